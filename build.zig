@@ -93,6 +93,7 @@ const Builder = struct {
             self.b.path("res/xdg-shell.xml"),
             self.b.path("res/xdg-decoration-unstable-v1.xml"),
             self.b.path("res/linux-dmabuf-v1.xml"),
+            self.b.path("res/presentation-time.xml"),
         });
     }
 
@@ -240,6 +241,35 @@ const Builder = struct {
         return exe;
     }
 
+    pub fn makeObjectTableBench(self: Builder) *std.Build.Step.Compile {
+        return self.b.addExecutable(.{
+            .name = "object_table_bench",
+            .root_module = self.b.createModule(.{
+                .root_source_file = self.b.path("src/sphwim/wayland/object_table_bench.zig"),
+                .target = self.target,
+                .optimize = self.optimize,
+            }),
+        });
+    }
+
+    pub fn makeReadPoolBench(self: Builder, wlio: *std.Build.Module, bindings: *std.Build.Module, sphtud: *std.Build.Module, wl_cmsg: *std.Build.Module) *std.Build.Step.Compile {
+        const exe = self.b.addExecutable(.{
+            .name = "read_pool_bench",
+            .root_module = self.b.createModule(.{
+                .root_source_file = self.b.path("src/sphwim/wayland/read_pool_bench.zig"),
+                .target = self.target,
+                .optimize = self.optimize,
+            }),
+        });
+
+        exe.root_module.addImport("wlio", wlio);
+        exe.root_module.addImport("wayland_bindings", bindings);
+        exe.root_module.addImport("sphtud", sphtud);
+        exe.root_module.addImport("wl_cmsg", wl_cmsg);
+
+        return exe;
+    }
+
     fn translateCFixed(self: Builder, path: []const u8) !*std.Build.Step.TranslateC {
         const window_translate_c_bindings = self.b.addTranslateC(.{
             .root_source_file = self.b.path(path),
@@ -279,12 +309,25 @@ pub fn build(b: *std.Build) !void {
 
     const server_bindings = builder.makeServerBindings(wlgen, wlio_mod);
     const wm = try builder.makeWm(wlio_mod, server_bindings, sphtud, wl_cmsg, sphwindow);
+    const object_table_bench = builder.makeObjectTableBench();
+    const read_pool_bench = builder.makeReadPoolBench(wlio_mod, server_bindings, sphtud, wl_cmsg);
+
+    const bench_step = b.step("bench", "Run benchmarks");
+    bench_step.dependOn(&b.addRunArtifact(object_table_bench).step);
+    bench_step.dependOn(&b.addRunArtifact(read_pool_bench).step);
+
+    const wm_tests = b.addTest(.{ .root_module = wm.root_module });
+    const test_step = b.step("test", "Run unit tests");
+    test_step.dependOn(&b.addRunArtifact(wm_tests).step);
 
     if (check) {
         b.getInstallStep().dependOn(&example.step);
         b.getInstallStep().dependOn(&wm.step);
         b.getInstallStep().dependOn(&wlgen.step);
         b.getInstallStep().dependOn(&wait_for_wl.step);
+        b.getInstallStep().dependOn(&object_table_bench.step);
+        b.getInstallStep().dependOn(&read_pool_bench.step);
+        b.getInstallStep().dependOn(&wm_tests.step);
     } else {
         b.installArtifact(example);
         b.installArtifact(wm);
@@ -5,18 +5,254 @@ const rendering = @import("rendering.zig");
 const FdPool = @import("FdPool.zig");
 const builtin = @import("builtin");
 const geometry = @import("geometry.zig");
+const cursor_img = @import("cursor.zig");
+const InputQueue = @import("InputQueue.zig");
 
 scratch: *sphtud.alloc.BufAllocator,
+// Bounding box of all outputs
 compositor_res: rendering.Resolution,
+// Laid out left to right, allocated once at init
+outputs: []Output,
 drag_state: DragState,
 cursor_pos: CursorPos,
 renderables: Renderables,
+// Written whenever a frame gets scheduled, render backends wait on this
+// instead of rendering continuously so that an idle desktop costs nothing
+frame_event: std.posix.fd_t,
+// Paces frame callbacks for surfaces nobody can see, which do not get to
+// make an output render. See hiddenFrameHandler()
+hidden_frame_timer: std.posix.fd_t,
+hidden_frame_timer_armed: bool = false,
+// Set by backends that can put the cursor on screen without us drawing it
+hardware_cursor: ?HardwareCursor = null,
+// Pointer input read off the main thread, applied at most once a frame. See
+// notifyInputQueued()
+input_queue: ?*InputQueue = null,
+// Recent cursor positions and when the input behind them happened, for
+// predicting where the cursor will be once a frame reaches the screen
+cursor_history: CursorHistory = .{},
+// Off with SPHWIM_NO_CURSOR_PREDICTION, frames then show the cursor where the
+// latest input put it
+predict_cursor: bool = true,
+// The hardware cursor was last moved to a predicted position rather than the
+// real one
+hw_cursor_predicted: bool = false,
+
+pub const HardwareCursor = struct {
+    ctx: ?*anyopaque,
+    // Called from input handling, position is the top left of the cursor
+    // image in output pixels
+    move: *const fn (ctx: ?*anyopaque, x: i32, y: i32) void,
+};
+
+pub const ScanoutLock = struct {
+    source_info: SourceInfo,
+    buffer: wayland.Connection.WlBufferId,
+
+    fn eql(self: ScanoutLock, other: ScanoutLock) bool {
+        return self.source_info.connection == other.source_info.connection and
+            self.source_info.surface.inner == other.source_info.surface.inner and
+            self.buffer.inner == other.buffer.inner;
+    }
+
+    fn release(self: ScanoutLock) void {
+        self.source_info.connection.releaseScanoutBuffer(self.source_info.surface, self.buffer);
+    }
+};
+
+// When and how a frame reached the screen, handed to clients with their frame
+// callbacks and presentation feedback
+pub const Presentation = struct {
+    // CLOCK_MONOTONIC nanoseconds
+    time_ns: u64,
+    // Zero if the output has no fixed refresh rate, or we do not know it
+    refresh_ns: u32 = 0,
+    // Vertical retrace counter, zero if there is none
+    seq: u64 = 0,
+    // Flipped at vblank, so no tearing
+    vsync: bool = false,
+    // Timestamp came from the display hardware, not from us looking at the
+    // clock after the fact
+    hw_timestamp: bool = false,
+
+    // For backends without display timing, stamped when called
+    pub fn now() Presentation {
+        return .{ .time_ns = monotonicNs() };
+    }
+};
+
+pub fn monotonicNs() u64 {
+    // Only fails for clocks the kernel does not have
+    const ts = std.posix.clock_gettime(.MONOTONIC) catch unreachable;
+    return @as(u64, @intCast(ts.sec)) * std.time.ns_per_s + @as(u64, @intCast(ts.nsec));
+}
+
+// Each output is rendered and paced on its own, so everything that decides
+// whether and what to draw is tracked per output
+pub const Output = struct {
+    // Where the output sits in the space windows and the cursor live in
+    rect: geometry.Rect,
+    // Pixels that changed since the last render, in global coordinates
+    damage: geometry.Damage = .{},
+    frame_scheduled: bool = false,
+    // Client buffers handed to the display directly. The client must not
+    // get them back until the display has moved on to something else
+    scanout: ScanoutLocks = .{},
+    last_presentation: ?Presentation = null,
+    // Measured between consecutive vblanks where the backend numbers them,
+    // otherwise whatever the backend reported. Zero if unknown
+    refresh_ns: u64 = 0,
+
+    fn notePresentation(self: *Output, presentation: Presentation) void {
+        defer self.last_presentation = presentation;
+        self.refresh_ns = presentation.refresh_ns;
+
+        const last = self.last_presentation orelse return;
+        if (!presentation.hw_timestamp or last.seq == 0) return;
+        if (presentation.seq <= last.seq or presentation.time_ns <= last.time_ns) return;
+        self.refresh_ns = (presentation.time_ns - last.time_ns) / (presentation.seq - last.seq);
+    }
+
+    // When a frame rendered now should reach the screen. Without a refresh
+    // interval we cannot tell, and say now
+    fn predictPresentNs(self: *const Output, now: u64) u64 {
+        const last = self.last_presentation orelse return now;
+        if (self.refresh_ns == 0 or last.time_ns > now) return now;
+
+        const intervals = (now - last.time_ns) / self.refresh_ns + 1;
+        return last.time_ns + intervals * self.refresh_ns;
+    }
+};
+
+// One per plane a client buffer can be put on
+pub const max_scanout_buffers = 8;
+
+// Rate frame callbacks go out at for surfaces that are covered, or off every
+// output. Enough to keep clients that block on them responsive, without them
+// rendering frames for nobody
+pub const hidden_frame_interval_ns = std.time.ns_per_s;
+
+// Pieces a surface's visible region is tracked in while working out whether
+// it is hidden. Past this we give up and call it visible
+const max_visible_rects = 32;
+
+const ScanoutLocks = struct {
+    // Queued with a flip that has not completed yet
+    pending: LockList = .{},
+    // On screen right now
+    displayed: LockList = .{},
+
+    const LockList = struct {
+        items: [max_scanout_buffers]ScanoutLock = undefined,
+        len: usize = 0,
+
+        fn slice(self: *const LockList) []const ScanoutLock {
+            return self.items[0..self.len];
+        }
+
+        fn contains(self: *const LockList, needle: ScanoutLock) bool {
+            for (self.slice()) |l| {
+                if (l.eql(needle)) return true;
+            }
+            return false;
+        }
+
+        fn removeSurface(self: *LockList, source_info: SourceInfo) void {
+            var i: usize = 0;
+            while (i < self.len) {
+                const l = self.items[i].source_info;
+                if (l.connection == source_info.connection and l.surface.inner == source_info.surface.inner) {
+                    self.len -= 1;
+                    self.items[i] = self.items[self.len];
+                } else {
+                    i += 1;
+                }
+            }
+        }
+    };
+};
 
 const CursorPos = struct {
     x: f32,
     y: f32,
 };
 
+const CursorHistory = struct {
+    samples: [capacity]Sample = undefined,
+    // Total ever pushed, the newest sample is at (count - 1) % capacity
+    count: usize = 0,
+
+    const capacity = 8;
+
+    // Velocity is measured over at most this much of the newest history
+    const velocity_window_ns = 50 * std.time.ns_per_ms;
+    // Less than this between samples and the velocity is mostly noise
+    const min_velocity_span_ns = 4 * std.time.ns_per_ms;
+    // No input for this long and the pointer is taken to have stopped
+    const max_sample_age_ns = 40 * std.time.ns_per_ms;
+    // Cap on how far ahead we extrapolate, overshoot when the pointer
+    // stops grows with it
+    const max_lookahead_ns = 20 * std.time.ns_per_ms;
+
+    const Sample = struct {
+        time_ns: u64,
+        pos: CursorPos,
+    };
+
+    fn push(self: *CursorHistory, sample: Sample) void {
+        self.samples[self.count % capacity] = sample;
+        self.count += 1;
+    }
+
+    // age 0 is the newest sample
+    fn get(self: *const CursorHistory, age: usize) ?Sample {
+        if (age >= @min(self.count, capacity)) return null;
+        return self.samples[(self.count - 1 - age) % capacity];
+    }
+
+    // Linear extrapolation of the recent motion to target_ns, null when
+    // there is nothing to extrapolate
+    fn predict(self: *const CursorHistory, target_ns: u64, now_ns: u64) ?CursorPos {
+        const newest = self.get(0) orelse return null;
+        if (now_ns -| newest.time_ns > max_sample_age_ns) return null;
+        if (target_ns <= newest.time_ns) return null;
+
+        var from: ?Sample = null;
+        var age: usize = 1;
+        while (self.get(age)) |sample| : (age += 1) {
+            if (sample.time_ns > newest.time_ns) break;
+            if (newest.time_ns - sample.time_ns > velocity_window_ns) break;
+            from = sample;
+        }
+
+        const base = from orelse return null;
+        const span = newest.time_ns - base.time_ns;
+        if (span < min_velocity_span_ns) return null;
+
+        const lookahead = @min(target_ns - newest.time_ns, max_lookahead_ns);
+        const scale = asf32(lookahead) / asf32(span);
+        return .{
+            .x = newest.pos.x + (newest.pos.x - base.pos.x) * scale,
+            .y = newest.pos.y + (newest.pos.y - base.pos.y) * scale,
+        };
+    }
+};
+
+// Where to draw the cursor, and the window dragged with it, in a frame that is
+// about to be rendered
+pub const CursorLatch = struct {
+    pos: CursorPos,
+    // Drawn moved along with the cursor, null if there is nothing to move
+    dragged: ?Renderables.Handle = null,
+    // Predicted minus actual cursor position, whole pixels
+    dx: i32 = 0,
+    dy: i32 = 0,
+
+    pub fn isDisplaced(self: CursorLatch) bool {
+        return self.dx != 0 or self.dy != 0;
+    }
+};
+
 const DragState = union(enum) {
     moving_window: struct {
         id: Renderables.Handle,
@@ -27,24 +263,300 @@ const DragState = union(enum) {
 
 const CompositorState = @This();
 
-pub fn init(alloc: *sphtud.alloc.Sphalloc, scratch: *sphtud.alloc.BufAllocator, random: std.Random, current_res: rendering.Resolution) !CompositorState {
-    return .{
+pub fn init(alloc: *sphtud.alloc.Sphalloc, scratch: *sphtud.alloc.BufAllocator, random: std.Random, output_resolutions: []const rendering.Resolution) !CompositorState {
+    std.debug.assert(output_resolutions.len > 0);
+
+    const outputs = try alloc.arena().alloc(Output, output_resolutions.len);
+
+    var compositor_res = rendering.Resolution{ .width = 0, .height = 0 };
+    for (outputs, output_resolutions) |*output, res| {
+        output.* = .{
+            .rect = .{
+                .x = @intCast(compositor_res.width),
+                .y = 0,
+                .width = @intCast(res.width),
+                .height = @intCast(res.height),
+            },
+        };
+        compositor_res.width += res.width;
+        compositor_res.height = @max(compositor_res.height, res.height);
+    }
+
+    const primary = outputs[0].rect;
+
+    var ret = CompositorState{
         .scratch = scratch,
-        .compositor_res = current_res,
+        .frame_event = try std.posix.eventfd(0, std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC),
+        .hidden_frame_timer = try std.posix.timerfd_create(.MONOTONIC, .{ .CLOEXEC = true, .NONBLOCK = true }),
+        .compositor_res = compositor_res,
+        .outputs = outputs,
         .cursor_pos = .{
-            .x = @floatFromInt(current_res.width / 2),
-            .y = @floatFromInt(current_res.height / 2),
+            .x = @floatFromInt(primary.x + @divTrunc(primary.width, 2)),
+            .y = @floatFromInt(primary.y + @divTrunc(primary.height, 2)),
         },
         .drag_state = .none,
         .renderables = try .init(alloc, scratch.linear(), random),
     };
+
+    for (outputs) |output| {
+        ret.addDamage(output.rect);
+    }
+    return ret;
+}
+
+// Mark that the next render of an output has something to show. Cheap to call
+// repeatedly, only the first call per frame wakes the backend
+fn scheduleFrame(self: *CompositorState, output_idx: usize) void {
+    const output = &self.outputs[output_idx];
+    if (output.frame_scheduled) return;
+    output.frame_scheduled = true;
+
+    const val: u64 = 1;
+    _ = std.posix.write(self.frame_event, std.mem.asBytes(&val)) catch |e| {
+        std.log.err("failed to signal frame event: {t}", .{e});
+    };
 }
 
-pub fn requestFrame(self: *CompositorState) !void {
+// A frame on whichever outputs show the renderable, so that its frame
+// callback gets sent even if nothing on screen changed. Hidden renderables
+// wait for the hidden frame timer instead
+pub fn scheduleRenderableFrame(self: *CompositorState, handle: Renderables.Handle) void {
+    if (self.isHidden(handle)) {
+        self.armHiddenFrameTimer();
+        return;
+    }
+
+    const bounds = geometry.WindowBorder.fromRenderable(self.renderables.storage.get(handle).*).bounds();
+    for (self.outputs, 0..) |output, i| {
+        if (output.rect.intersect(bounds).isEmpty()) continue;
+        self.scheduleFrame(i);
+    }
+}
+
+// True if no part of the renderable can be seen on any output. Only windows
+// with opaque surfaces hide what is under them. Cost is quadratic in the
+// number of windows, which stays small
+fn isHidden(self: *CompositorState, handle: Renderables.Handle) bool {
+    const bounds = geometry.WindowBorder.fromRenderable(self.renderables.storage.get(handle).*).bounds();
+
+    var visible: [max_visible_rects]geometry.Rect = undefined;
+    var num_visible: usize = 0;
+    for (self.outputs) |output| {
+        const on_output = output.rect.intersect(bounds);
+        if (on_output.isEmpty()) continue;
+        if (num_visible == max_visible_rects) return false;
+        visible[num_visible] = on_output;
+        num_visible += 1;
+    }
+
+    // Front to back, so everything before the renderable is on top of it
     var it = self.renderables.storage.iter();
     while (it.next()) |item| {
+        if (num_visible == 0) return true;
+        if (item.handle.inner == handle.inner) return false;
+        if (!item.val.buffer.is_opaque) continue;
+
+        const cover = geometry.WindowBorder.fromRenderable(item.val.*).coverage();
+
+        var remaining: [max_visible_rects]geometry.Rect = undefined;
+        var num_remaining: usize = 0;
+        for (visible[0..num_visible]) |rect| {
+            const pieces = rect.subtract(cover);
+            if (num_remaining + pieces.len > max_visible_rects) return false;
+            @memcpy(remaining[num_remaining..][0..pieces.len], pieces.slice());
+            num_remaining += pieces.len;
+        }
+
+        visible = remaining;
+        num_visible = num_remaining;
+    }
+
+    return num_visible == 0;
+}
+
+fn armHiddenFrameTimer(self: *CompositorState) void {
+    if (self.hidden_frame_timer_armed) return;
+
+    const spec = std.posix.system.itimerspec{
+        .it_value = .{
+            .sec = hidden_frame_interval_ns / std.time.ns_per_s,
+            .nsec = hidden_frame_interval_ns % std.time.ns_per_s,
+        },
+        .it_interval = .{ .sec = 0, .nsec = 0 },
+    };
+    std.posix.timerfd_settime(self.hidden_frame_timer, .{}, &spec, null) catch |e| {
+        std.log.err("failed to arm hidden frame timer: {t}", .{e});
+        return;
+    };
+    self.hidden_frame_timer_armed = true;
+}
+
+pub fn hiddenFrameHandler(self: *CompositorState) sphtud.event.Loop.Handler {
+    return .{
+        .ptr = self,
+        .fd = self.hidden_frame_timer,
+        .vtable = &hidden_frame_vtable,
+        .desired_events = .{
+            .read = true,
+            .write = false,
+        },
+    };
+}
+
+const hidden_frame_vtable = sphtud.event.Loop.Handler.VTable{
+    .poll = pollHiddenFrame,
+    .close = closeHiddenFrame,
+};
+
+fn pollHiddenFrame(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+    const self: *CompositorState = @ptrCast(@alignCast(ctx));
+    self.pollHiddenFrameError() catch |e| {
+        std.log.err("hidden frame timer failed: {t}", .{e});
+        return .complete;
+    };
+    return .in_progress;
+}
+
+fn pollHiddenFrameError(self: *CompositorState) !void {
+    var expirations: u64 = 0;
+    _ = try std.posix.read(self.hidden_frame_timer, std.mem.asBytes(&expirations));
+    self.hidden_frame_timer_armed = false;
+
+    const now = monotonicNs();
+
+    var it = self.renderables.storage.iter();
+    while (it.next()) |item| {
+        if (!self.isHidden(item.handle)) continue;
+
+        // The timer is shared by every client, one that cannot take its
+        // callback must not stop the others from getting theirs. A failed
+        // write means the client is gone, its connection cleans up the next
+        // time it is polled
         const si = item.val.source_info;
-        try si.connection.requestFrame(si.surface);
+        si.connection.requestFrame(si.surface, now) catch |e| {
+            std.log.warn("failed to send hidden frame callback: {t}", .{e});
+        };
+    }
+
+    self.flushFrameEvents();
+}
+
+fn closeHiddenFrame(ctx: ?*anyopaque) void {
+    const self: *CompositorState = @ptrCast(@alignCast(ctx));
+    std.posix.close(self.hidden_frame_timer);
+}
+
+pub fn wantsFrame(self: *const CompositorState, output_idx: usize) bool {
+    return self.outputs[output_idx].frame_scheduled;
+}
+
+// Called by the backend when frame_event is readable
+pub fn consumeFrameEvent(self: *CompositorState) void {
+    var val: u64 = 0;
+    _ = std.posix.read(self.frame_event, std.mem.asBytes(&val)) catch {};
+}
+
+fn addDamage(self: *CompositorState, rect: geometry.Rect) void {
+    for (self.outputs, 0..) |*output, i| {
+        if (output.rect.intersect(rect).isEmpty()) continue;
+        output.damage.add(rect);
+        self.scheduleFrame(i);
+    }
+}
+
+// Called by the backend after queueing a flip to a client buffer
+pub fn lockScanout(self: *CompositorState, output_idx: usize, lock: ScanoutLock) void {
+    const pending = &self.outputs[output_idx].scanout.pending;
+    std.debug.assert(pending.len < max_scanout_buffers);
+    pending.items[pending.len] = lock;
+    pending.len += 1;
+}
+
+// Called by the backend whenever a flip completes, whether it was to a client
+// buffer or to one of ours
+pub fn notifyFlipComplete(self: *CompositorState, output_idx: usize) void {
+    const scanout = &self.outputs[output_idx].scanout;
+
+    const prev = scanout.displayed;
+    scanout.displayed = scanout.pending;
+    scanout.pending = .{};
+
+    for (prev.slice()) |lock| {
+        // Flipping to the same buffer again, or another output still shows it
+        if (self.isLocked(lock)) continue;
+        lock.release();
+    }
+}
+
+pub fn isScanoutLocked(self: *const CompositorState, connection: *wayland.Connection, surface: wayland.Connection.WlSurfaceId, buffer: wayland.Connection.WlBufferId) bool {
+    const needle = ScanoutLock{
+        .source_info = .{
+            .connection = connection,
+            .surface = surface,
+        },
+        .buffer = buffer,
+    };
+
+    return self.isLocked(needle);
+}
+
+fn isLocked(self: *const CompositorState, lock: ScanoutLock) bool {
+    for (self.outputs) |output| {
+        if (output.scanout.pending.contains(lock) or output.scanout.displayed.contains(lock)) return true;
+    }
+    return false;
+}
+
+// The output's next frame has been fixed, whatever visible surfaces it shows
+// have had their current content put on screen. Surfaces in direct were
+// handed to the display as they are instead of being composited
+pub fn latchFrame(self: *CompositorState, output_idx: usize, direct: []const Renderables.Handle) !void {
+    var it = self.renderables.storage.iter();
+    while (it.next()) |item| {
+        const bounds = geometry.WindowBorder.fromRenderable(item.val.*).bounds();
+        if (self.outputs[output_idx].rect.intersect(bounds).isEmpty()) continue;
+        // Content nobody sees is not presented, its feedback is discarded
+        // once it gets superseded
+        if (self.isHidden(item.handle)) continue;
+
+        const zero_copy = for (direct) |h| {
+            if (h.inner == item.handle.inner) break true;
+        } else false;
+
+        const si = item.val.source_info;
+        try si.connection.latchPresentation(si.surface, zero_copy);
+    }
+}
+
+// Presentation feedback for every surface the output shows, and frame
+// callbacks for the ones that can be seen. Hidden surfaces are left to the
+// hidden frame timer
+pub fn requestFrame(self: *CompositorState, output_idx: usize, presentation: Presentation) !void {
+    self.outputs[output_idx].notePresentation(presentation);
+
+    var it = self.renderables.storage.iter();
+    while (it.next()) |item| {
+        const bounds = geometry.WindowBorder.fromRenderable(item.val.*).bounds();
+        if (self.outputs[output_idx].rect.intersect(bounds).isEmpty()) continue;
+
+        const si = item.val.source_info;
+        try si.connection.presentFeedback(si.surface, presentation);
+
+        if (self.isHidden(item.handle)) {
+            self.armHiddenFrameTimer();
+            continue;
+        }
+        try si.connection.requestFrame(si.surface, presentation.time_ns);
+    }
+
+    self.flushFrameEvents();
+}
+
+// Send everything for the frame with one write per client
+fn flushFrameEvents(self: *CompositorState) void {
+    var it = self.renderables.storage.iter();
+    while (it.next()) |item| {
+        item.val.source_info.connection.flushFrameEvents();
     }
 }
 
@@ -56,26 +568,176 @@ pub fn notifyCursorMovement(self: *CompositorState, dx: f32, dy: f32) void {
 }
 
 pub fn notifyCursorPosition(self: *CompositorState, x: f32, y: f32) void {
-    self.cursor_pos.x = std.math.clamp(x, 0, asf32(self.compositor_res.width));
-    self.cursor_pos.y = std.math.clamp(y, 0, asf32(self.compositor_res.height));
+    self.moveCursor(x, y, monotonicNs());
+}
+
+fn moveCursor(self: *CompositorState, x: f32, y: f32, time_ns: u64) void {
+    if (self.hardware_cursor == null) self.addDamage(self.cursorBounds());
+
+    self.cursor_pos = self.clampCursor(.{ .x = x, .y = y });
+    self.cursor_history.push(.{ .time_ns = time_ns, .pos = self.cursor_pos });
+
+    if (self.hardware_cursor) |hw| {
+        // Goes to the display straight away, no frame needed
+        hw.move(hw.ctx, @intFromFloat(self.cursor_pos.x), @intFromFloat(self.cursor_pos.y));
+        self.hw_cursor_predicted = false;
+    } else {
+        self.addDamage(self.cursorBounds());
+    }
 
     switch (self.drag_state) {
         .moving_window => |*params| {
             const renderable = self.renderables.storage.get(params.id);
+            self.addDamage(geometry.WindowBorder.fromRenderable(renderable.*).bounds());
+
             renderable.cx += @intFromFloat(self.cursor_pos.x - params.last.x);
             renderable.cy += @intFromFloat(self.cursor_pos.y - params.last.y);
             params.last = self.cursor_pos;
+
+            self.addDamage(geometry.WindowBorder.fromRenderable(renderable.*).bounds());
         },
         .none => {},
     }
 }
 
+// Called when the input queue wakes us. While a frame is on its way the input
+// stays queued, and gets applied in one go when that frame starts. The queue
+// does not wake us again until then
+pub fn notifyInputQueued(self: *CompositorState) void {
+    for (self.outputs) |output| {
+        if (output.frame_scheduled) return;
+    }
+
+    self.applyQueuedInput();
+}
+
+// Folds everything queued into a single cursor update
+fn applyQueuedInput(self: *CompositorState) void {
+    const queue = self.input_queue orelse return;
+    queue.beginDrain();
+
+    var absolute: ?CursorPos = null;
+    var dx: f32 = 0;
+    var dy: f32 = 0;
+    var time_us: ?u64 = null;
+
+    while (queue.pop()) |event| {
+        time_us = event.time_us;
+        switch (event.kind) {
+            .motion => |m| {
+                dx += m.dx;
+                dy += m.dy;
+            },
+            .motion_absolute => |m| {
+                // Earlier relative motion is superseded
+                absolute = .{ .x = m.x, .y = m.y };
+                dx = 0;
+                dy = 0;
+            },
+        }
+    }
+
+    const newest_us = time_us orelse return;
+
+    const base = absolute orelse self.cursor_pos;
+    self.moveCursor(base.x + dx, base.y + dy, newest_us * std.time.ns_per_us);
+}
+
+// Called by the renderer right after takeDamage(). With prediction on, the
+// cursor and anything dragged with it are drawn where the recent motion says
+// they will be when the frame reaches the screen, rather than where the last
+// input left them
+pub fn latchCursor(self: *CompositorState, output_idx: usize) CursorLatch {
+    var latch = CursorLatch{ .pos = self.cursor_pos };
+    defer self.moveHardwareCursor(latch);
+
+    if (!self.predict_cursor) return latch;
+
+    const now = monotonicNs();
+    const target = self.outputs[output_idx].predictPresentNs(now);
+    const predicted = self.cursor_history.predict(target, now) orelse return latch;
+
+    latch.pos = self.clampCursor(predicted);
+    latch.dx = @intFromFloat(@round(latch.pos.x - self.cursor_pos.x));
+    latch.dy = @intFromFloat(@round(latch.pos.y - self.cursor_pos.y));
+    if (!latch.isDisplaced()) return latch;
+
+    switch (self.drag_state) {
+        .moving_window => |params| latch.dragged = params.id,
+        .none => {},
+    }
+
+    // The prediction only holds while the pointer keeps moving, the frame
+    // after it stops has to put everything back where it really is
+    self.scheduleFrame(output_idx);
+    return latch;
+}
+
+fn moveHardwareCursor(self: *CompositorState, latch: CursorLatch) void {
+    const hw = self.hardware_cursor orelse return;
+    if (!latch.isDisplaced() and !self.hw_cursor_predicted) return;
+
+    hw.move(hw.ctx, @intFromFloat(latch.pos.x), @intFromFloat(latch.pos.y));
+    self.hw_cursor_predicted = latch.isDisplaced();
+}
+
+fn clampCursor(self: *const CompositorState, pos: CursorPos) CursorPos {
+    return .{
+        .x = std.math.clamp(pos.x, 0, asf32(self.compositor_res.width)),
+        .y = std.math.clamp(pos.y, 0, asf32(self.compositor_res.height)),
+    };
+}
+
+pub fn setHardwareCursor(self: *CompositorState, hw: HardwareCursor) void {
+    self.hardware_cursor = hw;
+    hw.move(hw.ctx, @intFromFloat(self.cursor_pos.x), @intFromFloat(self.cursor_pos.y));
+
+    // Clear out the last software drawn cursor
+    self.addDamage(self.cursorBounds());
+}
+
+// Everything on the output that changed since the last call, in global
+// coordinates. Called at the start of a render, which satisfies any
+// scheduled frame
+pub fn takeDamage(self: *CompositorState, output_idx: usize) geometry.Damage {
+    self.applyQueuedInput();
+
+    const output = &self.outputs[output_idx];
+    defer output.damage.clear();
+    output.frame_scheduled = false;
+    return output.damage;
+}
+
+// Swap the buffer shown for a renderable. Damage is in surface coordinates
+pub fn commitRenderableBuffer(self: *CompositorState, handle: Renderables.Handle, buffer: RenderableBuffer, surface_damage: []const geometry.Rect) void {
+    const renderable = self.renderables.storage.get(handle);
+
+    const resized = renderable.buffer.width != buffer.width or renderable.buffer.height != buffer.height;
+    if (resized) {
+        self.addDamage(geometry.WindowBorder.fromRenderable(renderable.*).bounds());
+    }
+
+    self.renderables.swapBuffer(handle, buffer);
+
+    const window_border = geometry.WindowBorder.fromRenderable(renderable.*);
+    if (resized) {
+        self.addDamage(window_border.bounds());
+        return;
+    }
+
+    const origin = window_border.surfaceOrigin();
+    for (surface_damage) |rect| {
+        const clamped = rect.clamp(buffer.width, buffer.height);
+        if (clamped.isEmpty()) continue;
+        self.addDamage(clamped.translate(origin.x, origin.y).pad(1));
+    }
+}
+
 pub fn pushRenderable(
     self: *CompositorState,
     connection: *wayland.Connection,
     surface: wayland.Connection.WlSurfaceId,
-    buffer: rendering.RenderBuffer,
-    buffer_id: wayland.Connection.WlBufferId,
+    buffer: RenderableBuffer,
 ) !Renderables.Handle {
     const item = try self.renderables.storage.acquire(self.renderables.expansion_alloc);
 
@@ -83,17 +745,28 @@ pub fn pushRenderable(
         .source_info = .{
             .connection = connection,
             .surface = surface,
-            .buffer_id = buffer_id,
         },
-        .cx = @intCast(self.compositor_res.width / 2),
-        .cy = @intCast(self.compositor_res.height / 2),
+        .cx = self.outputs[0].rect.x + @divTrunc(self.outputs[0].rect.width, 2),
+        .cy = self.outputs[0].rect.y + @divTrunc(self.outputs[0].rect.height, 2),
         .buffer = buffer,
     };
 
+    self.addDamage(geometry.WindowBorder.fromRenderable(item.val.*).bounds());
+
     return item.handle;
 }
 
 pub fn removeRenderable(self: *CompositorState, handle: Renderables.Handle) void {
+    const removed = self.renderables.storage.get(handle).*;
+    self.addDamage(geometry.WindowBorder.fromRenderable(removed).bounds());
+
+    // The surface is going away and takes its held buffers with it. The
+    // kernel keeps anything still on screen alive until we flip away from it
+    for (self.outputs) |*output| {
+        output.scanout.pending.removeSurface(removed.source_info);
+        output.scanout.displayed.removeSurface(removed.source_info);
+    }
+
     switch (self.drag_state) {
         .moving_window => |move_state| {
             if (move_state.id.inner == handle.inner) {
@@ -154,14 +827,28 @@ pub fn notifyMouse1Down(self: *CompositorState) void {
 pub const SourceInfo = struct {
     connection: *wayland.Connection,
     surface: wayland.Connection.WlSurfaceId,
-    buffer_id: wayland.Connection.WlBufferId,
+};
+
+pub const RenderableBuffer = struct {
+    id: wayland.Connection.WlBufferId,
+    width: i32,
+    height: i32,
+    // Only set for dma-buf backed buffers, shm contents are copied into the
+    // texture on commit
+    dmabuf: ?rendering.RenderBuffer,
+    // Set along with dmabuf, owned by the wl_buffer
+    dmabuf_user_data: ?*rendering.BufferUserData = null,
+    // Owned by the wl_buffer for dma-bufs, and by the wl_surface for shm
+    texture: rendering.BufferTexture,
+    // No alpha channel, hides whatever is under it
+    is_opaque: bool,
 };
 
 pub const Renderable = struct {
     source_info: SourceInfo,
     cx: i32,
     cy: i32,
-    buffer: rendering.RenderBuffer,
+    buffer: RenderableBuffer,
 };
 
 // Ties wayland surfaces that are ready to their renderable state
@@ -192,9 +879,8 @@ pub const Renderables = struct {
         };
     }
 
-    pub fn swapBuffer(self: *Renderables, handle: Renderables.Handle, new_buffer: rendering.RenderBuffer, new_buffer_id: wayland.Connection.WlBufferId) void {
+    pub fn swapBuffer(self: *Renderables, handle: Renderables.Handle, new_buffer: RenderableBuffer) void {
         const item = self.storage.get(handle);
-        item.source_info.buffer_id = new_buffer_id;
         item.buffer = new_buffer;
     }
 
@@ -237,6 +923,56 @@ pub const Renderables = struct {
     };
 };
 
+fn cursorBounds(self: *const CompositorState) geometry.Rect {
+    return cursorBoundsAt(self.cursor_pos);
+}
+
+pub fn cursorBoundsAt(pos: CursorPos) geometry.Rect {
+    return (geometry.Rect{
+        .x = @intFromFloat(pos.x),
+        .y = @intFromFloat(pos.y),
+        .width = cursor_img.width,
+        .height = cursor_img.height,
+    }).pad(1);
+}
+
 fn asf32(in: anytype) f32 {
     return @floatFromInt(in);
 }
+
+test "cursor history predict" {
+    const ms = std.time.ns_per_ms;
+    var history = CursorHistory{};
+
+    try std.testing.expectEqual(null, history.predict(10 * ms, 10 * ms));
+
+    // One sample says nothing about velocity
+    history.push(.{ .time_ns = 100 * ms, .pos = .{ .x = 0, .y = 0 } });
+    try std.testing.expectEqual(null, history.predict(110 * ms, 100 * ms));
+
+    history.push(.{ .time_ns = 110 * ms, .pos = .{ .x = 10, .y = 5 } });
+
+    // 1px and half a pixel per ms, 8ms on from the newest sample
+    const predicted = history.predict(118 * ms, 112 * ms).?;
+    try std.testing.expectApproxEqAbs(18, predicted.x, 0.001);
+    try std.testing.expectApproxEqAbs(9, predicted.y, 0.001);
+
+    // Lookahead is capped
+    const far = history.predict(500 * ms, 112 * ms).?;
+    try std.testing.expectApproxEqAbs(30, far.x, 0.001);
+    try std.testing.expectApproxEqAbs(15, far.y, 0.001);
+
+    // Nothing to extrapolate into the past
+    try std.testing.expectEqual(null, history.predict(105 * ms, 112 * ms));
+
+    // The pointer stopped
+    try std.testing.expectEqual(null, history.predict(170 * ms, 160 * ms));
+
+    // Samples outside the velocity window are not used
+    history.push(.{ .time_ns = 200 * ms, .pos = .{ .x = 10, .y = 5 } });
+    try std.testing.expectEqual(null, history.predict(210 * ms, 200 * ms));
+
+    // Too close together to be anything but noise
+    history.push(.{ .time_ns = 201 * ms, .pos = .{ .x = 20, .y = 5 } });
+    try std.testing.expectEqual(null, history.predict(210 * ms, 201 * ms));
+}
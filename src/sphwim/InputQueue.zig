@@ -0,0 +1,148 @@
+const std = @import("std");
+const SpscQueue = @import("wayland/SpscQueue.zig").SpscQueue;
+
+// Pointer input read on a thread of its own, handed to the compositor through
+// a lock-free ring. The compositor applies whatever has queued up in one go,
+// at the start of a frame or when it is woken with no frame coming
+const InputQueue = @This();
+
+const logger = std.log.scoped(.input_queue);
+
+pub const Event = struct {
+    // CLOCK_MONOTONIC, straight from the kernel's event
+    time_us: u64,
+    kind: union(enum) {
+        motion: struct { dx: f32, dy: f32 },
+        motion_absolute: struct { x: f32, y: f32 },
+    },
+};
+
+queue: SpscQueue(Event),
+// Readable once there is input the compositor has not been told about
+wake_event: std.posix.fd_t,
+// Set by the input thread when it writes wake_event, cleared by the
+// compositor when it drains. The input thread stays quiet in between, no
+// matter how fast the device reports
+signalled: std.atomic.Value(bool) = .init(false),
+// Input thread only. Whatever did not fit in the queue, merged into one event
+held: ?Event = null,
+
+// Over a hundred milliseconds of a 1000Hz mouse, the compositor drains it
+// every frame
+const capacity = 128;
+
+pub fn init(alloc: std.mem.Allocator) !InputQueue {
+    const wake_event = try std.posix.eventfd(0, std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC);
+    errdefer std.posix.close(wake_event);
+
+    return .{
+        .queue = try .init(alloc, capacity),
+        .wake_event = wake_event,
+    };
+}
+
+pub fn deinit(self: *InputQueue, alloc: std.mem.Allocator) void {
+    self.queue.deinit(alloc);
+    std.posix.close(self.wake_event);
+}
+
+// Input thread
+pub fn push(self: *InputQueue, event: Event) void {
+    if (self.held) |*held| {
+        if (!self.queue.push(held.*)) {
+            merge(held, event);
+            return;
+        }
+        self.held = null;
+    }
+
+    if (!self.queue.push(event)) self.held = event;
+    self.signal();
+}
+
+// Input thread, retries the held event. True if it is still held
+pub fn flushHeld(self: *InputQueue) bool {
+    const held = self.held orelse return false;
+    if (!self.queue.push(held)) return true;
+
+    self.held = null;
+    self.signal();
+    return false;
+}
+
+// Compositor side. The wakeup only says there is something, it is up to the
+// compositor when it drains
+pub fn consumeWake(self: *InputQueue) void {
+    var val: u64 = 0;
+    _ = std.posix.read(self.wake_event, std.mem.asBytes(&val)) catch {};
+}
+
+// Compositor side, before popping. Anything pushed after this wakes us again
+pub fn beginDrain(self: *InputQueue) void {
+    // A swap rather than a store, so that whatever the input thread pushed
+    // before it last set the flag is visible to the pops that follow
+    _ = self.signalled.swap(false, .acq_rel);
+}
+
+pub fn pop(self: *InputQueue) ?Event {
+    return self.queue.pop();
+}
+
+fn signal(self: *InputQueue) void {
+    if (self.signalled.swap(true, .acq_rel)) return;
+
+    const val: u64 = 1;
+    _ = std.posix.write(self.wake_event, std.mem.asBytes(&val)) catch |e| {
+        logger.err("failed to wake compositor for input: {t}", .{e});
+    };
+}
+
+fn merge(into: *Event, event: Event) void {
+    into.time_us = event.time_us;
+    switch (event.kind) {
+        .motion => |m| switch (into.kind) {
+            .motion => |*held| {
+                held.dx += m.dx;
+                held.dy += m.dy;
+            },
+            .motion_absolute => |*held| {
+                held.x += m.dx;
+                held.y += m.dy;
+            },
+        },
+        .motion_absolute => into.kind = event.kind,
+    }
+}
+
+test "input queue merges what does not fit" {
+    var queue = try InputQueue.init(std.testing.allocator);
+    defer queue.deinit(std.testing.allocator);
+
+    for (0..capacity) |i| {
+        queue.push(.{ .time_us = i, .kind = .{ .motion = .{ .dx = 1, .dy = 1 } } });
+    }
+    try std.testing.expectEqual(null, queue.held);
+
+    queue.push(.{ .time_us = 1000, .kind = .{ .motion = .{ .dx = 2, .dy = 3 } } });
+    queue.push(.{ .time_us = 1001, .kind = .{ .motion = .{ .dx = 4, .dy = 5 } } });
+    try std.testing.expectEqual(Event{ .time_us = 1001, .kind = .{ .motion = .{ .dx = 6, .dy = 8 } } }, queue.held.?);
+
+    // Absolute positions replace whatever motion came before them, motion
+    // after one moves it
+    queue.push(.{ .time_us = 1002, .kind = .{ .motion_absolute = .{ .x = 100, .y = 200 } } });
+    queue.push(.{ .time_us = 1003, .kind = .{ .motion = .{ .dx = 1, .dy = -2 } } });
+    const expected = Event{ .time_us = 1003, .kind = .{ .motion_absolute = .{ .x = 101, .y = 198 } } };
+    try std.testing.expectEqual(expected, queue.held.?);
+
+    try std.testing.expect(queue.flushHeld());
+
+    queue.beginDrain();
+    for (0..capacity) |i| {
+        try std.testing.expectEqual(i, queue.pop().?.time_us);
+    }
+    try std.testing.expectEqual(null, queue.pop());
+
+    try std.testing.expect(!queue.flushHeld());
+    try std.testing.expectEqual(expected, queue.pop().?);
+    try std.testing.expectEqual(null, queue.pop());
+}
@@ -0,0 +1,197 @@
+const std = @import("std");
+const sphtud = @import("sphtud");
+const CompositorState = @import("CompositorState.zig");
+
+// Runs handlers in order of how much their latency matters, rather than in
+// whatever order the loop finds them ready
+//
+// Handlers are registered with the loop through a wrapper that only queues
+// them when the loop reports them ready. Once the loop's wait returns,
+// dispatch() runs the queues a class at a time. Input goes first, so that a
+// frame composed in the same wakeup has the pointer where the user left it.
+// Then vblank work, then clients, then housekeeping
+const PriorityDispatch = @This();
+
+const logger = std.log.scoped(.priority_dispatch);
+
+pub const Class = enum {
+    input,
+    vblank,
+    clients,
+    housekeeping,
+
+    // Put off once a pass has run long, until the starvation guard kicks in
+    fn deferrable(self: Class) bool {
+        return switch (self) {
+            .input, .vblank => false,
+            .clients, .housekeeping => true,
+        };
+    }
+};
+
+pub const Registration = struct {
+    class: Class,
+    handler: sphtud.event.Loop.Handler,
+};
+
+ready: std.EnumArray(Class, std.DoublyLinkedList) = .initFill(.{}),
+// Consecutive passes each class has been put off for
+num_deferred: std.EnumArray(Class, u8) = .initFill(0),
+// Readable while work is left queued, so that the loop does not go to sleep
+// on it
+pending_event: std.posix.fd_t,
+
+// Past this, deferrable classes wait for the next pass. A quarter of a 60Hz
+// frame
+const max_pass_ns = 4 * std.time.ns_per_ms;
+// Starvation guard, a class put off this many passes in a row runs anyway
+const max_deferred_passes = 2;
+
+const pending_vtable = sphtud.event.Loop.Handler.VTable{
+    .poll = pollPending,
+    .close = closePending,
+};
+
+const wrapped_vtable = sphtud.event.Loop.Handler.VTable{
+    .poll = Wrapped.poll,
+    .close = Wrapped.close,
+};
+
+pub fn init() !PriorityDispatch {
+    return .{
+        .pending_event = try std.posix.eventfd(0, std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC),
+    };
+}
+
+// Registered with the loop as is, it only wakes the loop up
+pub fn handler(self: *PriorityDispatch) sphtud.event.Loop.Handler {
+    return .{
+        .ptr = self,
+        .fd = self.pending_event,
+        .vtable = &pending_vtable,
+        .desired_events = .{
+            .read = true,
+            .write = false,
+        },
+    };
+}
+
+// A handler for the loop that runs inner with the given class. The wrapper is
+// allocated with alloc, which has to outlive inner's close
+//
+// A poll that completes after being queued cannot tell the loop straight
+// away. The handler is closed the next time the loop reports it ready, so a
+// handler that completes has to leave its fd ready
+pub fn wrap(self: *PriorityDispatch, alloc: std.mem.Allocator, class: Class, inner: sphtud.event.Loop.Handler) !sphtud.event.Loop.Handler {
+    const wrapped = try alloc.create(Wrapped);
+    wrapped.* = .{
+        .dispatch = self,
+        .class = class,
+        .inner = inner,
+    };
+
+    return .{
+        .ptr = wrapped,
+        .fd = inner.fd,
+        .vtable = &wrapped_vtable,
+        .desired_events = inner.desired_events,
+    };
+}
+
+// After every wait of the loop
+pub fn dispatch(self: *PriorityDispatch) void {
+    const start_ns = CompositorState.monotonicNs();
+
+    var left_queued = false;
+    for (std.enums.values(Class)) |class| {
+        const num_deferred = self.num_deferred.getPtr(class);
+        if (self.ready.get(class).first == null) {
+            num_deferred.* = 0;
+            continue;
+        }
+
+        const over_budget = CompositorState.monotonicNs() - start_ns > max_pass_ns;
+        if (class.deferrable() and over_budget and num_deferred.* < max_deferred_passes) {
+            num_deferred.* += 1;
+            left_queued = true;
+            continue;
+        }
+
+        num_deferred.* = 0;
+        self.runClass(class);
+    }
+
+    if (left_queued) {
+        const val: u64 = 1;
+        _ = std.posix.write(self.pending_event, std.mem.asBytes(&val)) catch |e| {
+            logger.err("failed to signal deferred handlers: {t}", .{e});
+        };
+    }
+}
+
+fn runClass(self: *PriorityDispatch, class: Class) void {
+    // Only the loop's wait queues handlers, nothing is added while we run
+    const ready = self.ready.getPtr(class);
+    while (ready.popFirst()) |node| {
+        const wrapped: *Wrapped = @fieldParentPtr("node", node);
+        wrapped.queued = false;
+
+        const inner = wrapped.inner;
+        switch (inner.vtable.poll(inner.ptr, wrapped.loop, wrapped.reason)) {
+            .in_progress => {},
+            .complete => wrapped.finished = true,
+        }
+    }
+}
+
+fn pollPending(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+    const self: *PriorityDispatch = @ptrCast(@alignCast(ctx));
+    var val: u64 = 0;
+    _ = std.posix.read(self.pending_event, std.mem.asBytes(&val)) catch {};
+    return .in_progress;
+}
+
+fn closePending(ctx: ?*anyopaque) void {
+    const self: *PriorityDispatch = @ptrCast(@alignCast(ctx));
+    std.posix.close(self.pending_event);
+}
+
+const Wrapped = struct {
+    dispatch: *PriorityDispatch,
+    class: Class,
+    inner: sphtud.event.Loop.Handler,
+    node: std.DoublyLinkedList.Node = .{},
+    queued: bool = false,
+    // Inner completed from a queued poll, waiting for the loop to close it
+    finished: bool = false,
+    // From the poll that queued us, passed along to inner
+    loop: *sphtud.event.Loop = undefined,
+    reason: sphtud.event.PollReason = undefined,
+
+    fn poll(ctx: ?*anyopaque, loop: *sphtud.event.Loop, reason: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Wrapped = @ptrCast(@alignCast(ctx));
+        if (self.finished) return .complete;
+
+        // Registration is not a wakeup, there is nothing to order it against
+        if (reason == .init) return self.inner.vtable.poll(self.inner.ptr, loop, reason);
+
+        self.loop = loop;
+        self.reason = reason;
+        if (!self.queued) {
+            self.queued = true;
+            self.dispatch.ready.getPtr(self.class).append(&self.node);
+        }
+        return .in_progress;
+    }
+
+    fn close(ctx: ?*anyopaque) void {
+        const self: *Wrapped = @ptrCast(@alignCast(ctx));
+        if (self.queued) {
+            self.dispatch.ready.getPtr(self.class).remove(&self.node);
+        }
+
+        // May free us
+        const inner = self.inner;
+        inner.vtable.close(inner.ptr);
+    }
+};
@@ -2,6 +2,7 @@ const std = @import("std");
 const sphtud = @import("sphtud");
 const rendering = @import("rendering.zig");
 const CompositorState = @import("CompositorState.zig");
+const PriorityDispatch = @import("PriorityDispatch.zig");
 const SeatBackend = @import("backend/SeatBackend.zig");
 const WaylandBackend = @import("backend/WaylandBackend.zig");
 const NullBackend = @import("backend/NullBackend.zig");
@@ -10,17 +11,18 @@ const logger = std.log.scoped(.backend);
 
 pub const Backend = struct {
     preferred_gpu: []const u8,
-    initial_res: rendering.Resolution,
+    // One renderer gets made for each, in this order
+    outputs: []const rendering.Resolution,
     ctx: ?*anyopaque,
     vtable: *const VTable,
 
     const VTable = struct {
-        makeHandlers: *const fn (ctx: ?*anyopaque, alloc: std.mem.Allocator, renderer: *rendering.Renderer, compositor_state: *CompositorState) anyerror![]sphtud.event.Loop.Handler,
+        makeHandlers: *const fn (ctx: ?*anyopaque, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) anyerror![]PriorityDispatch.Registration,
         deinit: *const fn (ctx: ?*anyopaque) void,
     };
 
-    pub fn makeHandlers(self: Backend, alloc: std.mem.Allocator, renderer: *rendering.Renderer, compositor_state: *CompositorState) ![]sphtud.event.Loop.Handler {
-        return self.vtable.makeHandlers(self.ctx, alloc, renderer, compositor_state);
+    pub fn makeHandlers(self: Backend, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) ![]PriorityDispatch.Registration {
+        return self.vtable.makeHandlers(self.ctx, alloc, renderers, compositor_state);
     }
 
     pub fn deinit(self: Backend) void {
@@ -1,22 +1,210 @@
 const std = @import("std");
 const sphtud = @import("sphtud");
 const CompositorState = @import("../CompositorState.zig");
+const PriorityDispatch = @import("../PriorityDispatch.zig");
 const c = @cImport({
     @cInclude("xf86drm.h");
     @cInclude("xf86drmMode.h");
+    @cInclude("drm_fourcc.h");
 });
 
 const rendering = @import("../rendering.zig");
 const Drm = @This();
 const system_gl = @import("../system_gl.zig");
+const cursor_img = @import("../cursor.zig");
+const geometry = @import("../geometry.zig");
 
-crtc_id: u32,
 dri_file: std.fs.File,
-connector_id: u32,
-preferred_mode: c.drmModeModeInfo,
-crtc_set: bool = false,
-outstanding_buffer: ?system_gl.GbmContext.Buffer,
 preferred_gpu: []const u8,
+// One per connected display, laid out left to right in this order
+outputs: []Output,
+add_fb_method: AddFbMethod = .unknown,
+unscannable: Unscannable = .{},
+// Framebuffers of destroyed client buffers that are still on screen. Managed
+// with the c allocator, see ClientFb
+retired_fbs: std.ArrayList(u32) = .empty,
+// GEM handle of the dumb buffer holding the cursor image
+cursor_handle: ?u32 = null,
+// Set once any output failed to take the cursor, all of them fall back to
+// the software one then
+software_cursor: bool = false,
+// Flip timestamps are only comparable to our own clock if the kernel stamps
+// them with CLOCK_MONOTONIC
+monotonic_timestamps: bool,
+
+const Flip = struct {
+    composited: ?system_gl.GbmContext.Buffer = null,
+    client_fbs: ClientFbs = .{},
+};
+
+// Framebuffers wrapping client buffers that a flip puts on screen. They are
+// cached on the wl_buffer, see fbFromClientBuffer(), this only tracks what is
+// in use so that a destroyed buffer's framebuffer is not removed from under
+// its plane
+const ClientFbs = struct {
+    items: [CompositorState.max_scanout_buffers]u32 = undefined,
+    len: usize = 0,
+
+    fn append(self: *ClientFbs, fb_id: u32) void {
+        std.debug.assert(self.len < self.items.len);
+        self.items[self.len] = fb_id;
+        self.len += 1;
+    }
+
+    fn contains(self: *const ClientFbs, fb_id: u32) bool {
+        return std.mem.indexOfScalar(u32, self.items[0..self.len], fb_id) != null;
+    }
+};
+
+const Atomic = struct {
+    crtc: CrtcProps,
+    connector: ConnectorProps,
+    mode_blob: u32,
+    primary: Plane,
+    // Topmost first
+    overlays: [max_overlays]Plane,
+    num_overlays: usize,
+
+    // The primary plane takes one scanout slot
+    const max_overlays = CompositorState.max_scanout_buffers - 1;
+};
+
+const Plane = struct {
+    id: u32,
+    props: PlaneProps,
+};
+
+// Property ids, looked up by name
+const PlaneProps = struct {
+    fb_id: u32,
+    crtc_id: u32,
+    src_x: u32,
+    src_y: u32,
+    src_w: u32,
+    src_h: u32,
+    crtc_x: u32,
+    crtc_y: u32,
+    crtc_w: u32,
+    crtc_h: u32,
+};
+
+const CrtcProps = struct {
+    mode_id: u32,
+    active: u32,
+};
+
+const ConnectorProps = struct {
+    crtc_id: u32,
+};
+
+// What to show on a plane for one frame
+const PlaneState = struct {
+    fb_id: u32,
+    // Part of the framebuffer shown, in buffer pixels
+    src: geometry.Rect,
+    // Where it ends up on the output
+    dst: geometry.Rect,
+
+    fn fullOutput(fb_id: u32, output: geometry.Rect) PlaneState {
+        const rect = geometry.Rect{
+            .x = 0,
+            .y = 0,
+            .width = output.width,
+            .height = output.height,
+        };
+        return .{ .fb_id = fb_id, .src = rect, .dst = rect };
+    }
+
+    // Clipped to the output, null if none of the surface is visible on it
+    fn forSurface(fb_id: u32, renderable: CompositorState.Renderable, output: geometry.Rect) ?PlaneState {
+        const origin = geometry.WindowBorder.fromRenderable(renderable).surfaceOrigin();
+        const surface = (geometry.Rect{
+            .x = origin.x,
+            .y = origin.y,
+            .width = renderable.buffer.width,
+            .height = renderable.buffer.height,
+        }).translate(-output.x, -output.y);
+        const dst = surface.clamp(output.width, output.height);
+
+        if (dst.isEmpty()) return null;
+
+        return .{
+            .fb_id = fb_id,
+            .src = dst.translate(-surface.x, -surface.y),
+            .dst = dst,
+        };
+    }
+};
+
+// Client surfaces given a plane of their own this frame, topmost first
+const OverlayAssignment = struct {
+    planes: [Atomic.max_overlays]PlaneState = undefined,
+    handles: [Atomic.max_overlays]CompositorState.Renderables.Handle = undefined,
+    locks: [Atomic.max_overlays]CompositorState.ScanoutLock = undefined,
+    // Window including decorations, which are composited into the primary
+    // plane underneath every overlay
+    bounds: [Atomic.max_overlays]geometry.Rect = undefined,
+    len: usize = 0,
+
+    fn push(self: *OverlayAssignment, item: CompositorState.Renderable, handle: CompositorState.Renderables.Handle, plane: PlaneState) void {
+        self.planes[self.len] = plane;
+        self.handles[self.len] = handle;
+        self.bounds[self.len] = geometry.WindowBorder.fromRenderable(item).bounds();
+        self.locks[self.len] = .{
+            .source_info = item.source_info,
+            .buffer = item.buffer.id,
+        };
+        self.len += 1;
+    }
+
+    fn pop(self: *OverlayAssignment) void {
+        self.len -= 1;
+    }
+
+    fn overlaps(self: *const OverlayAssignment, rect: geometry.Rect) bool {
+        for (self.bounds[0..self.len]) |assigned| {
+            if (!assigned.intersect(rect).isEmpty()) return true;
+        }
+        return false;
+    }
+};
+
+// Format/modifier pairs the display refused. Clients tend to stick to one
+// buffer layout, remembering a few is enough to stop us paying for a failed
+// AddFB and flip every frame
+const Unscannable = struct {
+    items: [8]FormatModifier = undefined,
+    len: usize = 0,
+    // Oldest entry, overwritten when full
+    next: usize = 0,
+
+    const FormatModifier = struct {
+        format: u32,
+        modifier: u64,
+    };
+
+    fn contains(self: *const Unscannable, buffer: rendering.RenderBuffer) bool {
+        for (self.items[0..self.len]) |item| {
+            if (item.format == buffer.format and item.modifier == buffer.modifiers) return true;
+        }
+        return false;
+    }
+
+    fn add(self: *Unscannable, buffer: rendering.RenderBuffer) void {
+        self.items[self.next] = .{
+            .format = buffer.format,
+            .modifier = buffer.modifiers,
+        };
+        self.next = (self.next + 1) % self.items.len;
+        self.len = @min(self.len + 1, self.items.len);
+    }
+};
+
+const AddFbMethod = enum {
+    unknown,
+    with_modifiers,
+    without_modifiers,
+};
 
 pub fn init(alloc: std.mem.Allocator) !Drm {
     const best_gpu = try selectBestGPU(alloc);
@@ -28,109 +216,517 @@ pub fn init(alloc: std.mem.Allocator) !Drm {
     const resources: *c.drmModeRes = c.drmModeGetResources(f.handle) orelse return error.GetResourcers;
     defer c.drmModeFreeResources(resources);
 
-    const connector = getFirstConnectedConnector(f, resources) orelse return error.NoConnector;
-    defer c.drmModeFreeConnector(connector);
+    try drmErrCheck(c.drmSetMaster(f.handle), error.SetMaster);
 
-    // References connector memory
-    const preferred_mode = getPreferredMode(connector) orelse return error.NoMode;
+    const supports_atomic = c.drmSetClientCap(f.handle, c.DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) == 0 and
+        c.drmSetClientCap(f.handle, c.DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+    if (!supports_atomic) {
+        std.log.info("No atomic modesetting, using legacy API", .{});
+    }
 
-    const encoder: *c.drmModeEncoder = c.drmModeGetEncoder(f.handle, connector.encoder_id) orelse return error.NoEncoder;
-    defer c.drmModeFreeEncoder(encoder);
+    var monotonic_timestamps: u64 = 0;
+    if (c.drmGetCap(f.handle, c.DRM_CAP_TIMESTAMP_MONOTONIC, &monotonic_timestamps) != 0 or monotonic_timestamps == 0) {
+        std.log.info("Flip timestamps are not monotonic, rendering as soon as a frame is wanted", .{});
+    }
 
-    const crtc: *c.drmModeCrtc = c.drmModeGetCrtc(f.handle, encoder.crtc_id) orelse return error.NoEncoder;
-    defer c.drmModeFreeCrtc(crtc);
+    var outputs = std.ArrayList(Output).empty;
+    // Bitmask over resources.crtcs
+    var claimed_crtcs: u32 = 0;
+    // A plane can only feed one crtc at a time
+    var claimed_planes = std.ArrayList(u32).empty;
+    defer claimed_planes.deinit(alloc);
 
-    try drmErrCheck(c.drmSetMaster(f.handle), error.SetMaster);
+    for (resources.connectors[0..@intCast(resources.count_connectors)]) |connector_id| {
+        const connector: *c.drmModeConnector = c.drmModeGetConnector(f.handle, connector_id) orelse continue;
+        defer c.drmModeFreeConnector(connector);
 
-    try drmErrCheck(
-        c.drmModeSetCrtc(f.handle, crtc.crtc_id, 0, 0, 0, 0, 0, 0),
-        error.BlankScreen,
-    );
+        if (connector.connection != c.DRM_MODE_CONNECTED) continue;
+
+        // References connector memory
+        const preferred_mode = getPreferredMode(connector) orelse {
+            std.log.warn("Connector {d} has no preferred mode, skipping", .{connector_id});
+            continue;
+        };
+
+        const crtc_idx = pickCrtc(f.handle, resources, connector, claimed_crtcs) orelse {
+            std.log.warn("No free crtc for connector {d}, skipping", .{connector_id});
+            continue;
+        };
+        claimed_crtcs |= @as(u32, 1) << @intCast(crtc_idx);
+        const crtc_id = resources.crtcs[crtc_idx];
+
+        try drmErrCheck(
+            c.drmModeSetCrtc(f.handle, crtc_id, 0, 0, 0, 0, 0, 0),
+            error.BlankScreen,
+        );
+
+        const atomic = if (supports_atomic) initAtomic(alloc, f.handle, crtc_idx, crtc_id, connector_id, preferred_mode, &claimed_planes) catch |e| blk: {
+            std.log.info("No atomic modesetting on crtc {d} ({t}), using legacy API", .{ crtc_id, e });
+            break :blk null;
+        } else null;
+
+        try outputs.append(alloc, .{
+            .idx = outputs.items.len,
+            .crtc_id = crtc_id,
+            .connector_id = connector_id,
+            .preferred_mode = preferred_mode.*,
+            .atomic = atomic,
+            .deadline_timer = try std.posix.timerfd_create(.MONOTONIC, .{ .CLOEXEC = true, .NONBLOCK = true }),
+        });
+    }
+
+    if (outputs.items.len == 0) return error.NoConnector;
+    std.log.info("Driving {d} outputs", .{outputs.items.len});
 
     return .{
-        .crtc_id = crtc.crtc_id,
         .dri_file = f,
-        .connector_id = connector.connector_id,
-        .preferred_mode = preferred_mode.*,
-        .outstanding_buffer = null,
         .preferred_gpu = best_gpu,
+        .outputs = try outputs.toOwnedSlice(alloc),
+        .monotonic_timestamps = monotonic_timestamps != 0,
     };
 }
 
+fn initAtomic(
+    alloc: std.mem.Allocator,
+    dri_fd: std.posix.fd_t,
+    crtc_idx: usize,
+    crtc_id: u32,
+    connector_id: u32,
+    mode: *c.drmModeModeInfo,
+    claimed_planes: *std.ArrayList(u32),
+) !Atomic {
+    const plane_resources: *c.drmModePlaneRes = c.drmModeGetPlaneResources(dri_fd) orelse return error.GetPlanes;
+    defer c.drmModeFreePlaneResources(plane_resources);
+
+    const OverlayCandidate = struct {
+        plane: Plane,
+        zpos: u64,
+
+        fn higher(_: void, a: @This(), b: @This()) bool {
+            return a.zpos > b.zpos;
+        }
+    };
+
+    var primary: ?Plane = null;
+    var overlays: [Atomic.max_overlays]OverlayCandidate = undefined;
+    var num_overlays: usize = 0;
+
+    for (plane_resources.planes[0..plane_resources.count_planes]) |plane_id| {
+        const plane: *c.drmModePlane = c.drmModeGetPlane(dri_fd, plane_id) orelse continue;
+        defer c.drmModeFreePlane(plane);
+
+        if (plane.possible_crtcs & (@as(u32, 1) << @intCast(crtc_idx)) == 0) continue;
+        if (std.mem.indexOfScalar(u32, claimed_planes.items, plane_id) != null) continue;
+
+        const plane_type = getPropValue(dri_fd, plane_id, c.DRM_MODE_OBJECT_PLANE, "type") orelse continue;
+        switch (plane_type) {
+            c.DRM_PLANE_TYPE_PRIMARY => if (primary == null) {
+                primary = .{
+                    .id = plane_id,
+                    .props = try getPropIds(PlaneProps, dri_fd, plane_id, c.DRM_MODE_OBJECT_PLANE),
+                };
+            },
+            c.DRM_PLANE_TYPE_OVERLAY => if (num_overlays < overlays.len) {
+                overlays[num_overlays] = .{
+                    .plane = .{
+                        .id = plane_id,
+                        .props = try getPropIds(PlaneProps, dri_fd, plane_id, c.DRM_MODE_OBJECT_PLANE),
+                    },
+                    // Without zpos the stacking is up to the driver, plane
+                    // order is as good a guess as any
+                    .zpos = getPropValue(dri_fd, plane_id, c.DRM_MODE_OBJECT_PLANE, "zpos") orelse num_overlays,
+                };
+                num_overlays += 1;
+            },
+            // The cursor stays on the legacy cursor API, which can move it
+            // without waiting on a commit
+            else => {},
+        }
+    }
+
+    std.mem.sort(OverlayCandidate, overlays[0..num_overlays], {}, OverlayCandidate.higher);
+
+    var ret = Atomic{
+        .crtc = try getPropIds(CrtcProps, dri_fd, crtc_id, c.DRM_MODE_OBJECT_CRTC),
+        .connector = try getPropIds(ConnectorProps, dri_fd, connector_id, c.DRM_MODE_OBJECT_CONNECTOR),
+        .mode_blob = 0,
+        .primary = primary orelse return error.NoPrimaryPlane,
+        .overlays = undefined,
+        .num_overlays = num_overlays,
+    };
+
+    for (overlays[0..num_overlays], 0..) |overlay, i| {
+        ret.overlays[i] = overlay.plane;
+    }
+
+    try drmErrCheck(
+        c.drmModeCreatePropertyBlob(dri_fd, mode, @sizeOf(c.drmModeModeInfo), &ret.mode_blob),
+        error.CreateModeBlob,
+    );
+
+    try claimed_planes.append(alloc, ret.primary.id);
+    for (ret.overlays[0..num_overlays]) |overlay| {
+        try claimed_planes.append(alloc, overlay.id);
+    }
+
+    std.log.info("Atomic modesetting on crtc {d} with {d} overlay planes", .{ crtc_id, num_overlays });
+    return ret;
+}
+
+fn getPropIds(comptime Props: type, dri_fd: std.posix.fd_t, object_id: u32, object_type: u32) !Props {
+    const props: *c.drmModeObjectProperties = c.drmModeObjectGetProperties(dri_fd, object_id, object_type) orelse return error.GetProperties;
+    defer c.drmModeFreeObjectProperties(props);
+
+    const fields = @typeInfo(Props).@"struct".fields;
+
+    var ret: Props = undefined;
+    var found: [fields.len]bool = @splat(false);
+
+    for (props.props[0..props.count_props]) |prop_id| {
+        const prop: *c.drmModePropertyRes = c.drmModeGetProperty(dri_fd, prop_id) orelse continue;
+        defer c.drmModeFreeProperty(prop);
+
+        const name = std.mem.span(@as([*c]u8, @ptrCast(&prop.name)));
+        inline for (fields, 0..) |field, i| {
+            if (std.ascii.eqlIgnoreCase(field.name, name)) {
+                @field(ret, field.name) = prop_id;
+                found[i] = true;
+            }
+        }
+    }
+
+    for (found) |f| {
+        if (!f) return error.MissingProperty;
+    }
+
+    return ret;
+}
+
+fn getPropValue(dri_fd: std.posix.fd_t, object_id: u32, object_type: u32, wanted: []const u8) ?u64 {
+    const props: *c.drmModeObjectProperties = c.drmModeObjectGetProperties(dri_fd, object_id, object_type) orelse return null;
+    defer c.drmModeFreeObjectProperties(props);
+
+    for (props.props[0..props.count_props], props.prop_values[0..props.count_props]) |prop_id, val| {
+        const prop: *c.drmModePropertyRes = c.drmModeGetProperty(dri_fd, prop_id) orelse continue;
+        defer c.drmModeFreeProperty(prop);
+
+        const name = std.mem.span(@as([*c]u8, @ptrCast(&prop.name)));
+        if (std.mem.eql(u8, name, wanted)) return val;
+    }
+
+    return null;
+}
+
+fn addProp(req: *c.drmModeAtomicReq, object_id: u32, prop_id: u32, val: u64) !void {
+    if (c.drmModeAtomicAddProperty(req, object_id, prop_id, val) < 0) return error.AtomicAddProperty;
+}
+
+fn addPlane(req: *c.drmModeAtomicReq, crtc_id: u32, plane: Plane, state_opt: ?PlaneState) !void {
+    const props = plane.props;
+    const state = state_opt orelse {
+        try addProp(req, plane.id, props.fb_id, 0);
+        try addProp(req, plane.id, props.crtc_id, 0);
+        return;
+    };
+
+    try addProp(req, plane.id, props.fb_id, state.fb_id);
+    try addProp(req, plane.id, props.crtc_id, crtc_id);
+
+    // Source coordinates are 16.16 fixed point
+    try addProp(req, plane.id, props.src_x, @as(u64, @intCast(state.src.x)) << 16);
+    try addProp(req, plane.id, props.src_y, @as(u64, @intCast(state.src.y)) << 16);
+    try addProp(req, plane.id, props.src_w, @as(u64, @intCast(state.src.width)) << 16);
+    try addProp(req, plane.id, props.src_h, @as(u64, @intCast(state.src.height)) << 16);
+
+    try addProp(req, plane.id, props.crtc_x, @bitCast(@as(i64, state.dst.x)));
+    try addProp(req, plane.id, props.crtc_y, @bitCast(@as(i64, state.dst.y)));
+    try addProp(req, plane.id, props.crtc_w, @intCast(state.dst.width));
+    try addProp(req, plane.id, props.crtc_h, @intCast(state.dst.height));
+}
+
 pub fn deinit(self: *Drm) void {
+    for (self.outputs) |output| {
+        std.posix.close(output.deadline_timer);
+    }
+    if (self.cursor_handle) |handle| {
+        var destroy = c.drm_mode_destroy_dumb{ .handle = handle };
+        _ = c.drmIoctl(self.dri_file.handle, c.DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    // Closing the device removes whatever framebuffers are left
+    self.retired_fbs.deinit(std.heap.c_allocator);
     self.dri_file.close();
 }
 
-const Handler = struct {
-    parent: *Drm,
-    renderer: *rendering.Renderer,
+// Hands the cursor to the display's cursor plane, so that moving it never
+// needs a repaint. The compositor only switches over once every output has
+// one, and stays on the software cursor if any of them does not
+fn enableHardwareCursor(self: *Drm, output: *Output) void {
+    if (self.software_cursor) return;
 
-    pub fn close(_: ?*anyopaque) void {}
+    const handle = self.cursor_handle orelse blk: {
+        const handle = self.createCursorBuffer() catch |e| {
+            std.log.warn("Failed to create cursor buffer ({t}), using software cursor", .{e});
+            self.software_cursor = true;
+            return;
+        };
+        self.cursor_handle = handle;
+        break :blk handle;
+    };
 
-    fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, reason: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
-        const self: *Handler = @ptrCast(@alignCast(ctx));
+    const size = cursorSize(self.dri_file.handle);
+    if (c.drmModeSetCursor(self.dri_file.handle, output.crtc_id, handle, size.width, size.height) != 0) {
+        std.log.warn("No cursor plane on crtc {d} ({d}), using software cursor", .{ output.crtc_id, std.c._errno().* });
+        self.software_cursor = true;
 
-        self.pollError(reason) catch |e| {
-            std.log.err("Failed to poll: {t}", .{e});
-            return .in_progress;
-        };
+        // Would otherwise be drawn twice
+        for (self.outputs) |other| {
+            if (other.cursor_enabled) _ = c.drmModeSetCursor(self.dri_file.handle, other.crtc_id, 0, 0, 0);
+        }
+        return;
+    }
+    output.cursor_enabled = true;
 
-        return .in_progress;
+    for (self.outputs) |other| {
+        if (!other.cursor_enabled) return;
+    }
+
+    output.compositor_state.setHardwareCursor(.{
+        .ctx = self,
+        .move = moveCursor,
+    });
+}
+
+// Position is in compositor coordinates. Every output gets it relative to
+// itself, so that a cursor straddling two outputs shows on both
+fn moveCursor(ctx: ?*anyopaque, x: i32, y: i32) void {
+    const self: *Drm = @ptrCast(@alignCast(ctx));
+    for (self.outputs) |output| {
+        const rect = output.compositor_state.outputs[output.idx].rect;
+        if (c.drmModeMoveCursor(self.dri_file.handle, output.crtc_id, x - rect.x, y - rect.y) != 0) {
+            std.log.err("Failed to move cursor on crtc {d}", .{output.crtc_id});
+        }
+    }
+}
+
+fn cursorSize(dri_fd: std.posix.fd_t) struct { width: u32, height: u32 } {
+    // Legacy cursors have to be exactly the size the driver asks for, 64x64
+    // if it does not say
+    var width: u64 = 64;
+    var height: u64 = 64;
+    _ = c.drmGetCap(dri_fd, c.DRM_CAP_CURSOR_WIDTH, &width);
+    _ = c.drmGetCap(dri_fd, c.DRM_CAP_CURSOR_HEIGHT, &height);
+    return .{ .width = @intCast(width), .height = @intCast(height) };
+}
+
+// Uploaded once, the image never changes
+fn createCursorBuffer(self: *Drm) !u32 {
+    const size = cursorSize(self.dri_file.handle);
+    if (size.width < cursor_img.width or size.height < cursor_img.height) return error.CursorTooLarge;
+
+    var create = std.mem.zeroes(c.drm_mode_create_dumb);
+    create.width = size.width;
+    create.height = size.height;
+    create.bpp = 32;
+
+    try drmErrCheck(
+        c.drmIoctl(self.dri_file.handle, c.DRM_IOCTL_MODE_CREATE_DUMB, &create),
+        error.CreateDumb,
+    );
+    errdefer {
+        var destroy = c.drm_mode_destroy_dumb{ .handle = create.handle };
+        _ = c.drmIoctl(self.dri_file.handle, c.DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+
+    var map = std.mem.zeroes(c.drm_mode_map_dumb);
+    map.handle = create.handle;
+    try drmErrCheck(
+        c.drmIoctl(self.dri_file.handle, c.DRM_IOCTL_MODE_MAP_DUMB, &map),
+        error.MapDumb,
+    );
+
+    const mapped = try std.posix.mmap(
+        null,
+        @intCast(create.size),
+        std.posix.PROT.READ | std.posix.PROT.WRITE,
+        .{ .TYPE = .SHARED },
+        self.dri_file.handle,
+        map.offset,
+    );
+    defer std.posix.munmap(mapped);
+
+    @memset(mapped, 0);
+    for (0..cursor_img.height) |y| {
+        const row: [*]u32 = @ptrCast(@alignCast(mapped.ptr + y * create.pitch));
+        for (0..cursor_img.width) |x| {
+            row[x] = cursor_img.argb8888(x, y);
+        }
+    }
+
+    return create.handle;
+}
+
+// A connector and the crtc driving it. Each output is paced by its own flips,
+// one being busy never holds up another
+pub const Output = struct {
+    idx: usize,
+    crtc_id: u32,
+    connector_id: u32,
+    preferred_mode: c.drmModeModeInfo,
+    crtc_set: bool = false,
+    // Null if the driver has no atomic support, we fall back to legacy
+    // modesetting with a single plane then
+    atomic: ?Atomic,
+    // Last framebuffer committed to the primary plane. Overlay assignments
+    // are tested against it, as the next composited frame will look just
+    // like it
+    primary_fb: u32 = 0,
+    outstanding_flip: ?Flip = null,
+    displayed_client_fbs: ClientFbs = .{},
+    cursor_enabled: bool = false,
+    // When the last flip hit the screen, in CLOCK_MONOTONIC nanoseconds
+    last_vblank_ns: ?u64 = null,
+    render_time: RenderTime = .{},
+    // Wakes us up just in time to render for the next vblank, so that the
+    // frame picks up every client commit made before then
+    deadline_timer: std.posix.fd_t,
+    deadline_armed: bool = false,
+
+    // Filled in by makeHandlers
+    drm: *Drm = undefined,
+    renderer: *rendering.Renderer = undefined,
+    compositor_state: *CompositorState = undefined,
+
+    pub fn resolution(self: Output) rendering.Resolution {
+        return .{ .width = self.preferred_mode.hdisplay, .height = self.preferred_mode.vdisplay };
     }
 
-    fn pollError(self: *Handler, reason: sphtud.event.PollReason) !void {
-        if (reason == .init) {
-            // Initial render to kick off vsync loop
-            try self.render();
+    fn rect(self: *const Output) geometry.Rect {
+        return self.compositor_state.outputs[self.idx].rect;
+    }
+
+    fn renderIfReady(self: *Output) !void {
+        if (self.outstanding_flip != null or !self.compositor_state.wantsFrame(self.idx)) return;
+        // The frame gets rendered when the timer fires
+        if (self.deadline_armed) return;
+
+        if (self.renderDeadline()) |deadline| {
+            try self.armDeadline(deadline);
             return;
         }
 
-        var evctx = c.drmEventContext{
-            .version = 2,
-            .page_flip_handler = pageFlipHandler,
+        try self.render();
+    }
+
+    fn pollDeadline(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Output = @ptrCast(@alignCast(ctx));
+
+        var expirations: u64 = undefined;
+        _ = std.posix.read(self.deadline_timer, std.mem.asBytes(&expirations)) catch |e| {
+            std.log.err("Failed to read deadline timer: {t}", .{e});
         };
-        _ = c.drmHandleEvent(self.parent.dri_file.handle, &evctx);
+        self.deadline_armed = false;
+
+        if (self.outstanding_flip == null and self.compositor_state.wantsFrame(self.idx)) {
+            self.render() catch |e| {
+                std.log.err("Failed to render output {d}: {t}", .{ self.idx, e });
+            };
+        }
+
+        return .in_progress;
+    }
+
+    // Latest point we can start rendering and still make the earliest vblank
+    // there is time for. Null until a flip has told us where vblanks fall
+    fn renderDeadline(self: *const Output) ?u64 {
+        if (!self.drm.monotonic_timestamps) return null;
+        const last_vblank = self.last_vblank_ns orelse return null;
+        const period = self.framePeriodNs() orelse return null;
 
-        if (self.parent.outstanding_buffer == null) {
-            try self.render();
+        const now = CompositorState.monotonicNs();
+        const lead = self.render_time.estimate_ns + deadline_margin_ns;
+
+        var target = last_vblank + period;
+        if (target < now + lead) {
+            const behind = now + lead - target;
+            target += (behind + period - 1) / period * period;
         }
+
+        return target - lead;
     }
 
-    fn render(self: *Handler) !void {
-        std.debug.assert(self.parent.outstanding_buffer == null);
+    fn armDeadline(self: *Output, deadline_ns: u64) !void {
+        const spec = std.posix.system.itimerspec{
+            .it_value = .{
+                .sec = @intCast(deadline_ns / std.time.ns_per_s),
+                .nsec = @intCast(deadline_ns % std.time.ns_per_s),
+            },
+            .it_interval = .{
+                .sec = 0,
+                .nsec = 0,
+            },
+        };
+        try std.posix.timerfd_settime(self.deadline_timer, .{ .ABSTIME = true }, &spec, null);
+        self.deadline_armed = true;
+    }
+
+    fn framePeriodNs(self: *const Output) ?u64 {
+        const mode = self.preferred_mode;
+        if (mode.clock == 0) return null;
+        // Clock is in kHz
+        return @as(u64, mode.htotal) * mode.vtotal * std.time.ns_per_ms / mode.clock;
+    }
+
+    fn render(self: *Output) !void {
+        std.debug.assert(self.outstanding_flip == null);
+
+        const start = CompositorState.monotonicNs();
+        defer self.render_time.push(CompositorState.monotonicNs() - start);
 
-        const gbm_buffer = (try self.renderer.render()) orelse return;
-        self.parent.outstanding_buffer = gbm_buffer;
+        if (self.atomic) |*atomic| {
+            return self.renderAtomic(atomic);
+        }
+
+        const drm = self.drm;
+
+        // The first modeset always goes through composition, which also
+        // settles how we create framebuffers before a client buffer needs one
+        if (self.crtc_set) {
+            if (self.renderer.scanoutCandidate()) |candidate| {
+                if (try self.scanout(candidate)) return;
+            }
+        }
 
-        const render_buffer = try rendering.RenderBuffer.fromGbm(gbm_buffer);
-        defer render_buffer.deinit();
+        const gbm_buffer = (try self.renderer.render(&.{})) orelse return;
+        self.outstanding_flip = .{ .composited = gbm_buffer };
 
-        const fb_id = try self.parent.fbFromRenderBuffer(render_buffer);
+        const fb_id = try drm.fbFromGbm(gbm_buffer);
 
         // Some systems need a valid framebuffer on first crtc set. We could do an
         // initial render before initializing DRM, but the rest of the codebase is
         // simpler if we just lazily initialize on the first render call
-        if (!self.parent.crtc_set) {
+        if (!self.crtc_set) {
             try drmErrCheck(
                 c.drmModeSetCrtc(
-                    self.parent.dri_file.handle,
-                    self.parent.crtc_id,
+                    drm.dri_file.handle,
+                    self.crtc_id,
                     fb_id,
                     0,
                     0,
-                    &self.parent.connector_id,
+                    &self.connector_id,
                     1,
-                    &self.parent.preferred_mode,
+                    &self.preferred_mode,
                 ),
                 error.SetMode,
             );
-            self.parent.crtc_set = true;
+            self.crtc_set = true;
+
+            drm.enableHardwareCursor(self);
         }
 
         try drmErrCheck(
             c.drmModePageFlip(
-                self.parent.dri_file.handle,
-                self.parent.crtc_id,
+                drm.dri_file.handle,
+                self.crtc_id,
                 fb_id,
                 c.DRM_MODE_PAGE_FLIP_EVENT,
                 self,
@@ -138,27 +734,323 @@ const Handler = struct {
             error.PageFlip,
         );
     }
+
+    fn renderAtomic(self: *Output, atomic: *const Atomic) !void {
+        const drm = self.drm;
+
+        var overlays = OverlayAssignment{};
+
+        // Nothing to test planes against until the first modeset is done
+        if (self.crtc_set) {
+            if (self.renderer.scanoutCandidate()) |candidate| {
+                if (try self.scanoutAtomic(atomic, candidate)) return;
+            }
+
+            self.assignOverlays(atomic, &overlays);
+        }
+
+        const gbm_buffer = (try self.renderer.render(overlays.handles[0..overlays.len])) orelse return;
+        errdefer self.renderer.releaseBuffer(gbm_buffer);
+
+        const fb_id = try drm.fbFromGbm(gbm_buffer);
+
+        self.commitAtomic(
+            atomic,
+            .fullOutput(fb_id, self.rect()),
+            overlays.planes[0..overlays.len],
+            c.DRM_MODE_ATOMIC_NONBLOCK | c.DRM_MODE_PAGE_FLIP_EVENT,
+            self,
+        ) catch |e| {
+            std.log.err("Atomic commit failed ({d})", .{std.c._errno().*});
+            return e;
+        };
+
+        var flip = Flip{ .composited = gbm_buffer };
+        for (overlays.planes[0..overlays.len], overlays.locks[0..overlays.len]) |plane, lock| {
+            flip.client_fbs.append(plane.fb_id);
+            self.compositor_state.lockScanout(self.idx, lock);
+        }
+        self.outstanding_flip = flip;
+        self.primary_fb = fb_id;
+
+        if (!self.crtc_set) {
+            self.crtc_set = true;
+            drm.enableHardwareCursor(self);
+        }
+    }
+
+    // Give the topmost surfaces planes of their own for as long as the
+    // display accepts them. Stops at the first one that cannot have one, as
+    // everything below it needs compositing anyway. Overlays never overlap,
+    // the order between planes is not something we control and a lower
+    // window's plane would cover the decorations of the one above it
+    fn assignOverlays(self: *Output, atomic: *const Atomic, out: *OverlayAssignment) void {
+        // The software cursor is drawn into the primary plane, and would end
+        // up underneath
+        if (self.compositor_state.hardware_cursor == null) return;
+
+        const drm = self.drm;
+        const output_rect = self.rect();
+        const primary = PlaneState.fullOutput(self.primary_fb, output_rect);
+
+        var it = self.compositor_state.renderables.storage.iter();
+        while (out.len < atomic.num_overlays) {
+            const item = it.next() orelse break;
+            const renderable = item.val.*;
+
+            if (out.overlaps(geometry.WindowBorder.fromRenderable(renderable).bounds())) break;
+
+            const buffer = renderable.buffer.dmabuf orelse break;
+            if (!renderable.buffer.is_opaque or drm.unscannable.contains(buffer)) break;
+
+            const fb_id = drm.fbFromClientBuffer(renderable.buffer) catch {
+                drm.unscannable.add(buffer);
+                break;
+            };
+
+            // Not on this output, covers nothing below it
+            const plane = PlaneState.forSurface(fb_id, renderable, output_rect) orelse continue;
+
+            out.push(renderable, item.handle, plane);
+            self.commitAtomic(atomic, primary, out.planes[0..out.len], c.DRM_MODE_ATOMIC_TEST_ONLY, null) catch {
+                out.pop();
+                break;
+            };
+        }
+    }
+
+    // Atomic version of scanout(). A failed commit changes nothing, so there
+    // is no need to test first
+    fn scanoutAtomic(self: *Output, atomic: *const Atomic, candidate: CompositorState.Renderable) !bool {
+        const drm = self.drm;
+        const fb_id = self.scanoutFb(candidate) orelse return false;
+
+        self.commitAtomic(
+            atomic,
+            .fullOutput(fb_id, self.rect()),
+            &.{},
+            c.DRM_MODE_ATOMIC_NONBLOCK | c.DRM_MODE_PAGE_FLIP_EVENT,
+            self,
+        ) catch {
+            std.log.info("scanout of client buffer rejected ({d}), compositing", .{std.c._errno().*});
+            drm.unscannable.add(candidate.buffer.dmabuf.?);
+            return false;
+        };
+
+        self.primary_fb = fb_id;
+        try self.finishScanout(candidate, fb_id);
+        return true;
+    }
+
+    // Framebuffer for a fullscreen client buffer, null if it cannot be
+    // scanned out
+    fn scanoutFb(self: *Output, candidate: CompositorState.Renderable) ?u32 {
+        const buffer = candidate.buffer.dmabuf.?;
+
+        // Compositing blends against black, the display would not
+        if (!candidate.buffer.is_opaque) return null;
+        if (self.drm.unscannable.contains(buffer)) return null;
+
+        return self.drm.fbFromClientBuffer(candidate.buffer) catch {
+            std.log.info("display cannot show format {x} modifier {x}, compositing", .{ buffer.format, buffer.modifiers });
+            self.drm.unscannable.add(buffer);
+            return null;
+        };
+    }
+
+    fn finishScanout(self: *Output, candidate: CompositorState.Renderable, fb_id: u32) !void {
+        var flip = Flip{};
+        flip.client_fbs.append(fb_id);
+        self.outstanding_flip = flip;
+
+        self.compositor_state.lockScanout(self.idx, .{
+            .source_info = candidate.source_info,
+            .buffer = candidate.buffer.id,
+        });
+        try self.renderer.notifyScanout();
+    }
+
+    // Flip straight to a client buffer. Returns false if the display cannot
+    // take it, in which case we composite as usual
+    fn scanout(self: *Output, candidate: CompositorState.Renderable) !bool {
+        const fb_id = self.scanoutFb(candidate) orelse return false;
+
+        const ret = c.drmModePageFlip(
+            self.drm.dri_file.handle,
+            self.crtc_id,
+            fb_id,
+            c.DRM_MODE_PAGE_FLIP_EVENT,
+            self,
+        );
+
+        if (ret != 0) {
+            std.log.info("flip to client buffer failed ({d}), compositing", .{std.c._errno().*});
+            self.drm.unscannable.add(candidate.buffer.dmabuf.?);
+            return false;
+        }
+
+        try self.finishScanout(candidate, fb_id);
+        return true;
+    }
+
+    // Overlays past the end of the given states are switched off. Sets the
+    // mode as well if we have not done so yet
+    fn commitAtomic(self: *Output, atomic: *const Atomic, primary: PlaneState, overlays: []const PlaneState, flags: u32, user_data: ?*anyopaque) !void {
+        const req = c.drmModeAtomicAlloc() orelse return error.OutOfMemory;
+        defer c.drmModeAtomicFree(req);
+
+        var commit_flags = flags;
+        if (!self.crtc_set) {
+            try addProp(req, self.crtc_id, atomic.crtc.mode_id, atomic.mode_blob);
+            try addProp(req, self.crtc_id, atomic.crtc.active, 1);
+            try addProp(req, self.connector_id, atomic.connector.crtc_id, self.crtc_id);
+            commit_flags |= c.DRM_MODE_ATOMIC_ALLOW_MODESET;
+        }
+
+        try addPlane(req, self.crtc_id, atomic.primary, primary);
+        for (atomic.overlays[0..atomic.num_overlays], 0..) |plane, i| {
+            try addPlane(req, self.crtc_id, plane, if (i < overlays.len) overlays[i] else null);
+        }
+
+        if (c.drmModeAtomicCommit(self.drm.dri_file.handle, req, commit_flags, user_data) != 0) {
+            return error.AtomicCommit;
+        }
+    }
+};
+
+// Time from starting a render to committing it. Follows the slowest recent
+// frame closely and forgets it slowly, as rendering too late costs a whole
+// refresh while rendering too early only costs a little latency
+const RenderTime = struct {
+    estimate_ns: u64 = 0,
+
+    fn push(self: *RenderTime, sample_ns: u64) void {
+        if (sample_ns >= self.estimate_ns) {
+            self.estimate_ns = sample_ns;
+        } else {
+            self.estimate_ns -= (self.estimate_ns - sample_ns) / 8;
+        }
+    }
 };
 
-pub fn makeHandler(self: *Drm, alloc: std.mem.Allocator, renderer: *rendering.Renderer) !sphtud.event.Loop.Handler {
+// The GPU finishes after we commit and the kernel holds the flip until it
+// does, none of which we measure. Covers that and timer wakeup jitter
+const deadline_margin_ns = 2 * std.time.ns_per_ms;
+
+// Flips for every output complete on the one DRM fd, and the compositor has
+// a single frame event, so one handler serves all outputs
+const Handler = struct {
+    drm: *Drm,
+    compositor_state: *CompositorState,
+
+    pub fn close(_: ?*anyopaque) void {}
+
+    fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, reason: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Handler = @ptrCast(@alignCast(ctx));
+
+        // Initial damage covers every output, the first render sets the
+        // modes
+        if (reason != .init) {
+            var evctx = c.drmEventContext{
+                .version = 2,
+                .page_flip_handler = pageFlipHandler,
+            };
+            _ = c.drmHandleEvent(self.drm.dri_file.handle, &evctx);
+        }
+
+        // Nothing new to show means no flip, and nothing waking us up until
+        // the compositor state schedules a frame
+        self.renderOutputs();
+        return .in_progress;
+    }
+
+    fn pollFrameEvent(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Handler = @ptrCast(@alignCast(ctx));
+        self.compositor_state.consumeFrameEvent();
+
+        // Outputs with a flip still in flight pick the frame up when it
+        // completes
+        self.renderOutputs();
+        return .in_progress;
+    }
+
+    fn renderOutputs(self: *Handler) void {
+        for (self.drm.outputs) |*output| {
+            output.renderIfReady() catch |e| {
+                std.log.err("Failed to render output {d}: {t}", .{ output.idx, e });
+            };
+        }
+    }
+};
+
+// One handler for flip completion on the DRM fd, one for the compositor
+// asking for a frame while we are idle, and a render deadline timer per
+// output
+pub fn makeHandlers(self: *Drm, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) ![]PriorityDispatch.Registration {
+    std.debug.assert(renderers.len == self.outputs.len);
+    for (self.outputs, renderers) |*output, *renderer| {
+        output.drm = self;
+        output.renderer = renderer;
+        output.compositor_state = compositor_state;
+    }
+
     const handler_ctx = try alloc.create(Handler);
     handler_ctx.* = .{
-        .parent = self,
-        .renderer = renderer,
+        .drm = self,
+        .compositor_state = compositor_state,
     };
 
-    return .{
-        .desired_events = .{
-            .read = true,
-            .write = false,
+    const handlers = try alloc.alloc(PriorityDispatch.Registration, 2 + self.outputs.len);
+    handlers[0] = .{
+        .class = .vblank,
+        .handler = .{
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
+            .fd = self.dri_file.handle,
+            .ptr = handler_ctx,
+            .vtable = &.{
+                .poll = Handler.poll,
+                .close = Handler.close,
+            },
         },
-        .fd = self.dri_file.handle,
-        .ptr = handler_ctx,
-        .vtable = &.{
-            .poll = Handler.poll,
-            .close = Handler.close,
+    };
+    handlers[1] = .{
+        .class = .vblank,
+        .handler = .{
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
+            .fd = compositor_state.frame_event,
+            .ptr = handler_ctx,
+            .vtable = &.{
+                .poll = Handler.pollFrameEvent,
+                .close = Handler.close,
+            },
         },
     };
+
+    for (self.outputs, handlers[2..]) |*output, *handler| {
+        handler.* = .{
+            .class = .vblank,
+            .handler = .{
+                .desired_events = .{
+                    .read = true,
+                    .write = false,
+                },
+                .fd = output.deadline_timer,
+                .ptr = output,
+                .vtable = &.{
+                    .poll = Output.pollDeadline,
+                    .close = Handler.close,
+                },
+            },
+        };
+    }
+
+    return handlers;
 }
 
 fn drmErrCheck(rc: c_int, on_err: anyerror) !void {
@@ -169,6 +1061,124 @@ fn drmErrCheck(rc: c_int, on_err: anyerror) !void {
     }
 }
 
+// Owned by the gbm_bo it is attached to. Allocated with the c allocator as
+// it is freed from within gbm whenever the buffer object goes away
+const CachedFb = struct {
+    dri_fd: std.posix.fd_t,
+    fb_id: u32,
+
+    fn destroy(ctx: ?*anyopaque) void {
+        const self: *CachedFb = @ptrCast(@alignCast(ctx));
+        if (c.drmModeRmFB(self.dri_fd, self.fb_id) != 0) {
+            std.log.err("Failed to remove framebuffer {d}", .{self.fb_id});
+        }
+        std.heap.c_allocator.destroy(self);
+    }
+};
+
+fn fbFromGbm(self: *Drm, gbm_buffer: system_gl.GbmContext.Buffer) !u32 {
+    if (gbm_buffer.userData()) |data| {
+        const cached: *CachedFb = @ptrCast(@alignCast(data));
+        return cached.fb_id;
+    }
+
+    const render_buffer = try rendering.RenderBuffer.fromGbm(gbm_buffer);
+    defer render_buffer.deinit();
+
+    const fb_id = try self.fbFromRenderBuffer(render_buffer);
+    errdefer _ = c.drmModeRmFB(self.dri_file.handle, fb_id);
+
+    const cached = try std.heap.c_allocator.create(CachedFb);
+    cached.* = .{
+        .dri_fd = self.dri_file.handle,
+        .fb_id = fb_id,
+    };
+    gbm_buffer.setUserData(cached, CachedFb.destroy);
+
+    return fb_id;
+}
+
+// Owned by the wl_buffer it is attached to, and like CachedFb allocated with
+// the c allocator. The framebuffer may still be on screen when the client
+// destroys the buffer, it is only removed once no output shows it
+const ClientFb = struct {
+    drm: *Drm,
+    fb_id: u32,
+
+    fn destroy(ctx: ?*anyopaque) void {
+        const self: *ClientFb = @ptrCast(@alignCast(ctx));
+        self.drm.retireFb(self.fb_id);
+        std.heap.c_allocator.destroy(self);
+    }
+};
+
+// Clients cycle through the same few buffers, so each one gets its
+// framebuffer the first time it is scanned out and keeps it for the lifetime
+// of the wl_buffer
+fn fbFromClientBuffer(self: *Drm, buffer: CompositorState.RenderableBuffer) !u32 {
+    const user_data = buffer.dmabuf_user_data.?;
+    if (user_data.data) |data| {
+        const cached: *ClientFb = @ptrCast(@alignCast(data));
+        return cached.fb_id;
+    }
+
+    const fb_id = try self.fbFromRenderBuffer(buffer.dmabuf.?);
+    errdefer _ = c.drmModeRmFB(self.dri_file.handle, fb_id);
+
+    const cached = try std.heap.c_allocator.create(ClientFb);
+    cached.* = .{
+        .drm = self,
+        .fb_id = fb_id,
+    };
+    user_data.* = .{ .data = cached, .destroy = ClientFb.destroy };
+
+    return fb_id;
+}
+
+fn retireFb(self: *Drm, fb_id: u32) void {
+    if (!self.fbInUse(fb_id)) {
+        self.removeFb(fb_id);
+        return;
+    }
+
+    self.retired_fbs.append(std.heap.c_allocator, fb_id) catch {
+        // Leaked until the device is closed, better than blanking a plane
+        std.log.err("Failed to retire framebuffer {d}", .{fb_id});
+    };
+}
+
+// Called whenever a flip completes, which may have taken the last retired
+// framebuffers off screen
+fn removeRetiredFbs(self: *Drm) void {
+    var i: usize = 0;
+    while (i < self.retired_fbs.items.len) {
+        const fb_id = self.retired_fbs.items[i];
+        if (self.fbInUse(fb_id)) {
+            i += 1;
+            continue;
+        }
+
+        self.removeFb(fb_id);
+        _ = self.retired_fbs.swapRemove(i);
+    }
+}
+
+fn fbInUse(self: *const Drm, fb_id: u32) bool {
+    for (self.outputs) |*output| {
+        if (output.displayed_client_fbs.contains(fb_id)) return true;
+        if (output.outstanding_flip) |*flip| {
+            if (flip.client_fbs.contains(fb_id)) return true;
+        }
+    }
+    return false;
+}
+
+fn removeFb(self: *Drm, fb_id: u32) void {
+    if (c.drmModeRmFB(self.dri_file.handle, fb_id) != 0) {
+        std.log.err("Failed to remove framebuffer {d}", .{fb_id});
+    }
+}
+
 fn fbFromRenderBuffer(self: *Drm, buffer: rendering.RenderBuffer) !u32 {
     var dri_prime_handle = c.drm_prime_handle{
         .flags = 0,
@@ -209,23 +1219,33 @@ fn fbFromRenderBuffer(self: *Drm, buffer: rendering.RenderBuffer) !u32 {
     offsets[0] = buffer.offset;
     modifiers[0] = buffer.modifiers;
 
-    // FIXME: If this fails once, it will fail every frame, double syscalling
-    // is stupid
-    const ret = c.drmModeAddFB2WithModifiers(
-        self.dri_file.handle,
-        @intCast(buffer.width),
-        @intCast(buffer.height),
-        buffer.format,
-        &handles,
-        &strides,
-        &offsets,
-        &modifiers,
-        &fb_id,
-        c.DRM_MODE_FB_MODIFIERS,
-    );
+    // Drivers without modifier support will fail every AddFB2WithModifiers
+    // call, remember which variant works so we only pay for the failing
+    // syscall once
+    if (self.add_fb_method != .without_modifiers) {
+        const ret = c.drmModeAddFB2WithModifiers(
+            self.dri_file.handle,
+            @intCast(buffer.width),
+            @intCast(buffer.height),
+            buffer.format,
+            &handles,
+            &strides,
+            &offsets,
+            &modifiers,
+            &fb_id,
+            c.DRM_MODE_FB_MODIFIERS,
+        );
+
+        if (ret == 0) {
+            self.add_fb_method = .with_modifiers;
+            return fb_id;
+        }
+
+        if (self.add_fb_method == .with_modifiers) {
+            try drmErrCheck(ret, error.AddFb);
+        }
 
-    if (ret == 0) {
-        return fb_id;
+        self.add_fb_method = .without_modifiers;
     }
 
     try drmErrCheck(
@@ -248,25 +1268,61 @@ fn fbFromRenderBuffer(self: *Drm, buffer: rendering.RenderBuffer) !u32 {
 
 fn pageFlipHandler(fd: c_int, frame: c_uint, sec: c_uint, usec: c_uint, data: ?*anyopaque) callconv(.c) void {
     _ = fd;
-    _ = frame;
-    _ = sec;
-    _ = usec;
-    const handler: *Handler = @ptrCast(@alignCast(data));
-    const to_release = handler.parent.outstanding_buffer.?;
-    handler.renderer.releaseBuffer(to_release);
-    handler.parent.outstanding_buffer = null;
-}
+    const output: *Output = @ptrCast(@alignCast(data));
+    output.last_vblank_ns = @as(u64, sec) * std.time.ns_per_s + @as(u64, usec) * std.time.ns_per_us;
+
+    const hw_timestamp = output.drm.monotonic_timestamps;
+    const presentation = CompositorState.Presentation{
+        .time_ns = if (hw_timestamp) output.last_vblank_ns.? else CompositorState.monotonicNs(),
+        .refresh_ns = std.math.cast(u32, output.framePeriodNs() orelse 0) orelse 0,
+        .seq = frame,
+        .vsync = true,
+        .hw_timestamp = hw_timestamp,
+    };
 
-fn getFirstConnectedConnector(f: std.fs.File, resources: *c.drmModeRes) ?*c.drmModeConnector {
-    for (resources.connectors[0..@intCast(resources.count_connectors)]) |connector_id| {
-        const connector: *c.drmModeConnector = c.drmModeGetConnector(f.handle, connector_id) orelse continue;
+    const flipped = output.outstanding_flip.?;
+    output.outstanding_flip = null;
+
+    // Whatever client buffers were on screen before have been replaced
+    output.displayed_client_fbs = flipped.client_fbs;
+    output.drm.removeRetiredFbs();
 
-        if (connector.connection == c.DRM_MODE_CONNECTED) {
-            return connector;
+    if (flipped.composited) |buf| {
+        output.renderer.releaseBuffer(buf);
+    }
+
+    output.compositor_state.notifyFlipComplete(output.idx);
+
+    // Right after vblank, giving clients the whole interval to draw
+    output.compositor_state.requestFrame(output.idx, presentation) catch |e| {
+        std.log.err("Failed to send frame callbacks: {t}", .{e});
+    };
+}
+
+// Index into resources.crtcs of a crtc nobody else is using that can drive
+// the connector. The one it is already on is preferred, so that we do not
+// reroute anything the firmware set up
+fn pickCrtc(dri_fd: std.posix.fd_t, resources: *c.drmModeRes, connector: *c.drmModeConnector, claimed: u32) ?usize {
+    const crtcs = resources.crtcs[0..@intCast(resources.count_crtcs)];
+
+    const current_encoder: ?*c.drmModeEncoder = c.drmModeGetEncoder(dri_fd, connector.encoder_id);
+    if (current_encoder) |encoder| {
+        defer c.drmModeFreeEncoder(encoder);
+        if (std.mem.indexOfScalar(u32, crtcs, encoder.crtc_id)) |idx| {
+            if (claimed & (@as(u32, 1) << @intCast(idx)) == 0) return idx;
         }
+    }
+
+    for (connector.encoders[0..@intCast(connector.count_encoders)]) |encoder_id| {
+        const encoder: *c.drmModeEncoder = c.drmModeGetEncoder(dri_fd, encoder_id) orelse continue;
+        defer c.drmModeFreeEncoder(encoder);
 
-        c.drmModeFreeConnector(connector);
+        for (0..crtcs.len) |idx| {
+            const bit = @as(u32, 1) << @intCast(idx);
+            if (encoder.possible_crtcs & bit != 0 and claimed & bit == 0) return idx;
+        }
     }
+
     return null;
 }
 
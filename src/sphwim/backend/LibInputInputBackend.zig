@@ -1,13 +1,24 @@
 const std = @import("std");
 const sphtud = @import("sphtud");
 const CompositorState = @import("../CompositorState.zig");
+const InputQueue = @import("../InputQueue.zig");
+const rendering = @import("../rendering.zig");
 const system = @import("input");
 
 const input_logger = std.log.scoped(.input);
 
+// libinput is dispatched on a thread of its own, so that reading the devices
+// never waits behind rendering or clients. Events go through queue, the main
+// thread side of this handler only wakes the compositor
+
 udev_ctx: *system.udev,
 input_ctx: *system.libinput,
 compositor_state: *CompositorState,
+queue: InputQueue,
+// Absolute devices are mapped onto this, fixed for the life of the compositor
+compositor_res: rendering.Resolution,
+stop_event: std.posix.fd_t,
+thread: std.Thread,
 
 const LibInputInputBackend = @This();
 
@@ -16,26 +27,46 @@ const libinput_interface = system.libinput_interface{
     .close_restricted = closeFile,
 };
 
+// While an event is held back by a full queue, how often to retry it without
+// waiting for more input
+const held_retry_ms = 1;
+
 pub fn init(alloc: std.mem.Allocator, compositor_state: *CompositorState) !sphtud.event.Loop.Handler {
     const udev_ctx = system.udev_new() orelse return error.UdevInit;
+    errdefer _ = system.udev_unref(udev_ctx);
 
     const input_ctx = system.libinput_udev_create_context(&libinput_interface, null, udev_ctx) orelse return error.CreateContext;
+    errdefer _ = system.libinput_unref(input_ctx);
 
     const seat_name = std.posix.getenv("XDG_SEAT") orelse return error.NoSeat;
     if (system.libinput_udev_assign_seat(input_ctx, seat_name) != 0) {
         return error.AssignSeat;
     }
 
+    const stop_event = try std.posix.eventfd(0, std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC);
+    errdefer std.posix.close(stop_event);
+
     const ret = try alloc.create(LibInputInputBackend);
     ret.* = .{
         .udev_ctx = udev_ctx,
         .input_ctx = input_ctx,
         .compositor_state = compositor_state,
+        .queue = try .init(alloc),
+        .compositor_res = compositor_state.compositor_res,
+        .stop_event = stop_event,
+        .thread = undefined,
     };
+    errdefer ret.queue.deinit(alloc);
+
+    // From here on libinput belongs to the input thread
+    ret.thread = try std.Thread.spawn(.{}, runInputThread, .{ret});
+    ret.thread.setName("sphwim-input") catch {};
+
+    compositor_state.input_queue = &ret.queue;
 
     return .{
         .ptr = ret,
-        .fd = system.libinput_get_fd(input_ctx),
+        .fd = ret.queue.wake_event,
         .desired_events = .{
             .read = true,
             .write = false,
@@ -57,15 +88,35 @@ fn closeFile(fd: c_int, _: ?*anyopaque) callconv(.c) void {
 
 fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
     const self: *LibInputInputBackend = @ptrCast(@alignCast(ctx));
-    self.pollError() catch |e| {
-        std.log.err("input handling error, shutting down input loop: {t}", .{e});
-        return .complete;
+    self.queue.consumeWake();
+    self.compositor_state.notifyInputQueued();
+    return .in_progress;
+}
+
+fn runInputThread(self: *LibInputInputBackend) void {
+    self.runInputThreadError() catch |e| {
+        std.log.err("input handling error, shutting down input thread: {t}", .{e});
     };
+}
 
-    return .in_progress;
+fn runInputThreadError(self: *LibInputInputBackend) !void {
+    var fds = [_]std.posix.pollfd{
+        .{ .fd = system.libinput_get_fd(self.input_ctx), .events = std.posix.POLL.IN, .revents = 0 },
+        .{ .fd = self.stop_event, .events = std.posix.POLL.IN, .revents = 0 },
+    };
+
+    while (true) {
+        const timeout: i32 = if (self.queue.held != null) held_retry_ms else -1;
+        _ = try std.posix.poll(&fds, timeout);
+
+        if (fds[1].revents != 0) return;
+        if (fds[0].revents != 0) try self.dispatchInput();
+
+        _ = self.queue.flushHeld();
+    }
 }
 
-fn pollError(self: *LibInputInputBackend) anyerror!void {
+fn dispatchInput(self: *LibInputInputBackend) !void {
     if (system.libinput_dispatch(self.input_ctx) != 0) {
         return error.InputError;
     }
@@ -82,22 +133,28 @@ fn pollError(self: *LibInputInputBackend) anyerror!void {
                 const pointer_event = system.libinput_event_get_pointer_event(next_event);
                 const dx = system.libinput_event_pointer_get_dx(pointer_event);
                 const dy = system.libinput_event_pointer_get_dy(pointer_event);
-                self.compositor_state.notifyCursorMovement(@floatCast(dx), @floatCast(dy));
+                self.queue.push(.{
+                    .time_us = system.libinput_event_pointer_get_time_usec(pointer_event),
+                    .kind = .{ .motion = .{ .dx = @floatCast(dx), .dy = @floatCast(dy) } },
+                });
             },
             system.LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE => {
                 const pointer_event = system.libinput_event_get_pointer_event(next_event);
 
                 const x = system.libinput_event_pointer_get_absolute_x_transformed(
                     pointer_event,
-                    self.compositor_state.compositor_res.width,
+                    self.compositor_res.width,
                 );
 
                 const y = system.libinput_event_pointer_get_absolute_y_transformed(
                     pointer_event,
-                    self.compositor_state.compositor_res.height,
+                    self.compositor_res.height,
                 );
 
-                self.compositor_state.notifyCursorPosition(@floatCast(x), @floatCast(y));
+                self.queue.push(.{
+                    .time_us = system.libinput_event_pointer_get_time_usec(pointer_event),
+                    .kind = .{ .motion_absolute = .{ .x = @floatCast(x), .y = @floatCast(y) } },
+                });
             },
             else => {
                 input_logger.debug("unhandled input event for {d}", .{next_event_type});
@@ -108,6 +165,15 @@ fn pollError(self: *LibInputInputBackend) anyerror!void {
 
 fn close(ctx: ?*anyopaque) void {
     const self: *LibInputInputBackend = @ptrCast(@alignCast(ctx));
+
+    const val: u64 = 1;
+    _ = std.posix.write(self.stop_event, std.mem.asBytes(&val)) catch {};
+    self.thread.join();
+
+    self.compositor_state.input_queue = null;
+    std.posix.close(self.stop_event);
+    std.posix.close(self.queue.wake_event);
+
     _ = system.libinput_unref(self.input_ctx);
     _ = system.udev_unref(self.udev_ctx);
 }
@@ -3,31 +3,24 @@ const sphtud = @import("sphtud");
 const CompositorState = @import("../CompositorState.zig");
 const rendering = @import("../rendering.zig");
 const backend = @import("../backend.zig");
+const PriorityDispatch = @import("../PriorityDispatch.zig");
 
 const NullRenderBackend = @This();
 
+// Stands in for vblank. Only armed while a frame is scheduled, so that we
+// never wake up for nothing
 fd: std.posix.fd_t,
+timer_armed: bool = false,
 
 pub fn init(alloc: std.mem.Allocator) !backend.Backend {
     const ctx = try alloc.create(NullRenderBackend);
     ctx.* = .{
         .fd = try std.posix.timerfd_create(.MONOTONIC, .{}),
     };
-    var next = std.posix.system.itimerspec{
-        .it_value = .{
-            .sec = 1,
-            .nsec = 0,
-        },
-        .it_interval = .{
-            .sec = 1,
-            .nsec = 0,
-        },
-    };
-    try std.posix.timerfd_settime(ctx.fd, .{}, &next, null);
 
     return .{
         .preferred_gpu = "/dev/dri/card0",
-        .initial_res = .{ .width = 640, .height = 480 },
+        .outputs = &.{.{ .width = 640, .height = 480 }},
         .ctx = ctx,
         .vtable = &.{
             .makeHandlers = makeHandlers,
@@ -41,9 +34,27 @@ fn deinit(ctx: ?*anyopaque) void {
     std.posix.close(self.fd);
 }
 
+fn armTimer(self: *NullRenderBackend) !void {
+    if (self.timer_armed) return;
+
+    const next = std.posix.system.itimerspec{
+        .it_value = .{
+            .sec = 1,
+            .nsec = 0,
+        },
+        .it_interval = .{
+            .sec = 0,
+            .nsec = 0,
+        },
+    };
+    try std.posix.timerfd_settime(self.fd, .{}, &next, null);
+    self.timer_armed = true;
+}
+
 const Handler = struct {
     parent: *NullRenderBackend,
     renderer: *rendering.Renderer,
+    compositor_state: *CompositorState,
 
     fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
         const self: *Handler = @ptrCast(@alignCast(ctx));
@@ -59,36 +70,71 @@ const Handler = struct {
     fn pollError(self: *Handler) !void {
         var read_time: u64 = undefined;
         _ = try std.posix.read(self.parent.fd, std.mem.asBytes(&read_time));
+        self.parent.timer_armed = false;
 
-        const buf = try self.renderer.render();
+        if (!self.compositor_state.wantsFrame(self.renderer.output_idx)) return;
+
+        const buf = try self.renderer.render(&.{});
         if (buf) |b| {
             self.renderer.releaseBuffer(b);
         }
+        try self.compositor_state.requestFrame(self.renderer.output_idx, .now());
+    }
+
+    fn pollFrameEvent(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Handler = @ptrCast(@alignCast(ctx));
+        self.compositor_state.consumeFrameEvent();
+
+        self.parent.armTimer() catch |e| {
+            std.log.err("Failed to arm frame timer: {t}", .{e});
+            return .complete;
+        };
+
+        return .in_progress;
     }
 
     fn close(_: ?*anyopaque) void {}
 };
 
-fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderer: *rendering.Renderer, _: *CompositorState) anyerror![]sphtud.event.Loop.Handler {
+fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) anyerror![]PriorityDispatch.Registration {
     const self: *NullRenderBackend = @ptrCast(@alignCast(ctx));
 
     const handler_ctx = try alloc.create(Handler);
     handler_ctx.* = .{
         .parent = self,
-        .renderer = renderer,
+        .renderer = &renderers[0],
+        .compositor_state = compositor_state,
     };
 
-    const handlers = try alloc.alloc(sphtud.event.Loop.Handler, 1);
+    const handlers = try alloc.alloc(PriorityDispatch.Registration, 2);
     handlers[0] = .{
-        .ptr = handler_ctx,
-        .vtable = &.{
-            .poll = Handler.poll,
-            .close = Handler.close,
+        .class = .vblank,
+        .handler = .{
+            .ptr = handler_ctx,
+            .vtable = &.{
+                .poll = Handler.poll,
+                .close = Handler.close,
+            },
+            .fd = self.fd,
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
         },
-        .fd = self.fd,
-        .desired_events = .{
-            .read = true,
-            .write = false,
+    };
+    handlers[1] = .{
+        .class = .vblank,
+        .handler = .{
+            .ptr = handler_ctx,
+            .vtable = &.{
+                .poll = Handler.pollFrameEvent,
+                .close = Handler.close,
+            },
+            .fd = compositor_state.frame_event,
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
         },
     };
 
@@ -3,6 +3,7 @@ const sphtud = @import("sphtud");
 const rendering = @import("../rendering.zig");
 const backend = @import("../backend.zig");
 const CompositorState = @import("../CompositorState.zig");
+const PriorityDispatch = @import("../PriorityDispatch.zig");
 const DrmRenderer = @import("DrmRenderBackend.zig");
 const LibinputHandler = @import("LibInputInputBackend.zig");
 
@@ -18,9 +19,14 @@ pub fn init(alloc: std.mem.Allocator) !backend.Backend {
         .drm = drm,
     };
 
+    const outputs = try alloc.alloc(rendering.Resolution, drm.outputs.len);
+    for (outputs, drm.outputs) |*res, output| {
+        res.* = output.resolution();
+    }
+
     return .{
         .preferred_gpu = drm.preferred_gpu,
-        .initial_res = .{ .width = drm.preferred_mode.hdisplay, .height = drm.preferred_mode.vdisplay },
+        .outputs = outputs,
         .ctx = ctx,
         .vtable = &.{
             .makeHandlers = makeHandlers,
@@ -29,12 +35,17 @@ pub fn init(alloc: std.mem.Allocator) !backend.Backend {
     };
 }
 
-fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderer: *rendering.Renderer, compositor_state: *CompositorState) anyerror![]sphtud.event.Loop.Handler {
+fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) anyerror![]PriorityDispatch.Registration {
     const self: *SeatBackend = @ptrCast(@alignCast(ctx));
 
-    const handlers = try alloc.alloc(sphtud.event.Loop.Handler, 2);
-    handlers[0] = try self.drm.makeHandler(alloc, renderer);
-    handlers[1] = try LibinputHandler.init(alloc, compositor_state);
+    const drm_handlers = try self.drm.makeHandlers(alloc, renderers, compositor_state);
+
+    const handlers = try alloc.alloc(PriorityDispatch.Registration, drm_handlers.len + 1);
+    @memcpy(handlers[0..drm_handlers.len], drm_handlers);
+    handlers[drm_handlers.len] = .{
+        .class = .input,
+        .handler = try LibinputHandler.init(alloc, compositor_state),
+    };
 
     return handlers;
 }
@@ -2,6 +2,7 @@ const std = @import("std");
 const sphtud = @import("sphtud");
 const rendering = @import("../rendering.zig");
 const backend = @import("../backend.zig");
+const PriorityDispatch = @import("../PriorityDispatch.zig");
 const sphwindow = @import("sphwindow");
 const CompositorState = @import("../CompositorState.zig");
 const system_gl = @import("../system_gl.zig");
@@ -10,6 +11,7 @@ const WaylandRenderBackend = @This();
 
 const logger = std.log.scoped(.wayland_renderer);
 
+alloc: std.mem.Allocator,
 window: sphwindow.Window,
 system_running: *bool,
 outstanding_buffers: sphtud.util.AutoHashMap(u32, system_gl.GbmContext.Buffer),
@@ -18,6 +20,7 @@ pub fn init(alloc: std.mem.Allocator, expansion_alloc: sphtud.util.ExpansionAllo
     const ctx = try alloc.create(WaylandRenderBackend);
 
     ctx.* = .{
+        .alloc = alloc,
         .window = try sphwindow.Window.init(alloc, expansion_alloc),
         .system_running = system_running,
         // Anything over quadruple buffering would be quite surprising to me
@@ -26,7 +29,7 @@ pub fn init(alloc: std.mem.Allocator, expansion_alloc: sphtud.util.ExpansionAllo
 
     return .{
         .preferred_gpu = try ctx.window.getPreferredGpu(alloc),
-        .initial_res = .{ .width = 1024, .height = 768 },
+        .outputs = &.{.{ .width = 1024, .height = 768 }},
         .ctx = ctx,
         .vtable = &.{
             .makeHandlers = makeHandlers,
@@ -37,6 +40,11 @@ pub fn init(alloc: std.mem.Allocator, expansion_alloc: sphtud.util.ExpansionAllo
 
 fn deinit(ctx: ?*anyopaque) void {
     const self: *WaylandRenderBackend = @ptrCast(@alignCast(ctx));
+    // Buffer objects that went away since the last frame have only queued
+    // their wl_buffer destroys
+    self.window.flush() catch |e| {
+        logger.err("Failed to flush buffer destroys: {t}", .{e});
+    };
     self.window.deinit();
 }
 
@@ -56,30 +64,59 @@ const Handler = struct {
 
         return .in_progress;
     }
+
+    fn pollFrameEvent(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
+        const self: *Handler = @ptrCast(@alignCast(ctx));
+        self.compositor_state.consumeFrameEvent();
+        self.parent.renderIfReady(self.renderer, self.compositor_state) catch |e| {
+            logger.err("Failed to render: {t}", .{e});
+            return .in_progress;
+        };
+
+        return .in_progress;
+    }
 };
 
-fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderer: *rendering.Renderer, compositor_state: *CompositorState) ![]sphtud.event.Loop.Handler {
+fn makeHandlers(ctx: ?*anyopaque, alloc: std.mem.Allocator, renderers: []rendering.Renderer, compositor_state: *CompositorState) ![]PriorityDispatch.Registration {
     const self: *WaylandRenderBackend = @ptrCast(@alignCast(ctx));
     const fd = self.window.getFd();
 
     const handler_ctx = try alloc.create(Handler);
     handler_ctx.* = .{
         .parent = self,
-        .renderer = renderer,
+        .renderer = &renderers[0],
         .compositor_state = compositor_state,
     };
 
-    const handlers = try alloc.alloc(sphtud.event.Loop.Handler, 1);
+    const handlers = try alloc.alloc(PriorityDispatch.Registration, 2);
     handlers[0] = .{
-        .ptr = handler_ctx,
-        .fd = fd,
-        .desired_events = .{
-            .read = true,
-            .write = false,
+        .class = .input,
+        .handler = .{
+            .ptr = handler_ctx,
+            .fd = fd,
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
+            .vtable = &.{
+                .poll = Handler.poll,
+                .close = Handler.close,
+            },
         },
-        .vtable = &.{
-            .poll = Handler.poll,
-            .close = Handler.close,
+    };
+    handlers[1] = .{
+        .class = .vblank,
+        .handler = .{
+            .ptr = handler_ctx,
+            .fd = compositor_state.frame_event,
+            .desired_events = .{
+                .read = true,
+                .write = false,
+            },
+            .vtable = &.{
+                .poll = Handler.pollFrameEvent,
+                .close = Handler.close,
+            },
         },
     };
 
@@ -101,17 +138,43 @@ fn pollError(self: *WaylandRenderBackend, renderer: *rendering.Renderer, composi
         .mouse1_up => compositor_state.notifyMouse1Up(),
     };
 
-    if (!self.window.wantsFrame()) {
+    try self.renderIfReady(renderer, compositor_state);
+}
+
+// Needs both the host compositor to be ready for another frame and something
+// on screen to have changed
+fn renderIfReady(self: *WaylandRenderBackend, renderer: *rendering.Renderer, compositor_state: *CompositorState) !void {
+    if (!self.window.wantsFrame() or !compositor_state.wantsFrame(renderer.output_idx)) {
         return;
     }
 
-    if (try renderer.render()) |buf| {
+    if (try renderer.render(&.{})) |buf| {
         try self.displayBuffer(renderer, buf);
     }
+    try compositor_state.requestFrame(renderer.output_idx, .now());
 }
 
 fn displayBuffer(self: *WaylandRenderBackend, renderer: *rendering.Renderer, buffer: system_gl.GbmContext.Buffer) !void {
-    errdefer renderer.gbm_ctx.unlock(buffer);
+    errdefer renderer.releaseBuffer(buffer);
+
+    const buf_id = try self.wlBufferForGbm(buffer);
+
+    try self.outstanding_buffers.put(buf_id, buffer);
+    errdefer _ = self.outstanding_buffers.remove(buf_id);
+
+    try self.window.swapBuffers(buf_id);
+}
+
+// Our swapchain only ever has a handful of buffer objects, give each one a
+// wl_buffer once and re-attach it every time it comes back around
+fn wlBufferForGbm(self: *WaylandRenderBackend, buffer: system_gl.GbmContext.Buffer) !u32 {
+    if (buffer.userData()) |data| {
+        const bo_buffer: *BoWlBuffer = @ptrCast(@alignCast(data));
+        return bo_buffer.id;
+    }
+
+    const bo_buffer = try self.alloc.create(BoWlBuffer);
+    errdefer self.alloc.destroy(bo_buffer);
 
     const fd = try buffer.fd();
     defer std.posix.close(fd);
@@ -126,10 +189,31 @@ fn displayBuffer(self: *WaylandRenderBackend, renderer: *rendering.Renderer, buf
         .format = buffer.format(),
     };
 
-    const buf_id = try self.window.swapBuffers(client_raw_buffer);
-    try self.outstanding_buffers.put(buf_id, buffer);
+    bo_buffer.* = .{
+        .alloc = self.alloc,
+        .window = &self.window,
+        .id = try self.window.createBuffer(client_raw_buffer),
+    };
+    buffer.setUserData(bo_buffer, BoWlBuffer.destroy);
+    return bo_buffer.id;
 }
 
+// Lives in the buffer object's user data, so that the host compositor's
+// wl_buffer goes away with the buffer object
+const BoWlBuffer = struct {
+    alloc: std.mem.Allocator,
+    window: *sphwindow.Window,
+    id: u32,
+
+    fn destroy(data: ?*anyopaque) void {
+        const self: *BoWlBuffer = @ptrCast(@alignCast(data));
+        self.window.destroyBuffer(self.id) catch |e| {
+            logger.err("Failed to destroy wl_buffer: {t}", .{e});
+        };
+        self.alloc.destroy(self);
+    }
+};
+
 const OutstandingBufNotifier = struct {
     outstanding_buffers: *sphtud.util.AutoHashMap(u32, system_gl.GbmContext.Buffer),
     renderer: *rendering.Renderer,
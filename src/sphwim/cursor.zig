@@ -66,3 +66,13 @@ pub fn makeRgba(alloc: std.mem.Allocator) ![]const u8 {
     }
     return ret;
 }
+
+// Pixel at x, y counted from the top left, as little endian ARGB8888
+pub fn argb8888(x: usize, y: usize) u32 {
+    return switch (data[y * width + x]) {
+        0 => 0x00000000,
+        1 => 0xff000000,
+        2 => 0xffffffff,
+        else => unreachable,
+    };
+}
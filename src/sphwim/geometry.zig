@@ -1,3 +1,4 @@
+const std = @import("std");
 const CompositorState = @import("CompositorState.zig");
 
 pub const PixelQuad = struct {
@@ -26,6 +27,22 @@ pub const PixelQuad = struct {
     pub fn bottom(self: PixelQuad) i32 {
         return self.cy + self.height / 2;
     }
+
+    // Nominal area, always painted
+    pub fn rect(self: PixelQuad) Rect {
+        return .{
+            .x = self.left(),
+            .y = self.top(),
+            .width = self.width,
+            .height = self.height,
+        };
+    }
+
+    // Rounding on odd sizes means a quad can touch one pixel past its
+    // nominal edges, pad so that damage always covers it
+    pub fn bounds(self: PixelQuad) Rect {
+        return self.rect().pad(1);
+    }
 };
 
 fn between(val: i32, a: i32, b: i32) bool {
@@ -71,7 +88,206 @@ pub const WindowBorder = struct {
         };
     }
 
+    // Everything drawn for the window, surface and decorations
+    pub fn bounds(self: WindowBorder) Rect {
+        return self.titleQuad().bounds().merge(self.windowTrim().bounds());
+    }
+
+    // Area the window is certain to paint, the opposite of bounds() which
+    // errs on the side of too large. The titlebar and trim overlap, so their
+    // bounding box has no gaps
+    pub fn coverage(self: WindowBorder) Rect {
+        return self.titleQuad().rect().merge(self.windowTrim().rect());
+    }
+
+    // Output position of the top left of the surface
+    pub fn surfaceOrigin(self: WindowBorder) struct { x: i32, y: i32 } {
+        return .{
+            .x = self.surface_cx - self.surface_width / 2,
+            .y = self.surface_cy - self.surface_height / 2,
+        };
+    }
+
     fn titlebarCy(self: WindowBorder) i32 {
         return self.surface_cy - titlebar_height / 2 - self.surface_height / 2;
     }
 };
+
+// Axis aligned rectangle, positioned from the top left
+pub const Rect = struct {
+    x: i32,
+    y: i32,
+    width: i32,
+    height: i32,
+
+    pub fn isEmpty(self: Rect) bool {
+        return self.width <= 0 or self.height <= 0;
+    }
+
+    // Clients routinely damage with INT32_MAX sized rects to mean "everything",
+    // so all math here saturates
+    pub fn clamp(self: Rect, width: i32, height: i32) Rect {
+        const left = std.math.clamp(self.x, 0, width);
+        const top = std.math.clamp(self.y, 0, height);
+        const right = std.math.clamp(self.x +| self.width, 0, width);
+        const bottom = std.math.clamp(self.y +| self.height, 0, height);
+
+        return .{
+            .x = left,
+            .y = top,
+            .width = @max(right - left, 0),
+            .height = @max(bottom - top, 0),
+        };
+    }
+
+    pub fn translate(self: Rect, x: i32, y: i32) Rect {
+        return .{
+            .x = self.x +| x,
+            .y = self.y +| y,
+            .width = self.width,
+            .height = self.height,
+        };
+    }
+
+    pub fn pad(self: Rect, amount: i32) Rect {
+        return .{
+            .x = self.x -| amount,
+            .y = self.y -| amount,
+            .width = self.width +| 2 * amount,
+            .height = self.height +| 2 * amount,
+        };
+    }
+
+    pub fn merge(self: Rect, other: Rect) Rect {
+        if (self.isEmpty()) return other;
+        if (other.isEmpty()) return self;
+
+        const left = @min(self.x, other.x);
+        const top = @min(self.y, other.y);
+        const right = @max(self.x +| self.width, other.x +| other.width);
+        const bottom = @max(self.y +| self.height, other.y +| other.height);
+
+        return .{
+            .x = left,
+            .y = top,
+            .width = right -| left,
+            .height = bottom -| top,
+        };
+    }
+
+    // Empty if the two do not overlap
+    pub fn intersect(self: Rect, other: Rect) Rect {
+        return self.translate(-other.x, -other.y)
+            .clamp(other.width, other.height)
+            .translate(other.x, other.y);
+    }
+
+    // What is left of self once other is cut out of it, as up to four
+    // non-overlapping rects: full width bands above and below, and the
+    // pieces either side in between
+    pub fn subtract(self: Rect, other: Rect) Split {
+        var ret = Split{};
+
+        const overlap = self.intersect(other);
+        if (overlap.isEmpty()) {
+            ret.add(self);
+            return ret;
+        }
+
+        const self_bottom = self.y +| self.height;
+        const self_right = self.x +| self.width;
+        const overlap_bottom = overlap.y +| overlap.height;
+        const overlap_right = overlap.x +| overlap.width;
+
+        ret.add(.{ .x = self.x, .y = self.y, .width = self.width, .height = overlap.y -| self.y });
+        ret.add(.{ .x = self.x, .y = overlap_bottom, .width = self.width, .height = self_bottom -| overlap_bottom });
+        ret.add(.{ .x = self.x, .y = overlap.y, .width = overlap.x -| self.x, .height = overlap.height });
+        ret.add(.{ .x = overlap_right, .y = overlap.y, .width = self_right -| overlap_right, .height = overlap.height });
+        return ret;
+    }
+
+    pub const Split = struct {
+        rects: [4]Rect = undefined,
+        len: usize = 0,
+
+        fn add(self: *Split, rect: Rect) void {
+            if (rect.isEmpty()) return;
+            self.rects[self.len] = rect;
+            self.len += 1;
+        }
+
+        pub fn slice(self: *const Split) []const Rect {
+            return self.rects[0..self.len];
+        }
+    };
+};
+
+// Damage accumulated between commits. Past a handful of rects the cost of
+// tracking them individually outweighs what we save, so everything collapses
+// into one bounding box
+pub const Damage = struct {
+    rects: [max_rects]Rect = undefined,
+    len: usize = 0,
+
+    pub const max_rects = 8;
+
+    pub fn add(self: *Damage, rect: Rect) void {
+        if (rect.isEmpty()) return;
+
+        if (self.len == max_rects) {
+            var bounds = rect;
+            for (self.rects[0..self.len]) |r| {
+                bounds = bounds.merge(r);
+            }
+            self.rects[0] = bounds;
+            self.len = 1;
+            return;
+        }
+
+        self.rects[self.len] = rect;
+        self.len += 1;
+    }
+
+    pub fn slice(self: *const Damage) []const Rect {
+        return self.rects[0..self.len];
+    }
+
+    pub fn bounds(self: *const Damage) Rect {
+        var ret = Rect{ .x = 0, .y = 0, .width = 0, .height = 0 };
+        for (self.slice()) |r| {
+            ret = ret.merge(r);
+        }
+        return ret;
+    }
+
+    pub fn clear(self: *Damage) void {
+        self.len = 0;
+    }
+};
+
+test "rect subtract" {
+    const outer = Rect{ .x = 0, .y = 0, .width = 10, .height = 10 };
+
+    const apart = outer.subtract(.{ .x = 20, .y = 20, .width = 5, .height = 5 });
+    try std.testing.expectEqualSlices(Rect, &.{outer}, apart.slice());
+
+    const covered = outer.subtract(.{ .x = -5, .y = -5, .width = 20, .height = 20 });
+    try std.testing.expectEqual(0, covered.slice().len);
+
+    const hole = outer.subtract(.{ .x = 3, .y = 4, .width = 2, .height = 2 });
+    try std.testing.expectEqualSlices(Rect, &.{
+        .{ .x = 0, .y = 0, .width = 10, .height = 4 },
+        .{ .x = 0, .y = 6, .width = 10, .height = 4 },
+        .{ .x = 0, .y = 4, .width = 3, .height = 2 },
+        .{ .x = 5, .y = 4, .width = 5, .height = 2 },
+    }, hole.slice());
+
+    const right_half = outer.subtract(.{ .x = 5, .y = -1, .width = 10, .height = 20 });
+    try std.testing.expectEqualSlices(Rect, &.{
+        .{ .x = 0, .y = 0, .width = 5, .height = 10 },
+    }, right_half.slice());
+
+    // Clients use INT32_MAX sized rects for everything
+    const everything = outer.subtract(.{ .x = 0, .y = 0, .width = std.math.maxInt(i32), .height = std.math.maxInt(i32) });
+    try std.testing.expectEqual(0, everything.slice().len);
+}
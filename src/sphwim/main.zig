@@ -7,6 +7,7 @@ const CompositorState = @import("CompositorState.zig");
 const system_gl = @import("system_gl.zig");
 const gl = sphtud.render.gl;
 const backend = @import("backend.zig");
+const PriorityDispatch = @import("PriorityDispatch.zig");
 
 pub const std_options = std.Options{
     .log_level = .warn,
@@ -51,7 +52,7 @@ const PeriodicMemoryDumper = struct {
             .vtable = &vtable,
             .desired_events = .{
                 .read = true,
-                .write = true,
+                .write = false,
             },
         };
     }
@@ -95,6 +96,15 @@ pub fn initializeGlParams() void {
     gl.glDepthFunc(gl.GL_LESS);
 }
 
+// SPHWIM_CLIENT_HIGH_WATER, in bytes
+fn outboundHighWater() usize {
+    const val = std.posix.getenv("SPHWIM_CLIENT_HIGH_WATER") orelse return wayland.Outbound.default_high_water;
+    return std.fmt.parseInt(usize, val, 10) catch {
+        std.log.warn("ignoring invalid SPHWIM_CLIENT_HIGH_WATER {s}", .{val});
+        return wayland.Outbound.default_high_water;
+    };
+}
+
 pub fn main() !void {
     var tpa: sphtud.alloc.TinyPageAllocator = undefined;
     try tpa.initPinned();
@@ -110,12 +120,24 @@ pub fn main() !void {
     const render_backend = try backend.initBackend(root_alloc.arena(), root_alloc.expansion(), &system_running);
     defer render_backend.deinit();
 
-    var gbm_context = try system_gl.GbmContext.init(render_backend.initial_res.width, render_backend.initial_res.height, render_backend.preferred_gpu);
+    var gbm_context = try system_gl.GbmContext.init(render_backend.preferred_gpu);
     errdefer gbm_context.deinit();
 
     var egl_context = try system_gl.EglContext.init(scratch.linear(), gbm_context);
     errdefer egl_context.deinit();
 
+    const output_surfaces = try root_alloc.arena().alloc(system_gl.OutputSurface, render_backend.outputs.len);
+    var num_output_surfaces: usize = 0;
+    // Backends keep state on the surfaces' buffer objects, which is released
+    // when they are destroyed. That has to happen before the backend goes
+    defer for (output_surfaces[0..num_output_surfaces]) |*surface| surface.deinit();
+    for (output_surfaces, render_backend.outputs) |*surface, res| {
+        surface.* = try .init(&gbm_context, &egl_context, res.width, res.height);
+        num_output_surfaces += 1;
+    }
+
+    // GL needs a current surface before anything can be loaded
+    try output_surfaces[0].makeCurrent();
     try sphtud.render.initGl(system_gl.getProcAddress);
 
     initializeGlParams();
@@ -124,8 +146,14 @@ pub fn main() !void {
     try std.posix.getrandom(std.mem.asBytes(&rng_seed));
     var rng = std.Random.DefaultPrng.init(rng_seed);
 
-    var compositor_state = try CompositorState.init(&root_alloc, &scratch, rng.random(), render_backend.initial_res);
-    var memory_dumper = try PeriodicMemoryDumper.init(&root_alloc, &scratch);
+    var compositor_state = try CompositorState.init(&root_alloc, &scratch, rng.random(), render_backend.outputs);
+    compositor_state.predict_cursor = std.posix.getenv("SPHWIM_NO_CURSOR_PREDICTION") == null;
+
+    // Wakes us up every few seconds, so only when asked for
+    var memory_dumper: ?PeriodicMemoryDumper = if (std.posix.getenv("SPHWIM_DUMP_MEMORY") != null)
+        try PeriodicMemoryDumper.init(&root_alloc, &scratch)
+    else
+        null;
 
     var gl_alloc = try sphtud.render.GlAlloc.init(&root_alloc);
     defer gl_alloc.deinit();
@@ -133,22 +161,35 @@ pub fn main() !void {
     const image_renderer = try sphtud.render.xyuvt_program.ImageRenderer.init(&gl_alloc, .rgba);
     const solid_color_renderer = try sphtud.render.xyt_program.solidColorProgram(&gl_alloc);
 
-    var renderer = try rendering.Renderer.init(
-        &root_alloc,
-        scratch.linear(),
-        &gl_alloc,
-        &egl_context,
-        &gbm_context,
-        &compositor_state,
-        image_renderer,
-        solid_color_renderer,
-    );
+    const renderers = try root_alloc.arena().alloc(rendering.Renderer, output_surfaces.len);
+    for (renderers, output_surfaces, 0..) |*renderer, *surface, i| {
+        renderer.* = try .init(
+            scratch.linear(),
+            &gl_alloc,
+            surface,
+            i,
+            &compositor_state,
+            image_renderer,
+            solid_color_renderer,
+        );
+    }
 
     var loop = try sphtud.event.Loop.init(
         root_alloc.arena(),
         root_alloc.expansion(),
     );
 
+    // Client messages are read and parsed off this thread, so that protocol
+    // traffic does not eat into the frame budget
+    var read_pool = try wayland.ReadPool.init(root_alloc.arena(), .{
+        .backend = if (std.posix.getenv("SPHWIM_IO_URING") != null) .io_uring else .epoll,
+    });
+    defer read_pool.deinit();
+
+    // Everything goes through here, so that input and vblank work are never
+    // held up behind clients that happened to be ready first
+    var dispatch = try PriorityDispatch.init();
+
     var server = try wayland.makeWaylandServer(
         try root_alloc.makeSubAlloc("server"),
         scratch.linear(),
@@ -156,16 +197,32 @@ pub fn main() !void {
         &compositor_state,
         &gbm_context,
         &egl_context,
+        &read_pool,
+        outboundHighWater(),
+        &dispatch,
     );
-    try loop.register(server.handler());
-    try loop.register(memory_dumper.handler());
-    const handlers = try render_backend.makeHandlers(root_alloc.arena(), &renderer, &compositor_state);
-    for (handlers) |handler| {
-        try loop.register(handler);
+    try loop.register(dispatch.handler());
+    try loop.register(try dispatch.wrap(root_alloc.arena(), .clients, server.handler()));
+    try loop.register(try dispatch.wrap(root_alloc.arena(), .housekeeping, compositor_state.hiddenFrameHandler()));
+    if (memory_dumper) |*d| try loop.register(try dispatch.wrap(root_alloc.arena(), .housekeeping, d.handler()));
+    const registrations = try render_backend.makeHandlers(root_alloc.arena(), renderers, &compositor_state);
+    for (registrations) |registration| {
+        try loop.register(try dispatch.wrap(root_alloc.arena(), registration.class, registration.handler));
     }
 
     while (system_running) {
         scratch.reset();
         try loop.wait(scratch.linear());
+        dispatch.dispatch();
     }
 }
+
+test {
+    _ = @import("wayland/ObjectTable.zig");
+    _ = @import("rendering.zig");
+    _ = @import("geometry.zig");
+    _ = @import("wayland/SpscQueue.zig");
+    _ = @import("wayland/Outbound.zig");
+    _ = @import("InputQueue.zig");
+    _ = @import("CompositorState.zig");
+}
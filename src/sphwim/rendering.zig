@@ -38,6 +38,189 @@ pub const RenderBuffer = struct {
     }
 };
 
+// State a backend keeps for a client buffer for as long as the wl_buffer
+// lives, the way gbm user data works for our own buffers. destroy is called
+// when the wl_buffer goes away
+pub const BufferUserData = struct {
+    data: ?*anyopaque = null,
+    destroy: ?*const fn (data: ?*anyopaque) void = null,
+
+    pub fn deinit(self: BufferUserData) void {
+        if (self.destroy) |destroy| destroy(self.data);
+    }
+};
+
+// A client buffer imported into GL once for its whole lifetime, rather than
+// once per frame. Failed imports are remembered as well so that a bad buffer
+// is rejected once instead of on every render
+pub const BufferTexture = struct {
+    texture: ?sphtud.render.Texture,
+
+    pub fn import(egl_ctx: *const system_gl.EglContext, buffer: RenderBuffer) BufferTexture {
+        const texture = importTexture(egl_ctx, buffer) catch |e| {
+            logger.warn("failed to import texture {t}, window will not be shown", .{e});
+            return .{ .texture = null };
+        };
+
+        return .{ .texture = texture };
+    }
+
+    pub fn deinit(self: BufferTexture) void {
+        if (self.texture) |t| {
+            gl.glDeleteTextures(1, &t.inner);
+        }
+    }
+};
+
+pub const shm_format_argb8888 = 0;
+pub const shm_format_xrgb8888 = 1;
+
+// dma-buf formats without an alpha channel, so whatever is behind them never
+// shows through. Only the ones clients commonly hand us, see drm_fourcc.h
+pub fn drmFormatIsOpaque(format: u32) bool {
+    const opaque_formats = [_]u32{
+        fourcc("XR24"),
+        fourcc("XB24"),
+        fourcc("RX24"),
+        fourcc("BX24"),
+        fourcc("XR30"),
+        fourcc("XB30"),
+        fourcc("RG16"),
+    };
+    return std.mem.indexOfScalar(u32, &opaque_formats, format) != null;
+}
+
+fn fourcc(comptime code: *const [4]u8) u32 {
+    return std.mem.readInt(u32, code, .little);
+}
+
+// Texture a wl_shm backed surface is copied into on commit, so that the client
+// can have its buffer back straight away. It lives as long as the surface's
+// size and format stay the same, and only damaged regions are uploaded into it
+pub const ShmTexture = struct {
+    texture: sphtud.render.Texture,
+    // Staging buffer for uploads, lets the driver copy into the texture
+    // asynchronously instead of stalling on client memory
+    pbo: gl.GLuint,
+    width: i32,
+    height: i32,
+    format: u32,
+
+    pub fn init(width: i32, height: i32, format: u32) !ShmTexture {
+        var texture = sphtud.render.Texture{ .inner = 0 };
+        gl.glGenTextures(1, &texture.inner);
+        if (texture.inner == 0) return error.GenTexture;
+        errdefer gl.glDeleteTextures(1, &texture.inner);
+
+        var pbo: gl.GLuint = 0;
+        gl.glGenBuffers(1, &pbo);
+        if (pbo == 0) return error.GenBuffer;
+
+        gl.glBindTexture(gl.GL_TEXTURE_2D, texture.inner);
+        defer gl.glBindTexture(gl.GL_TEXTURE_2D, 0);
+
+        gl.glTexImage2D(gl.GL_TEXTURE_2D, 0, gl.GL_RGBA8, width, height, 0, gl.GL_BGRA, gl.GL_UNSIGNED_BYTE, null);
+        gl.glTexParameteri(gl.GL_TEXTURE_2D, gl.GL_TEXTURE_MIN_FILTER, gl.GL_NEAREST);
+        gl.glTexParameteri(gl.GL_TEXTURE_2D, gl.GL_TEXTURE_MAG_FILTER, gl.GL_NEAREST);
+        if (format == shm_format_xrgb8888) {
+            // Whatever is in the X channel is garbage
+            gl.glTexParameteri(gl.GL_TEXTURE_2D, gl.GL_TEXTURE_SWIZZLE_A, gl.GL_ONE);
+        }
+
+        return .{
+            .texture = texture,
+            .pbo = pbo,
+            .width = width,
+            .height = height,
+            .format = format,
+        };
+    }
+
+    pub fn deinit(self: ShmTexture) void {
+        gl.glDeleteTextures(1, &self.texture.inner);
+        gl.glDeleteBuffers(1, &self.pbo);
+    }
+
+    pub fn matches(self: ShmTexture, width: i32, height: i32, format: u32) bool {
+        return self.width == width and self.height == height and self.format == format;
+    }
+
+    pub fn bufferTexture(self: ShmTexture) BufferTexture {
+        return .{ .texture = self.texture };
+    }
+
+    // data must hold stride * height bytes. Damage is in buffer coordinates
+    pub fn upload(self: *ShmTexture, data: []const u8, stride: u32, damage: []const geometry.Rect) !void {
+        const bytes_per_px = 4;
+
+        var total_size: usize = 0;
+        for (damage) |rect| {
+            const clamped = rect.clamp(self.width, self.height);
+            total_size += @as(usize, @intCast(clamped.width)) * @as(usize, @intCast(clamped.height)) * bytes_per_px;
+        }
+
+        if (total_size == 0) return;
+
+        gl.glBindBuffer(gl.GL_PIXEL_UNPACK_BUFFER, self.pbo);
+        defer gl.glBindBuffer(gl.GL_PIXEL_UNPACK_BUFFER, 0);
+
+        // Orphan whatever is still in flight from the last upload so that
+        // mapping never waits on the GPU
+        gl.glBufferData(gl.GL_PIXEL_UNPACK_BUFFER, @intCast(total_size), null, gl.GL_STREAM_DRAW);
+
+        {
+            const mapped_opt = gl.glMapBufferRange(
+                gl.GL_PIXEL_UNPACK_BUFFER,
+                0,
+                @intCast(total_size),
+                gl.GL_MAP_WRITE_BIT | gl.GL_MAP_INVALIDATE_BUFFER_BIT,
+            );
+            const mapped: [*]u8 = @ptrCast(mapped_opt orelse return error.MapBuffer);
+            defer _ = gl.glUnmapBuffer(gl.GL_PIXEL_UNPACK_BUFFER);
+
+            // Pack damaged rows tightly, the client's stride does not matter
+            // past this point
+            var offs: usize = 0;
+            for (damage) |rect| {
+                const clamped = rect.clamp(self.width, self.height);
+                if (clamped.isEmpty()) continue;
+
+                const row_len: usize = @as(usize, @intCast(clamped.width)) * bytes_per_px;
+                for (0..@intCast(clamped.height)) |row| {
+                    const y: usize = @as(usize, @intCast(clamped.y)) + row;
+                    const src_start = y * stride + @as(usize, @intCast(clamped.x)) * bytes_per_px;
+                    @memcpy(mapped[offs..][0..row_len], data[src_start..][0..row_len]);
+                    offs += row_len;
+                }
+            }
+        }
+
+        gl.glBindTexture(gl.GL_TEXTURE_2D, self.texture.inner);
+        defer gl.glBindTexture(gl.GL_TEXTURE_2D, 0);
+
+        gl.glPixelStorei(gl.GL_UNPACK_ALIGNMENT, 4);
+
+        var offs: usize = 0;
+        for (damage) |rect| {
+            const clamped = rect.clamp(self.width, self.height);
+            if (clamped.isEmpty()) continue;
+
+            gl.glTexSubImage2D(
+                gl.GL_TEXTURE_2D,
+                0,
+                clamped.x,
+                clamped.y,
+                clamped.width,
+                clamped.height,
+                gl.GL_BGRA,
+                gl.GL_UNSIGNED_BYTE,
+                @ptrFromInt(offs),
+            );
+            offs += @as(usize, @intCast(clamped.width)) * @as(usize, @intCast(clamped.height)) * bytes_per_px;
+        }
+    }
+};
+
 pub const Resolution = struct {
     width: u32,
     height: u32,
@@ -53,11 +236,11 @@ const window_border_color = sphtud.math.Vec3{
     45.0 / 255.0,
 };
 
+// One per output, all sharing the same GL context and so the same client
+// textures. Everything is drawn in the output's own coordinates
 pub const Renderer = struct {
-    frame_gl_alloc: *sphtud.render.GlAlloc,
-
-    egl_ctx: *system_gl.EglContext,
-    gbm_ctx: *system_gl.GbmContext,
+    surface: *system_gl.OutputSurface,
+    output_idx: usize,
 
     compositor_state: *CompositorState,
     image_renderer: sphtud.render.xyuvt_program.ImageRenderer,
@@ -70,17 +253,25 @@ pub const Renderer = struct {
     render_in_progress: bool,
     backend_rendering_buf: ?system_gl.GbmContext.Buffer,
 
-    // Eventually we won't need this, but for now it's useful to prove that the
-    // compositor is rendering
-    background_animation_state: f32 = 1.0,
+    damage_history: DamageHistory = .{},
+    // Frames went to the display without passing through our buffers, none
+    // of them know what is on screen any more
+    composition_stale: bool = false,
+    // Surfaces the display put on planes of their own last frame
+    overlaid: [CompositorState.max_scanout_buffers]CompositorState.Renderables.Handle = undefined,
+    num_overlaid: usize = 0,
     cursor_tex: sphtud.render.Texture,
+    // Where the cursor and a dragged window go in the frame being rendered
+    cursor_latch: CompositorState.CursorLatch = .{ .pos = .{ .x = 0, .y = 0 } },
+    // What the last frame drew away from where the compositor state has it,
+    // in global coordinates. Nobody else damages it
+    displaced: geometry.Damage = .{},
 
     pub fn init(
-        alloc: *sphtud.alloc.Sphalloc,
         scratch: sphtud.alloc.LinearAllocator,
         gl_alloc: *sphtud.render.GlAlloc,
-        egl_ctx: *system_gl.EglContext,
-        gbm_ctx: *system_gl.GbmContext,
+        surface: *system_gl.OutputSurface,
+        output_idx: usize,
         compositor_state: *CompositorState,
         image_renderer: sphtud.render.xyuvt_program.ImageRenderer,
         solid_color_renderer: sphtud.render.xyt_program.SolidColorProgram,
@@ -108,11 +299,10 @@ pub const Renderer = struct {
         fullscreen_quad_render_source.bindData(solid_color_renderer.handle(), fullscreen_quad_buf);
 
         return .{
-            .frame_gl_alloc = try gl_alloc.makeSubAlloc(alloc),
             .last_render_time = try std.time.Instant.now(),
             .compositor_state = compositor_state,
-            .egl_ctx = egl_ctx,
-            .gbm_ctx = gbm_ctx,
+            .surface = surface,
+            .output_idx = output_idx,
             .render_in_progress = false,
             .image_renderer = image_renderer,
             .solid_color_renderer = solid_color_renderer,
@@ -123,65 +313,223 @@ pub const Renderer = struct {
     }
 
     pub fn releaseBuffer(self: *Renderer, buf: system_gl.GbmContext.Buffer) void {
-        self.gbm_ctx.unlock(buf);
+        self.surface.unlock(buf);
     }
 
-    pub fn render(self: *Renderer) !?system_gl.GbmContext.Buffer {
+    // Surfaces in overlaid are left out, the backend shows them on planes
+    // above ours. Frame callbacks are up to the backend, which knows when
+    // the frame actually reaches the screen
+    pub fn render(self: *Renderer, overlaid: []const CompositorState.Renderables.Handle) !?system_gl.GbmContext.Buffer {
         const now = try std.time.Instant.now();
         defer self.last_render_time = now;
 
-        const delta_ns = now.since(self.last_render_time);
-        const delta = @as(f32, @floatFromInt(delta_ns)) / std.time.ns_per_s;
+        try self.surface.makeCurrent();
+
+        const output = self.outputRect();
+        const output_width = output.width;
+        const output_height = output.height;
+        gl.glViewport(0, 0, output_width, output_height);
+
+        const full_output = geometry.Rect{ .x = 0, .y = 0, .width = output_width, .height = output_height };
+
+        var frame_damage = geometry.Damage{};
+        const global_damage = self.compositor_state.takeDamage(self.output_idx);
+        for (global_damage.slice()) |rect| {
+            frame_damage.add(rect.translate(-output.x, -output.y));
+        }
+
+        if (self.composition_stale or !self.overlaidMatches(overlaid)) {
+            frame_damage.add(full_output);
+            self.composition_stale = false;
+        }
+
+        @memcpy(self.overlaid[0..overlaid.len], overlaid);
+        self.num_overlaid = overlaid.len;
+
+        self.cursor_latch = self.compositor_state.latchCursor(self.output_idx);
+        if (self.cursor_latch.dragged) |handle| {
+            // The plane it is on is positioned by the backend, it would come
+            // apart from its decorations
+            if (self.isOverlaid(handle)) self.cursor_latch.dragged = null;
+        }
+
+        const displaced = self.displacedDamage();
+        for ([_]*const geometry.Damage{ &self.displaced, &displaced }) |damage| {
+            for (damage.slice()) |rect| {
+                frame_damage.add(rect.translate(-output.x, -output.y));
+            }
+        }
+        self.displaced = displaced;
+
+        const frame_bounds = frame_damage.bounds().clamp(output_width, output_height);
+
+        // The back buffer still holds whatever was drawn into it last time it
+        // was used, so we only have to catch it up on what changed since
+        const repaint = self.damage_history.repaintRegion(frame_bounds, self.surface.bufferAge()) orelse full_output;
+        self.damage_history.push(frame_bounds);
+
+        if (!repaint.isEmpty()) {
+            gl.glEnable(gl.GL_SCISSOR_TEST);
+            defer gl.glDisable(gl.GL_SCISSOR_TEST);
+
+            // GL's origin is the bottom left
+            gl.glScissor(repaint.x, output_height - repaint.y - repaint.height, repaint.width, repaint.height);
+            self.renderScene();
+        }
+
+        var egl_damage: [geometry.Damage.max_rects][4]i32 = undefined;
+        var num_egl_damage: usize = 0;
+        for (frame_damage.slice()) |rect| {
+            const clamped = rect.clamp(output_width, output_height);
+            if (clamped.isEmpty()) continue;
+
+            egl_damage[num_egl_damage] = .{ clamped.x, output_height - clamped.y - clamped.height, clamped.width, clamped.height };
+            num_egl_damage += 1;
+        }
+
+        if (num_egl_damage == 0) {
+            // No rects would mean the whole surface changed
+            egl_damage[0] = .{ 0, 0, 0, 0 };
+            num_egl_damage = 1;
+        }
 
-        const background_red = @abs(self.background_animation_state - 1.0);
-        gl.glClearColor(background_red, 0.0, 0.0, 1.0);
+        try self.surface.swapBuffersWithDamage(egl_damage[0..num_egl_damage]);
+        const front_buf = try self.surface.lockFront();
+        errdefer self.surface.unlock(front_buf);
+
+        try self.compositor_state.latchFrame(self.output_idx, overlaid);
+        logger.debug("rendered after {d}ms", .{now.since(self.last_render_time) / std.time.ns_per_ms});
+
+        return front_buf;
+    }
+
+    // The topmost surface, if it covers the whole output on its own and so
+    // could be handed to the display as is. Whether the display can actually
+    // show it is up to the backend
+    pub fn scanoutCandidate(self: *Renderer) ?CompositorState.Renderable {
+        const state = self.compositor_state;
+        const output = self.outputRect();
+
+        // The software cursor is drawn from cursor_pos towards the bottom
+        // right, it is only out of the way when it cannot reach this output
+        if (state.hardware_cursor == null) {
+            const cursor_bounds = geometry.Rect{
+                .x = @intFromFloat(state.cursor_pos.x),
+                .y = @intFromFloat(state.cursor_pos.y),
+                .width = cursor_img.width,
+                .height = cursor_img.height,
+            };
+            if (!cursor_bounds.intersect(output).isEmpty()) return null;
+        }
+
+        var it = state.renderables.storage.iter();
+        const top = (it.next() orelse return null).val.*;
+
+        if (top.buffer.dmabuf == null) return null;
+        if (top.buffer.width != output.width or top.buffer.height != output.height) return null;
+
+        // Decorations sit outside of the surface, so they are off screen too
+        const origin = geometry.WindowBorder.fromRenderable(top).surfaceOrigin();
+        if (origin.x != output.x or origin.y != output.y) return null;
+
+        return top;
+    }
+
+    // Position of the output in the compositor's coordinate space
+    pub fn outputRect(self: *const Renderer) geometry.Rect {
+        return self.compositor_state.outputs[self.output_idx].rect;
+    }
+
+    // Called instead of render() when the backend showed the scanout
+    // candidate directly
+    pub fn notifyScanout(self: *Renderer) !void {
+        _ = self.compositor_state.takeDamage(self.output_idx);
+        self.composition_stale = true;
+
+        var it = self.compositor_state.renderables.storage.iter();
+        const top = it.next() orelse return;
+        try self.compositor_state.latchFrame(self.output_idx, &.{top.handle});
+    }
+
+    fn displacedDamage(self: *const Renderer) geometry.Damage {
+        var ret = geometry.Damage{};
+        const latch = self.cursor_latch;
+        if (!latch.isDisplaced()) return ret;
+
+        if (self.compositor_state.hardware_cursor == null) {
+            ret.add(CompositorState.cursorBoundsAt(latch.pos));
+        }
+
+        if (latch.dragged) |handle| {
+            const renderable = self.compositor_state.renderables.storage.get(handle);
+            ret.add(geometry.WindowBorder.fromRenderable(renderable.*).bounds().translate(latch.dx, latch.dy));
+        }
+
+        return ret;
+    }
+
+    fn overlaidMatches(self: *const Renderer, overlaid: []const CompositorState.Renderables.Handle) bool {
+        if (overlaid.len != self.num_overlaid) return false;
+        for (self.overlaid[0..self.num_overlaid], overlaid) |a, b| {
+            if (a.inner != b.inner) return false;
+        }
+        return true;
+    }
+
+    fn isOverlaid(self: *const Renderer, handle: CompositorState.Renderables.Handle) bool {
+        for (self.overlaid[0..self.num_overlaid]) |h| {
+            if (h.inner == handle.inner) return true;
+        }
+        return false;
+    }
+
+    fn renderScene(self: *Renderer) void {
+        gl.glClearColor(0.0, 0.0, 0.0, 1.0);
         gl.glClearDepth(std.math.inf(f32));
         gl.glClear(gl.GL_COLOR_BUFFER_BIT | gl.GL_DEPTH_BUFFER_BIT);
-        self.background_animation_state = @mod(self.background_animation_state + delta / 4.0, 2.0);
 
         const renderables = &self.compositor_state.renderables;
 
-        defer self.frame_gl_alloc.reset();
-
         const num_renderables = renderables.storage.count();
 
         var renderable_it = renderables.storage.iter();
         var depth: usize = 0;
         while (renderable_it.next()) |item| {
             defer depth += 1;
-            self.renderWindowSurface(item.val.*, depth, num_renderables) catch |e| {
-                logger.warn("failed to import texture {t}, skipping window", .{e});
-                continue;
-            };
 
-            const window_border = geometry.WindowBorder.fromRenderable(item.val.*);
+            var renderable = item.val.*;
+            if (self.cursor_latch.dragged) |dragged| {
+                if (dragged.inner == item.handle.inner) {
+                    renderable.cx += self.cursor_latch.dx;
+                    renderable.cy += self.cursor_latch.dy;
+                }
+            }
+
+            if (!self.isOverlaid(item.handle)) {
+                // Import failures were already logged when the buffer was created
+                self.renderWindowSurface(renderable, depth, num_renderables) catch continue;
+            }
+
+            const window_border = geometry.WindowBorder.fromRenderable(renderable);
 
             self.renderWindowTrim(window_border.titleQuad(), depth, num_renderables);
             self.renderWindowTrim(window_border.windowTrim(), depth, num_renderables);
         }
 
-        self.renderCursor();
-
-        try self.egl_ctx.swapBuffers();
-        const front_buf = try self.gbm_ctx.lockFront();
-        errdefer self.gbm_ctx.unlock(front_buf);
-
-        try self.compositor_state.requestFrame();
-        logger.debug("rendered after {d}ms", .{now.since(self.last_render_time) / std.time.ns_per_ms});
-
-        return front_buf;
+        if (self.compositor_state.hardware_cursor == null) {
+            self.renderCursor();
+        }
     }
 
     fn renderWindowSurface(self: *Renderer, renderable: CompositorState.Renderable, depth: usize, num_renderables: usize) !void {
-        const buffer = renderable.buffer;
-        const texture = try importTexture(self.frame_gl_alloc, self.egl_ctx, buffer);
+        const texture = renderable.buffer.texture.texture orelse return error.NoTexture;
 
-        const transform = quadTransform(.{
+        const transform = self.quadTransform(.{
             .cx = renderable.cx,
             .cy = renderable.cy,
             .width = @intCast(renderable.buffer.width),
             .height = @intCast(renderable.buffer.height),
-        }, self.compositor_state.compositor_res);
+        });
 
         var depth_f: f32 = @floatFromInt(depth);
         depth_f /= @floatFromInt(num_renderables);
@@ -189,7 +537,7 @@ pub const Renderer = struct {
     }
 
     fn renderWindowTrim(self: *Renderer, quad: geometry.PixelQuad, depth: usize, num_renderables: usize) void {
-        const transform = quadTransform(quad, self.compositor_state.compositor_res);
+        const transform = self.quadTransform(quad);
         var depth_f: f32 = @floatFromInt(depth);
         depth_f += 0.1;
         depth_f /= @floatFromInt(num_renderables);
@@ -200,15 +548,15 @@ pub const Renderer = struct {
         });
     }
 
+    // Fallback for backends without a cursor plane
     fn renderCursor(self: *Renderer) void {
-        // Proof of concept, render the cursor as a black square. A lot of
-        // drivers support hardware blitting of a cursor plane, for now I'm
-        // happy to just ignore that
-
-        logger.debug("cursor pos: {any}", .{self.compositor_state.cursor_pos});
-        const resolution = self.compositor_state.compositor_res;
-        const half_width = asf32(resolution.width) / 2;
-        const half_height = asf32(resolution.height) / 2;
+        const pos = self.cursor_latch.pos;
+        logger.debug("cursor pos: {any}", .{pos});
+        const output = self.outputRect();
+        const half_width = asf32(output.width) / 2;
+        const half_height = asf32(output.height) / 2;
+        const cursor_x = pos.x - asf32(output.x);
+        const cursor_y = pos.y - asf32(output.y);
 
         const transform = sphtud.math.Transform.translate(
             1.0,
@@ -217,11 +565,53 @@ pub const Renderer = struct {
             cursor_img.width / half_width / 2,
             cursor_img.height / half_height / 2,
         )).then(.translate(
-            -1.0 + self.compositor_state.cursor_pos.x / half_width,
-            1.0 - self.compositor_state.cursor_pos.y / half_height,
+            -1.0 + cursor_x / half_width,
+            1.0 - cursor_y / half_height,
         ));
         self.image_renderer.renderTextureAtDepth(self.cursor_tex, transform, -1.0);
     }
+
+    fn quadTransform(self: *const Renderer, quad: geometry.PixelQuad) sphtud.math.Transform {
+        const output = self.outputRect();
+        var local = quad;
+        local.cx -= output.x;
+        local.cy -= output.y;
+
+        return quadTransformForRes(local, .{
+            .width = @intCast(output.width),
+            .height = @intCast(output.height),
+        });
+    }
+};
+
+// Damage of the last few frames, so that we know what a back buffer of a
+// given age is missing
+const DamageHistory = struct {
+    frames: [max_age]geometry.Rect = undefined,
+    len: usize = 0,
+    // Where the next frame goes
+    head: usize = 0,
+
+    // Triple buffering is the deepest swap chain we expect to see
+    const max_age = 4;
+
+    fn push(self: *DamageHistory, rect: geometry.Rect) void {
+        self.frames[self.head] = rect;
+        self.head = (self.head + 1) % max_age;
+        self.len = @min(self.len + 1, max_age);
+    }
+
+    // Region to repaint for a buffer last drawn age frames ago, null if it
+    // has to be repainted entirely
+    fn repaintRegion(self: *const DamageHistory, current: geometry.Rect, age: usize) ?geometry.Rect {
+        if (age == 0 or age - 1 > self.len) return null;
+
+        var ret = current;
+        for (1..age) |i| {
+            ret = ret.merge(self.frames[(self.head + max_age - i) % max_age]);
+        }
+        return ret;
+    }
 };
 
 fn pxToNorm(px: i32, axis_size: u32) f32 {
@@ -235,16 +625,18 @@ fn pxToClip(px: i32, axis_size: u32) f32 {
     return pxToNorm(px - center, axis_size) * 2.0;
 }
 
-fn quadTransform(quad: geometry.PixelQuad, compositor_res: Resolution) sphtud.math.Transform {
-    return sphtud.math.Transform.scale(pxToNorm(quad.width, compositor_res.width), -pxToNorm(quad.height, compositor_res.height))
-        .then(.translate(pxToClip(quad.cx, compositor_res.width), -pxToClip(quad.cy, compositor_res.height)));
+fn quadTransformForRes(quad: geometry.PixelQuad, res: Resolution) sphtud.math.Transform {
+    return sphtud.math.Transform.scale(pxToNorm(quad.width, res.width), -pxToNorm(quad.height, res.height))
+        .then(.translate(pxToClip(quad.cx, res.width), -pxToClip(quad.cy, res.height)));
 }
 
-fn importTexture(gl_alloc: *sphtud.render.GlAlloc, egl_ctx: *const system_gl.EglContext, buffer: RenderBuffer) !sphtud.render.Texture {
+fn importTexture(egl_ctx: *const system_gl.EglContext, buffer: RenderBuffer) !sphtud.render.Texture {
     const egl_image = try egl_ctx.importDmaBuf(buffer);
     defer egl_ctx.freeEglImage(egl_image);
 
-    const texture = sphtud.render.Texture{ .inner = try gl_alloc.genTexture() };
+    var texture = sphtud.render.Texture{ .inner = 0 };
+    gl.glGenTextures(1, &texture.inner);
+    if (texture.inner == 0) return error.GenTexture;
 
     gl.glBindTexture(gl.GL_TEXTURE_2D, texture.inner);
     gl.glEGLImageTargetTexture2DOES(gl.GL_TEXTURE_2D, egl_image);
@@ -254,3 +646,30 @@ fn importTexture(gl_alloc: *sphtud.render.GlAlloc, egl_ctx: *const system_gl.Egl
 
     return texture;
 }
+
+test "damage history repaint region" {
+    const Rect = geometry.Rect;
+    var history = DamageHistory{};
+
+    const current = Rect{ .x = 60, .y = 0, .width = 10, .height = 10 };
+
+    // Age 0 means the buffer contents are undefined
+    try std.testing.expectEqual(null, history.repaintRegion(current, 0));
+    try std.testing.expectEqual(current, history.repaintRegion(current, 1).?);
+    try std.testing.expectEqual(null, history.repaintRegion(current, 2));
+
+    history.push(.{ .x = 0, .y = 0, .width = 10, .height = 10 });
+    history.push(.{ .x = 20, .y = 0, .width = 10, .height = 10 });
+    history.push(.{ .x = 40, .y = 0, .width = 10, .height = 10 });
+
+    try std.testing.expectEqual(current, history.repaintRegion(current, 1).?);
+    try std.testing.expectEqual(Rect{ .x = 40, .y = 0, .width = 30, .height = 10 }, history.repaintRegion(current, 2).?);
+    try std.testing.expectEqual(Rect{ .x = 0, .y = 0, .width = 70, .height = 10 }, history.repaintRegion(current, 4).?);
+    try std.testing.expectEqual(null, history.repaintRegion(current, 5));
+
+    // Only the last max_age frames are kept
+    history.push(.{ .x = 60, .y = 0, .width = 10, .height = 10 });
+    history.push(.{ .x = 80, .y = 0, .width = 10, .height = 10 });
+    try std.testing.expectEqual(Rect{ .x = 20, .y = 0, .width = 80, .height = 10 }, history.repaintRegion(.{ .x = 90, .y = 0, .width = 10, .height = 10 }, 5).?);
+    try std.testing.expectEqual(null, history.repaintRegion(current, 6));
+}
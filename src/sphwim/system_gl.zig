@@ -6,7 +6,6 @@ const rendering = @import("rendering.zig");
 pub const GbmContext = struct {
     drm_handle: std.fs.File,
     device: *c.gbm_device,
-    surface: *c.gbm_surface,
 
     pub const Buffer = struct {
         inner: *c.gbm_bo,
@@ -42,15 +41,28 @@ pub const GbmContext = struct {
         pub fn format(self: Buffer) u32 {
             return c.gbm_bo_get_format(self.inner);
         }
+
+        pub fn userData(self: Buffer) ?*anyopaque {
+            return c.gbm_bo_get_user_data(self.inner);
+        }
+
+        // GBM surfaces cycle through a small set of buffer objects for their
+        // whole lifetime, so per buffer state can be cached here and cleaned
+        // up when the buffer object is destroyed
+        pub fn setUserData(self: Buffer, data: ?*anyopaque, comptime destroy: ?fn (data: ?*anyopaque) void) void {
+            const destroy_fn = if (destroy) |f| &struct {
+                fn destroyUserData(_: ?*c.gbm_bo, user_data: ?*anyopaque) callconv(.c) void {
+                    f(user_data);
+                }
+            }.destroyUserData else null;
+
+            c.gbm_bo_set_user_data(self.inner, data, destroy_fn);
+        }
     };
 
     const format = c.GBM_FORMAT_XRGB8888;
 
-    pub fn init(
-        init_width: u32,
-        init_height: u32,
-        device_path: []const u8,
-    ) !GbmContext {
+    pub fn init(device_path: []const u8) !GbmContext {
         std.log.debug("Initializing GL context with GPU {s}\n", .{device_path});
 
         const f = try std.fs.openFileAbsolute(device_path, .{ .mode = .read_write });
@@ -59,29 +71,13 @@ pub const GbmContext = struct {
         const device = c.gbm_create_device(f.handle) orelse return error.GbmDeviceInit;
         errdefer c.gbm_device_destroy(device);
 
-        const surface = c.gbm_surface_create(device, init_width, init_height, format, c.GBM_BO_USE_SCANOUT | c.GBM_BO_USE_RENDERING) orelse return error.GbmSurfaceInit;
-        errdefer c.gbm_surface_destroy(surface);
-
         return .{
             .drm_handle = f,
             .device = device,
-            .surface = surface,
         };
     }
 
-    pub fn lockFront(self: *GbmContext) !Buffer {
-        const bo = c.gbm_surface_lock_front_buffer(self.surface) orelse return error.LockFailed;
-        if (c.gbm_bo_get_plane_count(bo) != 1) return error.Unimplemented;
-
-        return .{ .inner = bo };
-    }
-
-    pub fn unlock(self: *GbmContext, buf: Buffer) void {
-        c.gbm_surface_release_buffer(self.surface, buf.inner);
-    }
-
     pub fn deinit(self: *GbmContext) void {
-        c.gbm_surface_destroy(self.surface);
         c.gbm_device_destroy(self.device);
         self.drm_handle.close();
     }
@@ -99,13 +95,18 @@ pub const getProcAddress = c.eglGetProcAddress;
 // platforms... Maybe not big endian platforms, but probably
 pub const drm_modifier_invalid = 0xffffffffffffff;
 
+// Shared by every output, each of which renders into an OutputSurface of its
+// own
 pub const EglContext = struct {
     display: c.EGLDisplay,
     context: c.EGLContext,
-    surface: c.EGLSurface,
+    config: c.EGLConfig,
 
     eglQueryDmaBufFormatsEXT: c.PFNEGLQUERYDMABUFFORMATSEXTPROC,
     eglQueryDmaBufModifiersEXT: c.PFNEGLQUERYDMABUFMODIFIERSEXTPROC,
+    // null if the driver does not support it
+    eglSwapBuffersWithDamage: c.PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC,
+    supports_buffer_age: bool,
 
     pub fn init(scratch: sphtud.alloc.LinearAllocator, gbm_context: GbmContext) !EglContext {
         const cp = scratch.checkpoint();
@@ -162,48 +163,28 @@ pub const EglContext = struct {
             return error.CreateContext;
         }
 
-        const surface = c.eglCreateWindowSurface(display, config, @intFromPtr(gbm_context.surface), null);
-        if (surface == c.EGL_NO_SURFACE) {
-            return error.CreateSurface;
-        }
+        const extensions_ptr = c.eglQueryString(display, c.EGL_EXTENSIONS);
+        const extensions: []const u8 = if (extensions_ptr != null) std.mem.span(extensions_ptr) else "";
 
-        if (c.eglMakeCurrent(display, surface, surface, context) == 0) {
-            const err = c.eglGetError();
-            std.log.err("EGL error: {d}\n", .{err});
-            return error.UpdateContext;
-        }
+        const swap_with_damage: c.PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC = if (hasExtension(extensions, "EGL_KHR_swap_buffers_with_damage"))
+            @ptrCast(getProcAddress("eglSwapBuffersWithDamageKHR"))
+        else if (hasExtension(extensions, "EGL_EXT_swap_buffers_with_damage"))
+            @ptrCast(getProcAddress("eglSwapBuffersWithDamageEXT"))
+        else
+            null;
 
         return .{
             .display = display,
-            .surface = surface,
             .context = context,
+            .config = config,
             .eglQueryDmaBufFormatsEXT = @ptrCast(getProcAddress("eglQueryDmaBufFormatsEXT")),
             .eglQueryDmaBufModifiersEXT = @ptrCast(getProcAddress("eglQueryDmaBufModifiersEXT")),
+            .eglSwapBuffersWithDamage = swap_with_damage,
+            .supports_buffer_age = hasExtension(extensions, "EGL_EXT_buffer_age"),
         };
     }
 
-    pub fn swapBuffers(self: *const EglContext) !void {
-        if (c.eglSwapBuffers(self.display, self.surface) != c.EGL_TRUE) return error.SwapFailed;
-    }
-
-    pub fn getWidth(self: *const EglContext) !c.EGLint {
-        var ret: c.EGLint = 0;
-        if (c.eglQuerySurface(self.display, self.surface, c.EGL_WIDTH, &ret) != c.EGL_TRUE) {
-            return error.Query;
-        }
-        return ret;
-    }
-
-    pub fn getHeight(self: *const EglContext) !c.EGLint {
-        var ret: c.EGLint = 0;
-        if (c.eglQuerySurface(self.display, self.surface, c.EGL_HEIGHT, &ret) != c.EGL_TRUE) {
-            return error.Query;
-        }
-        return ret;
-    }
-
     pub fn deinit(self: *EglContext) void {
-        _ = c.eglDestroySurface(self.display, self.surface);
         _ = c.eglDestroyContext(self.display, self.context);
         _ = c.eglTerminate(self.display);
     }
@@ -382,3 +363,87 @@ pub const EglContext = struct {
         };
     }
 };
+
+// What one output renders into. GL draws into the EGL surface, and the
+// finished buffers come out of the gbm surface for the display
+pub const OutputSurface = struct {
+    egl_ctx: *const EglContext,
+    gbm_surface: *c.gbm_surface,
+    egl_surface: c.EGLSurface,
+
+    pub fn init(gbm_ctx: *const GbmContext, egl_ctx: *const EglContext, width: u32, height: u32) !OutputSurface {
+        const gbm_surface = c.gbm_surface_create(gbm_ctx.device, width, height, GbmContext.format, c.GBM_BO_USE_SCANOUT | c.GBM_BO_USE_RENDERING) orelse return error.GbmSurfaceInit;
+        errdefer c.gbm_surface_destroy(gbm_surface);
+
+        const egl_surface = c.eglCreateWindowSurface(egl_ctx.display, egl_ctx.config, @intFromPtr(gbm_surface), null);
+        if (egl_surface == c.EGL_NO_SURFACE) {
+            return error.CreateSurface;
+        }
+
+        return .{
+            .egl_ctx = egl_ctx,
+            .gbm_surface = gbm_surface,
+            .egl_surface = egl_surface,
+        };
+    }
+
+    pub fn deinit(self: *OutputSurface) void {
+        _ = c.eglDestroySurface(self.egl_ctx.display, self.egl_surface);
+        c.gbm_surface_destroy(self.gbm_surface);
+    }
+
+    // All outputs share one context, it has to be pointed at the right
+    // surface before rendering
+    pub fn makeCurrent(self: *const OutputSurface) !void {
+        if (c.eglMakeCurrent(self.egl_ctx.display, self.egl_surface, self.egl_surface, self.egl_ctx.context) == 0) {
+            const err = c.eglGetError();
+            std.log.err("EGL error: {d}\n", .{err});
+            return error.UpdateContext;
+        }
+    }
+
+    pub fn swapBuffers(self: *const OutputSurface) !void {
+        if (c.eglSwapBuffers(self.egl_ctx.display, self.egl_surface) != c.EGL_TRUE) return error.SwapFailed;
+    }
+
+    // Rects are x, y, width, height with the origin at the bottom left, as
+    // EGL wants them. Falls back to a full swap if the driver cannot take
+    // damage
+    pub fn swapBuffersWithDamage(self: *const OutputSurface, rects: []const [4]c.EGLint) !void {
+        const swap = self.egl_ctx.eglSwapBuffersWithDamage orelse return self.swapBuffers();
+        if (swap(self.egl_ctx.display, self.egl_surface, @ptrCast(@constCast(rects.ptr)), @intCast(rects.len)) != c.EGL_TRUE) {
+            return error.SwapFailed;
+        }
+    }
+
+    // Number of frames ago the current back buffer was last rendered to, 0
+    // if its contents are unknown
+    pub fn bufferAge(self: *const OutputSurface) usize {
+        if (!self.egl_ctx.supports_buffer_age) return 0;
+
+        var ret: c.EGLint = 0;
+        if (c.eglQuerySurface(self.egl_ctx.display, self.egl_surface, c.EGL_BUFFER_AGE_EXT, &ret) != c.EGL_TRUE) {
+            return 0;
+        }
+        return std.math.cast(usize, ret) orelse 0;
+    }
+
+    pub fn lockFront(self: *OutputSurface) !GbmContext.Buffer {
+        const bo = c.gbm_surface_lock_front_buffer(self.gbm_surface) orelse return error.LockFailed;
+        if (c.gbm_bo_get_plane_count(bo) != 1) return error.Unimplemented;
+
+        return .{ .inner = bo };
+    }
+
+    pub fn unlock(self: *OutputSurface, buf: GbmContext.Buffer) void {
+        c.gbm_surface_release_buffer(self.gbm_surface, buf.inner);
+    }
+};
+
+fn hasExtension(extensions: []const u8, name: []const u8) bool {
+    var it = std.mem.tokenizeScalar(u8, extensions, ' ');
+    while (it.next()) |ext| {
+        if (std.mem.eql(u8, ext, name)) return true;
+    }
+    return false;
+}
@@ -3,9 +3,12 @@ const sphtud = @import("sphtud");
 const CompositorState = @import("CompositorState.zig");
 const rendering = @import("rendering.zig");
 const system_gl = @import("system_gl.zig");
+const PriorityDispatch = @import("PriorityDispatch.zig");
 
 pub const Reader = @import("wayland/Reader.zig");
 pub const Connection = @import("wayland/Connection.zig");
+pub const ReadPool = @import("wayland/ReadPool.zig");
+pub const Outbound = @import("wayland/Outbound.zig");
 
 pub const FormatTable = struct {
     fd: std.posix.fd_t,
@@ -46,16 +49,20 @@ const ServerCtx = struct {
     compositor_state: *CompositorState,
     rand: std.Random,
     gbm_context: *const system_gl.GbmContext,
+    egl_context: *const system_gl.EglContext,
     format_table: FormatTable,
+    read_pool: *ReadPool,
+    outbound_high_water: usize,
+    dispatch: *PriorityDispatch,
 
     pub fn generate(self: *ServerCtx, connection: std.net.Server.Connection) !sphtud.event.Loop.Handler {
         const connection_alloc = try self.server_alloc.makeSubAlloc("connection");
         errdefer connection_alloc.deinit();
 
         const ret = try connection_alloc.arena().create(Connection);
-        ret.* = try Connection.init(connection_alloc, self.scratch, connection, self.rand, self.compositor_state, self.gbm_context, self.format_table);
+        ret.* = try Connection.init(connection_alloc, self.scratch, connection, self.rand, self.compositor_state, self.gbm_context, self.egl_context, self.format_table, self.read_pool, self.outbound_high_water);
 
-        return ret.handler();
+        return self.dispatch.wrap(connection_alloc.arena(), .clients, ret.handler());
     }
 
     pub fn close(self: *ServerCtx) void {
@@ -70,6 +77,10 @@ pub fn makeWaylandServer(
     compositor_state: *CompositorState,
     gbm_context: *const system_gl.GbmContext,
     egl_context: *const system_gl.EglContext,
+    read_pool: *ReadPool,
+    // Bytes queued for a client before its frame callbacks are held back
+    outbound_high_water: usize,
+    dispatch: *PriorityDispatch,
 ) !sphtud.event.net.Server(ServerCtx) {
     const xdg_runtime_dir = std.posix.getenv("XDG_RUNTIME_DIR") orelse return error.NoXdgRuntime;
 
@@ -103,6 +114,10 @@ pub fn makeWaylandServer(
         .rand = rand,
         .compositor_state = compositor_state,
         .gbm_context = gbm_context,
+        .egl_context = egl_context,
         .format_table = try FormatTable.init(scratch, egl_context),
+        .read_pool = read_pool,
+        .outbound_high_water = outbound_high_water,
+        .dispatch = dispatch,
     });
 }
@@ -1,14 +1,16 @@
 const std = @import("std");
 const sphtud = @import("sphtud");
-const Reader = @import("Reader.zig");
+const ReadPool = @import("ReadPool.zig");
+const Outbound = @import("Outbound.zig");
+const object_table = @import("ObjectTable.zig");
+const ObjectTable = object_table.ObjectTable;
 const rendering = @import("../rendering.zig");
 const Bindings = @import("wayland_bindings");
-const wlio = @import("wlio");
 const CompositorState = @import("../CompositorState.zig");
 const FdPool = @import("../FdPool.zig");
 const system_gl = @import("../system_gl.zig");
+const geometry = @import("../geometry.zig");
 const server = @import("../wayland.zig");
-const wl_cmsg = @import("wl_cmsg");
 
 const Connection = @This();
 
@@ -23,32 +25,51 @@ format_table: server.FormatTable,
 rand: std.Random,
 
 connection: std.net.Server.Connection,
-stream_reader: *Reader,
-io_reader: *std.Io.Reader,
+// Reading and parsing happens on one of read_pool's threads, we only apply
+// what comes out of inbound
+read_pool: *ReadPool,
+inbound: *ReadPool.Inbound,
+// Never blocks on the client, io_writer writes into it
+outbound: *Outbound,
 io_writer: *std.Io.Writer,
+// What the event loop waits on for us. Holds the inbound wake event, and the
+// socket while there is anything queued for it
+events: std.posix.fd_t,
+write_armed: bool = false,
+// Frame callbacks held back while the client was not reading what we sent.
+// Each surface still has its callback_id, it is sent with the next frame
+// once the client catches up
+frames_throttled: bool = false,
 
 compositor_state: *CompositorState,
 gbm_context: *const system_gl.GbmContext,
+egl_context: *const system_gl.EglContext,
 
-interface_registry: InterfaceRegistry,
-wl_surfaces: sphtud.util.AutoHashMap(WlSurfaceId, Surface),
-wl_buffers: sphtud.util.AutoHashMap(WlBufferId, *RefCountedRenderBuffer),
-zwp_params: sphtud.util.AutoHashMap(ZwpBufferParamsId, ?BufferParams),
-xdg_surfaces: sphtud.util.AutoHashMap(XdgSurfaceId, WlSurfaceId),
-windows: sphtud.util.AutoHashMap(XdgToplevelId, Window),
+// Every object the client can reference, pages are allocated with
+// alloc.general()
+objects: ObjectTable(Object),
 
-const typical_surfaces = 2;
-const max_surfaces = 100;
+// Frame callbacks are written as each surface is visited after a render, but
+// only flushed once per connection when all surfaces have been visited
+frame_events_pending: bool = false,
 
-const typical_windows = 2;
-const max_windows = 100;
+const display_id = 1;
 
-const typical_zwp_buffers = 2;
-const max_zwp_buffers = 100;
+// A poll hands the loop back after this many requests or this much time,
+// whichever comes first, so that one client flooding us cannot hold up
+// rendering, input or the other clients. Whatever is left is picked up on a
+// later pass, after everything else that was ready
+const max_requests_per_poll = 64;
+const max_ns_per_poll = 500 * std.time.ns_per_us;
 
-const typical_buffers = typical_surfaces * 2;
-const max_buffers = max_surfaces * 2;
-const display_id = 1;
+// wp_presentation_feedback.kind
+const presentation_kind_vsync = 0x1;
+const presentation_kind_hw_clock = 0x2;
+const presentation_kind_hw_completion = 0x4;
+const presentation_kind_zero_copy = 0x8;
+
+// wl_shm.error
+const shm_error_invalid_fd = 2;
 
 const vtable = sphtud.event.Loop.Handler.VTable{
     .poll = poll,
@@ -62,18 +83,37 @@ pub fn init(
     rand: std.Random,
     compositor_state: *CompositorState,
     gbm_context: *const system_gl.GbmContext,
+    egl_context: *const system_gl.EglContext,
     format_table: server.FormatTable,
+    read_pool: *ReadPool,
+    outbound_high_water: usize,
 ) !Connection {
-    const stream_writer = try alloc.arena().create(std.net.Stream.Writer);
-    stream_writer.* = connection.stream.writer(try alloc.arena().alloc(u8, 4096));
-    const io_writer = &stream_writer.interface;
+    const outbound = try alloc.arena().create(Outbound);
+    outbound.* = try .init(alloc.general(), connection.stream, outbound_high_water);
+    errdefer outbound.deinit();
 
     const fd_pool = try alloc.arena().create(FdPool);
     fd_pool.* = try .init(alloc, 8, 100);
 
-    const stream_reader = try alloc.arena().create(Reader);
-    stream_reader.* = try Reader.init(alloc.arena(), fd_pool, connection.stream);
-    const io_reader = &stream_reader.interface;
+    var objects = ObjectTable(Object).empty;
+    try objects.put(alloc.general(), display_id, .{ .generic = .wl_display });
+
+    const events = try std.posix.epoll_create1(std.os.linux.EPOLL.CLOEXEC);
+    errdefer std.posix.close(events);
+
+    const inbound = try alloc.arena().create(ReadPool.Inbound);
+    inbound.* = try .init(alloc.arena(), connection.stream);
+    errdefer inbound.deinit();
+
+    var wake_event = std.os.linux.epoll_event{
+        .events = std.os.linux.EPOLL.IN,
+        .data = .{ .fd = inbound.wake_event },
+    };
+    try std.posix.epoll_ctl(events, std.os.linux.EPOLL.CTL_ADD, inbound.wake_event, &wake_event);
+
+    // Nothing can fail past this point, the worker starts reading straight
+    // away
+    read_pool.add(inbound);
 
     return .{
         .alloc = alloc,
@@ -82,17 +122,15 @@ pub fn init(
         .rand = rand,
         .fd_pool = fd_pool,
         .format_table = format_table,
-        .stream_reader = stream_reader,
-        .io_writer = io_writer,
-        .io_reader = io_reader,
+        .read_pool = read_pool,
+        .inbound = inbound,
+        .outbound = outbound,
+        .io_writer = &outbound.interface,
+        .events = events,
         .compositor_state = compositor_state,
         .gbm_context = gbm_context,
-        .interface_registry = try .init(alloc),
-        .wl_surfaces = try .init(alloc.arena(), alloc.expansion(), typical_surfaces, max_surfaces),
-        .xdg_surfaces = try .init(alloc.arena(), alloc.expansion(), typical_surfaces, max_surfaces),
-        .windows = try .init(alloc.arena(), alloc.expansion(), typical_windows, max_windows),
-        .wl_buffers = try .init(alloc.arena(), alloc.expansion(), typical_surfaces, max_surfaces),
-        .zwp_params = try .init(alloc.arena(), alloc.expansion(), typical_zwp_buffers, max_zwp_buffers),
+        .egl_context = egl_context,
+        .objects = objects,
     };
 }
 
@@ -100,37 +138,145 @@ pub fn handler(self: *Connection) sphtud.event.Loop.Handler {
     return .{
         .ptr = self,
         .vtable = &vtable,
-        .fd = self.connection.stream.handle,
+        .fd = self.events,
         .desired_events = .{
             .read = true,
-            .write = true,
+            .write = false,
         },
     };
 }
 
-pub fn requestFrame(self: *Connection, surface_id: WlSurfaceId) !void {
-    const surface = self.wl_surfaces.getPtr(surface_id) orelse return error.InvalidSurface;
+// The surface's committed state has made it into the next frame, feedback
+// for it is answered once that frame is on screen
+pub fn latchPresentation(self: *Connection, surface_id: WlSurfaceId, zero_copy: bool) !void {
+    const surface = self.objectState(surface_id.inner, .wl_surface) orelse return error.InvalidSurface;
+    if (surface.committed_feedback.items.len == 0) return;
+
+    try surface.latched_feedback.appendSlice(self.alloc.general(), surface.committed_feedback.items);
+    surface.committed_feedback.clearRetainingCapacity();
+    surface.latched_zero_copy = zero_copy;
+}
+
+// The frame latched content went into is on screen
+pub fn presentFeedback(self: *Connection, surface_id: WlSurfaceId, presentation: CompositorState.Presentation) !void {
+    const surface = self.objectState(surface_id.inner, .wl_surface) orelse return error.InvalidSurface;
+    if (surface.latched_feedback.items.len == 0) return;
+
+    defer surface.latched_feedback.clearRetainingCapacity();
+
+    var global = Bindings.WlDisplay{ .id = display_id };
+
+    const sec = presentation.time_ns / std.time.ns_per_s;
+    var flags: u32 = 0;
+    if (presentation.vsync) flags |= presentation_kind_vsync;
+    if (presentation.hw_timestamp) flags |= presentation_kind_hw_clock | presentation_kind_hw_completion;
+    if (surface.latched_zero_copy) flags |= presentation_kind_zero_copy;
+
+    for (surface.latched_feedback.items) |feedback_id| {
+        const feedback = Bindings.WpPresentationFeedback{ .id = feedback_id };
+        try feedback.presented(self.io_writer, .{
+            .tv_sec_hi = @truncate(sec >> 32),
+            .tv_sec_lo = @truncate(sec),
+            .tv_nsec = @intCast(presentation.time_ns % std.time.ns_per_s),
+            .refresh = presentation.refresh_ns,
+            .seq_hi = @truncate(presentation.seq >> 32),
+            .seq_lo = @truncate(presentation.seq),
+            .flags = flags,
+        });
+
+        _ = self.objects.remove(feedback_id);
+        try global.deleteId(self.io_writer, .{ .id = feedback_id });
+    }
+
+    self.frame_events_pending = true;
+}
+
+// Answers the surface's frame callback, if it has one. time_ns is
+// CLOCK_MONOTONIC
+pub fn requestFrame(self: *Connection, surface_id: WlSurfaceId, time_ns: u64) !void {
+    const surface = self.objectState(surface_id.inner, .wl_surface) orelse return error.InvalidSurface;
     const callback_id = surface.callback_id orelse return;
 
+    // A client that does not read what we send gets no reason to draw more
+    if (self.outbound.overHighWater()) {
+        self.frames_throttled = true;
+        return;
+    }
+
     const wl_callback = Bindings.WlCallback{ .id = callback_id };
     try wl_callback.done(self.io_writer, .{
-        .callback_data = 0,
+        .callback_data = @truncate(time_ns / std.time.ns_per_ms),
     });
 
     surface.callback_id = null;
-    self.interface_registry.remove(callback_id);
 
     var global = Bindings.WlDisplay{ .id = display_id };
     try global.deleteId(self.io_writer, .{ .id = callback_id });
-    try self.io_writer.flush();
+
+    self.frame_events_pending = true;
+}
+
+// Content updates the user never got to see
+fn discardFeedback(self: *Connection, feedback_ids: *std.ArrayList(u32)) !void {
+    defer feedback_ids.clearRetainingCapacity();
+
+    var global = Bindings.WlDisplay{ .id = display_id };
+    for (feedback_ids.items) |feedback_id| {
+        const feedback = Bindings.WpPresentationFeedback{ .id = feedback_id };
+        try feedback.discarded(self.io_writer, .{});
+
+        _ = self.objects.remove(feedback_id);
+        try global.deleteId(self.io_writer, .{ .id = feedback_id });
+    }
+}
+
+pub fn flushFrameEvents(self: *Connection) void {
+    if (!self.frame_events_pending) return;
+    self.frame_events_pending = false;
+
+    // A failure here means the client is gone, we will find out and clean up
+    // the next time the connection is polled
+    self.flush() catch {
+        logger.warn("failed to send frame events", .{});
+    };
+}
+
+// The display has stopped showing buffer, if the surface has moved on from it
+// the client can have it back
+pub fn releaseScanoutBuffer(self: *Connection, surface_id: WlSurfaceId, buffer: WlBufferId) void {
+    const surface = self.objectState(surface_id.inner, .wl_surface) orelse return;
+
+    for (&surface.scanout_held) |*held_opt| {
+        const held = held_opt.* orelse continue;
+        if (held.buf_id.inner != buffer.inner) continue;
+
+        held_opt.* = null;
+        held.unref(self.alloc.general(), self.fd_pool);
+
+        const wl_buf_iface = Bindings.WlBuffer{ .id = buffer.inner };
+        // As with frame events, a failure means the client is gone
+        wl_buf_iface.release(self.io_writer, .{}) catch {};
+        self.flush() catch {
+            logger.warn("failed to send buffer release", .{});
+        };
+        return;
+    }
 }
 
 pub fn updateRenderableHandle(self: *Connection, surface: WlSurfaceId, handle: CompositorState.Renderables.Handle) void {
-    self.wl_surfaces.getPtr(surface).?.committed_buffer_handle = handle;
+    self.objectState(surface.inner, .wl_surface).?.committed_buffer_handle = handle;
 }
 
 fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sphtud.event.Loop.PollResult {
     const self: *Connection = @ptrCast(@alignCast(ctx));
+    const ret = self.pollResult();
+    // We are polled through PriorityDispatch, which only gets to close us
+    // the next time the loop finds us ready
+    if (ret == .complete) self.inbound.rewake();
+    return ret;
+}
+
+fn pollResult(self: *Connection) sphtud.event.Loop.PollResult {
     var message_buf: [4096]u8 = undefined;
     var diagnostics = HandleMessageDiagnostics{
         .msg_buf = &message_buf,
@@ -143,13 +289,8 @@ fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sph
 
         switch (e) {
             error.ReadFailed => {
-                switch (self.stream_reader.last_res) {
-                    .AGAIN => return .in_progress,
-                    else => {
-                        logWithTrace("failure to read wl client (stream {d})", .{self.stream_reader.last_res});
-                        return .complete;
-                    },
-                }
+                logWithTrace("failure to read wl client (stream {d})", .{self.inbound.failure_errno});
+                return .complete;
             },
             error.WriteFailed => {
                 logWithTrace("failure to write wl client", .{});
@@ -161,7 +302,7 @@ fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sph
                     .code = 1, // invalid_method
                     .message = "could not find fd for message",
                 }) catch {};
-                self.io_writer.flush() catch {};
+                self.flush() catch {};
                 return .complete;
             },
             error.OutOfMemory => {
@@ -170,7 +311,7 @@ fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sph
                     .code = 2, // no memory
                     .message = "memory allocated for client exhausted",
                 }) catch {};
-                self.io_writer.flush() catch {};
+                self.flush() catch {};
                 return .complete;
             },
             error.EndOfStream => {
@@ -182,14 +323,20 @@ fn poll(ctx: ?*anyopaque, _: *sphtud.event.Loop, _: sphtud.event.PollReason) sph
                     .invalid_object => 0,
                     .invalid_method => 1,
                     .none, .internal_err => 3,
+                    .object => |o| o.code,
+                };
+
+                const object_id: u32 = switch (diagnostics.err_typ) {
+                    .object => |o| o.id,
+                    else => display_id,
                 };
 
                 display.err(self.io_writer, .{
-                    .object_id = display_id,
+                    .object_id = object_id,
                     .code = code,
                     .message = diagnostics.message,
                 }) catch {};
-                self.io_writer.flush() catch {};
+                self.flush() catch {};
                 logWithTrace("{s}", .{diagnostics.message});
                 return .complete;
             },
@@ -206,64 +353,124 @@ fn logWithTrace(comptime msg: []const u8, args: anytype) void {
     }
 }
 fn pollError(self: *Connection, diagnostics: *HandleMessageDiagnostics) !void {
-    var retrying = false;
-    while (true) {
-        const header = try self.io_reader.peekStruct(wlio.HeaderLE, .little);
-        const data = (try self.io_reader.peek(header.size))[@sizeOf(wlio.HeaderLE)..];
+    self.inbound.consumeWake();
+
+    // Checked before draining, everything the worker queued before failing
+    // still gets handled
+    const failed = self.inbound.failed.load(.acquire);
+
+    const start_ns = CompositorState.monotonicNs();
+    var num_handled: usize = 0;
+    while (self.inbound.queue.peek()) |request| {
+        if (num_handled == max_requests_per_poll or CompositorState.monotonicNs() - start_ns > max_ns_per_poll) {
+            // Back of the line
+            self.inbound.rewake();
+            break;
+        }
+        num_handled += 1;
 
-        const interface_id = self.interface_registry.get(header.id) orelse {
-            return diagnostics.makeInvalidObjectError("cannot find interface for object {d}", .{header.id});
-        };
+        defer self.inbound.release(request);
 
-        const req = parseRequest(header.op, data, interface_id) catch |e| switch (e) {
-            error.InvalidLen, error.UnknownMessage => {
-                return diagnostics.makeInvalidMethodError("received malformed request", .{});
-            },
-        };
+        const fd = request.fd;
+        if (fd) |f| {
+            self.fd_pool.register(f) catch {
+                std.posix.close(f);
+                return error.OutOfMemory;
+            };
+        }
 
-        var fd: ?std.posix.fd_t = null;
-        if (requiresFd(req)) {
-            fd = self.stream_reader.fd_list.pop() orelse {
-                if (!retrying) {
-                    // While wayland messages do have a max size significantly
-                    // larger than this, typical messages will be ~8 bytes for
-                    // the header + < 5 ints alongside
-                    //
-                    // This means most messages sill be <= 28 bytes. Filling a
-                    // 4K buffer would give us > 140 messages
-                    //
-                    // If someone is sending a message requiring an fd 140
-                    // messages before the file descriptor comes in, they can
-                    // get shut down
-                    //
-                    // Try one time to fill the buffer as much as possible, if
-                    // we still don't have the file descriptor, return an error
-                    try self.io_reader.fillMore();
-                    retrying = true;
-                    continue;
-                }
+        // The worker only knows what was created, not what has been
+        // destroyed since
+        const object = self.objects.get(request.object_id) orelse {
+            return diagnostics.makeInvalidObjectError("cannot find interface for object {d}", .{request.object_id});
+        };
+        if (object.interface() != std.meta.activeTag(request.message)) {
+            return diagnostics.makeInvalidObjectError("object {d} is no longer a {t}", .{ request.object_id, std.meta.activeTag(request.message) });
+        }
 
-                return error.NoFd;
+        try self.handleMessage(request.object_id, request.message, fd, diagnostics);
+    }
+    self.inbound.resumeIfStalled();
+
+    // The failure comes after everything still queued
+    if (failed and self.inbound.queue.peek() == null) {
+        const err = self.inbound.failure;
+        if (err == error.Diagnostic) {
+            const diagnostic = self.inbound.diagnostic;
+            diagnostics.err_typ = switch (diagnostic.kind) {
+                .invalid_object => .invalid_object,
+                .invalid_method => .invalid_method,
             };
+            diagnostics.message = diagnostics.makeMessage("{s}", .{diagnostic.message});
         }
+        return err;
+    }
 
-        _ = try self.io_reader.discard(.limited(header.size));
-        retrying = false;
+    // Everything we produced while handling this batch of requests goes out
+    // in one write, along with whatever an earlier one left queued
+    try self.flush();
 
-        try self.handleMessage(header.id, req, fd, diagnostics);
-        try self.io_writer.flush();
+    if (self.frames_throttled and !self.outbound.overHighWater()) {
+        self.resumeFrames();
+    }
+}
+
+// Sends what the socket takes, and has the loop tell us when it takes more
+fn flush(self: *Connection) !void {
+    try self.io_writer.flush();
+
+    const want_write = !self.outbound.isEmpty();
+    if (want_write == self.write_armed) return;
+
+    var event = std.os.linux.epoll_event{
+        .events = std.os.linux.EPOLL.OUT,
+        .data = .{ .fd = self.connection.stream.handle },
+    };
+    const op = if (want_write) std.os.linux.EPOLL.CTL_ADD else std.os.linux.EPOLL.CTL_DEL;
+    std.posix.epoll_ctl(self.events, op, self.connection.stream.handle, &event) catch |e| {
+        logger.err("failed to update client write interest: {t}", .{e});
+        return error.WriteFailed;
+    };
+    self.write_armed = want_write;
+}
+
+// The client has caught up, frame callbacks held back go out with the next
+// frame of whatever shows their surface
+fn resumeFrames(self: *Connection) void {
+    self.frames_throttled = false;
+
+    var object_it = self.objects.iter();
+    while (object_it.next()) |entry| {
+        const surface = switch (entry.val.*) {
+            .wl_surface => |surface| surface,
+            else => continue,
+        };
+        if (surface.callback_id == null) continue;
+        const handle = surface.committed_buffer_handle orelse continue;
+        self.compositor_state.scheduleRenderableFrame(handle);
     }
 }
 
 fn close(ctx: ?*anyopaque) void {
     const self: *Connection = @ptrCast(@alignCast(ctx));
-    var surface_it = self.wl_surfaces.iter();
-    while (surface_it.next()) |surface| {
-        if (surface.val.committed_buffer_handle) |h| {
-            self.compositor_state.removeRenderable(h);
+    // Imported textures and renderables are not owned by our allocator, they
+    // have to be released explicitly
+    var object_it = self.objects.iter();
+    while (object_it.next()) |entry| {
+        switch (entry.val.*) {
+            .wl_surface => |surface| surface.deinit(self.alloc.general(), self.fd_pool, self.compositor_state),
+            .wl_buffer => |buffer| buffer.unref(self.alloc.general(), self.fd_pool),
+            .wl_shm_pool => |pool| pool.unref(self.alloc.general()),
+            else => {},
         }
     }
 
+    // The worker has to be done with the socket before it can be closed
+    self.read_pool.remove(self.inbound);
+    self.inbound.deinit();
+    self.outbound.deinit();
+    std.posix.close(self.events);
+
     self.fd_pool.closeAll();
     self.connection.stream.close();
     self.alloc.deinit();
@@ -313,6 +520,8 @@ const HandleMessageDiagnostics = struct {
         internal_err,
         invalid_object,
         invalid_method,
+        // An error defined by the interface of the object it is posted on
+        object: struct { id: u32, code: u32 },
     };
 
     fn makeMessage(self: *HandleMessageDiagnostics, comptime msg: []const u8, args: anytype) [:0]const u8 {
@@ -342,6 +551,13 @@ const HandleMessageDiagnostics = struct {
 
         return error.Diagnostic;
     }
+
+    fn makeObjectError(self: *HandleMessageDiagnostics, object_id: u32, code: u32, comptime msg: []const u8, args: anytype) HandleMessageError {
+        self.err_typ = .{ .object = .{ .id = object_id, .code = code } };
+        self.message = self.makeMessage(msg, args);
+
+        return error.Diagnostic;
+    }
 };
 
 const HandleMessageError = error{
@@ -360,12 +576,13 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         .zwp_linux_dmabuf_v1,
         .wl_seat,
         .wl_shm,
+        .wp_presentation,
     };
 
     switch (req) {
         .wl_display => |parsed| switch (parsed) {
             .get_registry => |params| {
-                try self.interface_registry.put(params.registry, .wl_registry, diagnostics);
+                try self.putObject(params.registry, .{ .generic = .wl_registry }, diagnostics);
 
                 const registry = Bindings.WlRegistry{ .id = params.registry };
                 for (supported_interfaces) |interface| {
@@ -389,28 +606,52 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         .wl_registry => |parsed| switch (parsed) {
             .bind => |params| {
                 const interface: Bindings.WaylandInterfaceType = @enumFromInt(params.name);
-                try self.interface_registry.put(params.id, interface, diagnostics);
+                try self.putObject(params.id, .{ .generic = interface }, diagnostics);
+
+                if (interface == .wl_shm) {
+                    const shm = Bindings.WlShm{ .id = params.id };
+                    for (supported_shm_formats) |format| {
+                        try shm.format(self.io_writer, .{ .format = format });
+                    }
+                }
+
+                if (interface == .wp_presentation) {
+                    // Page flip timestamps are in CLOCK_MONOTONIC, as is
+                    // everything else we stamp frames with
+                    const presentation = Bindings.WpPresentation{ .id = params.id };
+                    try presentation.clockId(self.io_writer, .{
+                        .clk_id = @intFromEnum(std.posix.clockid_t.MONOTONIC),
+                    });
+                }
             },
         },
         .wl_region => |parsed| switch (parsed) {
             .destroy => {
-                self.interface_registry.remove(object_id);
+                _ = self.objects.remove(object_id);
             },
             else => logUnhandledRequest(object_id, req),
         },
         .wl_compositor => |parsed| switch (parsed) {
             .create_surface => |params| {
-                const wl_surface_id = WlSurfaceId{ .inner = params.id };
-                try self.wl_surfaces.put(wl_surface_id, .{});
-                try self.interface_registry.put(params.id, .wl_surface, diagnostics);
+                try self.putObject(params.id, .{ .wl_surface = .{} }, diagnostics);
             },
             .create_region => |params| {
-                try self.interface_registry.put(params.id, .wl_region, diagnostics);
+                try self.putObject(params.id, .{ .generic = .wl_region }, diagnostics);
             },
         },
         .wl_shm => |parsed| switch (parsed) {
             .create_pool => |params| {
-                try self.interface_registry.put(params.id, .wl_shm_pool, diagnostics);
+                // The mapping holds its own reference to the file
+                defer self.fd_pool.close(fd.?);
+
+                const pool = ShmPool.init(self.alloc.general(), fd.?, params.size) catch |e| switch (e) {
+                    error.OutOfMemory => return error.OutOfMemory,
+                    error.FileTooSmall => return diagnostics.makeObjectError(object_id, shm_error_invalid_fd, "shm pool of size {d} is larger than its file", .{params.size}),
+                    else => return diagnostics.makeInvalidMethodError("failed to map shm pool of size {d} ({t})", .{ params.size, e }),
+                };
+                errdefer pool.unref(self.alloc.general());
+
+                try self.putObject(params.id, .{ .wl_shm_pool = pool }, diagnostics);
             },
             else => {
                 logUnhandledRequest(object_id, req);
@@ -418,24 +659,56 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
             },
         },
         .wl_shm_pool => |parsed| switch (parsed) {
+            .create_buffer => |params| {
+                const pool = self.objectState(object_id, .wl_shm_pool) orelse {
+                    return diagnostics.makeInternalErr("wl_shm_pool storage missing {d}", .{object_id});
+                };
+
+                const buffer = ShmBuffer.init(.{ .inner = params.id }, pool.*, params.offset, params.width, params.height, params.stride, params.format) catch |e| {
+                    return diagnostics.makeInvalidMethodError("invalid shm buffer {d}x{d} stride {d} offset {d} format {d} ({t})", .{
+                        params.width,
+                        params.height,
+                        params.stride,
+                        params.offset,
+                        params.format,
+                        e,
+                    });
+                };
+                errdefer buffer.pool.unref(self.alloc.general());
+
+                try self.putObject(params.id, .{ .wl_buffer = .{ .shm = buffer } }, diagnostics);
+            },
+            .resize => |params| {
+                const pool = self.objectState(object_id, .wl_shm_pool) orelse {
+                    return diagnostics.makeInternalErr("wl_shm_pool storage missing {d}", .{object_id});
+                };
+
+                pool.*.resize(params.size) catch |e| switch (e) {
+                    error.FileTooSmall => return diagnostics.makeObjectError(object_id, shm_error_invalid_fd, "shm pool resized to {d}, past the end of its file", .{params.size}),
+                    else => return diagnostics.makeInvalidMethodError("failed to resize shm pool to {d} ({t})", .{ params.size, e }),
+                };
+            },
             .destroy => {
-                self.interface_registry.remove(object_id);
+                const removed = self.objects.remove(object_id);
+                if (removed == null or removed.? != .wl_shm_pool) {
+                    return diagnostics.makeInternalErr("trying to remove invalid wl_shm_pool {d}", .{object_id});
+                }
+                removed.?.wl_shm_pool.unref(self.alloc.general());
             },
-            else => logUnhandledRequest(object_id, req),
         },
         .xdg_wm_base => |parsed| switch (parsed) {
             .get_xdg_surface => |params| {
                 const wl_surface_id = WlSurfaceId{ .inner = params.surface };
                 const xdg_id = XdgSurfaceId{ .inner = params.id };
 
-                const surface = self.wl_surfaces.getPtr(wl_surface_id) orelse {
+                const surface = self.objectState(wl_surface_id.inner, .wl_surface) orelse {
                     return diagnostics.makeInvalidMethodError("get_xdg_surface called with invalid wl_surface handle {d}", .{params.surface});
                 };
 
                 // FIXME: If wl_surface has a role this should emit a role error
 
-                try self.xdg_surfaces.put(xdg_id, wl_surface_id);
-                try self.interface_registry.put(params.id, .xdg_surface, diagnostics);
+                // Table pages never move, surface stays valid across the put
+                try self.putObject(params.id, .{ .xdg_surface = wl_surface_id }, diagnostics);
 
                 try self.emitXdgSurfaceConfigure(xdg_id, surface);
             },
@@ -446,9 +719,7 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         },
         .xdg_surface => |parsed| switch (parsed) {
             .get_toplevel => |params| {
-                const toplevel_id = XdgToplevelId{ .inner = params.id };
-                try self.windows.put(toplevel_id, .{});
-                try self.interface_registry.put(params.id, .xdg_toplevel, diagnostics);
+                try self.putObject(params.id, .{ .xdg_toplevel = .{} }, diagnostics);
                 const toplevel = Bindings.XdgToplevel{ .id = params.id };
 
                 try toplevel.configure(self.io_writer, .{
@@ -481,15 +752,13 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         },
         .xdg_toplevel => |parsed| switch (parsed) {
             .set_title => |params| {
-                const toplevel_id = XdgToplevelId{ .inner = object_id };
-                const window = self.windows.getPtr(toplevel_id) orelse {
+                const window = self.objectState(object_id, .xdg_toplevel) orelse {
                     return diagnostics.makeInternalErr("xdg_toplevel missing internal storage {d}", .{object_id});
                 };
                 try window.setTitle(self.alloc.general(), params.title);
             },
             .set_app_id => |params| {
-                const toplevel_id = XdgToplevelId{ .inner = object_id };
-                const window = self.windows.getPtr(toplevel_id) orelse {
+                const window = self.objectState(object_id, .xdg_toplevel) orelse {
                     return diagnostics.makeInternalErr("xdg_toplevel missing internal storage {d}", .{object_id});
                 };
                 try window.setAppId(self.alloc.general(), params.app_id);
@@ -509,30 +778,90 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
                     return;
                 }
 
+                defer surface.pending_damage.clear();
+
+                // Feedback for the previous commit is superseded if it did
+                // not make it into a frame before this one
+                try self.discardFeedback(&surface.committed_feedback);
+                std.mem.swap(std.ArrayList(u32), &surface.committed_feedback, &surface.pending_feedback);
+
+                // Damage schedules a frame on its own, but a client waiting
+                // on a frame callback or feedback needs one even if nothing
+                // changed
+                if (surface.callback_id != null or surface.committed_feedback.items.len > 0) {
+                    if (surface.committed_buffer_handle) |h| {
+                        self.compositor_state.scheduleRenderableFrame(h);
+                    }
+                }
+
                 if (surface.pending_buffer) |next_buf| {
                     defer surface.pending_buffer = null;
 
                     if (surface.committed_buffer) |ref_counted_buf| {
-                        ref_counted_buf.unref(self.alloc.general(), self.fd_pool);
+                        surface.committed_buffer = null;
+
+                        // Still on screen, released once the display flips
+                        // away from it
+                        const held = self.compositor_state.isScanoutLocked(self, wl_surface_id, ref_counted_buf.buf_id) and
+                            surface.holdForScanout(ref_counted_buf);
+
+                        if (!held) {
+                            ref_counted_buf.unref(self.alloc.general(), self.fd_pool);
 
-                        const wl_buf_iface = Bindings.WlBuffer{ .id = ref_counted_buf.buf_id.inner };
-                        try wl_buf_iface.release(self.io_writer, .{});
+                            const wl_buf_iface = Bindings.WlBuffer{ .id = ref_counted_buf.buf_id.inner };
+                            try wl_buf_iface.release(self.io_writer, .{});
+                        }
                     }
 
-                    surface.committed_buffer = next_buf;
+                    const renderable_buffer: CompositorState.RenderableBuffer = switch (next_buf) {
+                        .dmabuf => |dmabuf| blk: {
+                            if (surface.shm_texture) |t| {
+                                t.deinit();
+                                surface.shm_texture = null;
+                            }
+
+                            surface.committed_buffer = dmabuf;
+
+                            break :blk .{
+                                .id = dmabuf.buf_id,
+                                .width = dmabuf.render_buffer.width,
+                                .height = dmabuf.render_buffer.height,
+                                .dmabuf = dmabuf.render_buffer,
+                                .dmabuf_user_data = &dmabuf.user_data,
+                                .texture = dmabuf.texture,
+                                .is_opaque = rendering.drmFormatIsOpaque(dmabuf.render_buffer.format),
+                            };
+                        },
+                        .shm => |shm_buf| blk: {
+                            defer shm_buf.pool.unref(self.alloc.general());
+
+                            const texture = surface.uploadShm(shm_buf) catch {
+                                return diagnostics.makeObjectError(shm_buf.id.inner, shm_error_invalid_fd, "shm pool file was truncated while in use", .{});
+                            };
+
+                            // We have our own copy, the client can re-use
+                            // the buffer immediately
+                            const wl_buf_iface = Bindings.WlBuffer{ .id = shm_buf.id.inner };
+                            try wl_buf_iface.release(self.io_writer, .{});
+
+                            break :blk .{
+                                .id = shm_buf.id,
+                                .width = shm_buf.width,
+                                .height = shm_buf.height,
+                                .dmabuf = null,
+                                .texture = texture,
+                                .is_opaque = shm_buf.format == rendering.shm_format_xrgb8888,
+                            };
+                        },
+                    };
 
                     if (surface.committed_buffer_handle) |h| {
-                        self.compositor_state.renderables.swapBuffer(
-                            h,
-                            next_buf.render_buffer,
-                            next_buf.buf_id,
-                        );
+                        self.compositor_state.commitRenderableBuffer(h, renderable_buffer, surface.pending_damage.slice());
                     } else {
                         surface.committed_buffer_handle = try self.compositor_state.pushRenderable(
                             self,
                             wl_surface_id,
-                            next_buf.render_buffer,
-                            next_buf.buf_id,
+                            renderable_buffer,
                         );
                     }
                 }
@@ -553,18 +882,46 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
                 if (surface.pending_buffer) |old_buf| old_buf.unref(self.alloc.general(), self.fd_pool);
                 surface.pending_buffer = buffer.ref();
             },
-            .destroy => {
+            .damage => |params| {
                 const wl_surface_id = WlSurfaceId{ .inner = object_id };
+                const surface = try self.getWlSurface(wl_surface_id, .interface, diagnostics);
 
-                const surface = self.wl_surfaces.remove(wl_surface_id) orelse {
+                // We do not support scale or transforms, surface and buffer
+                // coordinates are the same thing
+                surface.pending_damage.add(.{
+                    .x = params.x,
+                    .y = params.y,
+                    .width = params.width,
+                    .height = params.height,
+                });
+            },
+            .damage_buffer => |params| {
+                const wl_surface_id = WlSurfaceId{ .inner = object_id };
+                const surface = try self.getWlSurface(wl_surface_id, .interface, diagnostics);
+
+                surface.pending_damage.add(.{
+                    .x = params.x,
+                    .y = params.y,
+                    .width = params.width,
+                    .height = params.height,
+                });
+            },
+            .destroy => {
+                if (self.objectState(object_id, .wl_surface)) |surface| {
+                    try self.discardFeedback(&surface.pending_feedback);
+                    try self.discardFeedback(&surface.committed_feedback);
+                    try self.discardFeedback(&surface.latched_feedback);
+                }
+
+                const removed = self.objects.remove(object_id);
+                if (removed == null or removed.? != .wl_surface) {
                     return diagnostics.makeInternalErr("removing wl surface {d} that does not exist", .{object_id});
-                };
-                surface.deinit(self.alloc.general(), self.fd_pool, self.compositor_state);
+                }
+                removed.?.wl_surface.deinit(self.alloc.general(), self.fd_pool, self.compositor_state);
 
                 // FIXME: Check if we leak an xdg surface here
                 //
 
-                self.interface_registry.remove(object_id);
                 const global = Bindings.WlDisplay{ .id = display_id };
                 try global.deleteId(self.io_writer, .{
                     .id = object_id,
@@ -601,35 +958,30 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
                 const wl_buffer_id = WlBufferId{ .inner = params.buffer_id };
 
                 {
-                    const buf = try RefCountedRenderBuffer.init(self.alloc.general(), wl_buffer_id, buf_params, params.width, params.height, params.format, params.flags);
+                    const buf = try RefCountedRenderBuffer.init(self.alloc.general(), self.egl_context, wl_buffer_id, buf_params, params.width, params.height, params.format, params.flags);
                     errdefer buf.unref(self.alloc.general(), self.fd_pool);
 
-                    try self.wl_buffers.put(wl_buffer_id, buf);
+                    try self.putObject(wl_buffer_id.inner, .{ .wl_buffer = .{ .dmabuf = buf } }, diagnostics);
                 }
 
                 // Ensure that on destroy we have nothing to cleanup, it's not
                 // ours anymore
                 buf_params_opt.* = null;
 
-                try self.interface_registry.put(wl_buffer_id.inner, .wl_buffer, diagnostics);
-
                 const iface = Bindings.ZwpLinuxBufferParamsV1{ .id = object_id };
                 try iface.created(self.io_writer, .{
                     .buffer = params.buffer_id,
                 });
             },
             .destroy => {
-                const zwp_buf_params_id = ZwpBufferParamsId{ .inner = object_id };
-
-                const removed_params = self.zwp_params.remove(zwp_buf_params_id) orelse {
+                const removed = self.objects.remove(object_id);
+                if (removed == null or removed.? != .zwp_linux_buffer_params_v1) {
                     return diagnostics.makeInternalErr("failed to find internal storage for params buf {d}", .{object_id});
-                };
+                }
 
-                if (removed_params) |params| {
+                if (removed.?.zwp_linux_buffer_params_v1) |params| {
                     self.fd_pool.close(params.fd);
                 }
-
-                self.interface_registry.remove(object_id);
             },
             else => {
                 logUnhandledRequest(object_id, req);
@@ -638,9 +990,7 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         },
         .zwp_linux_dmabuf_v1 => |parsed| switch (parsed) {
             .create_params => |params| {
-                const zwp_buf_params_id = ZwpBufferParamsId{ .inner = params.params_id };
-                try self.zwp_params.put(zwp_buf_params_id, null);
-                try self.interface_registry.put(params.params_id, .zwp_linux_buffer_params_v1, diagnostics);
+                try self.putObject(params.params_id, .{ .zwp_linux_buffer_params_v1 = null }, diagnostics);
             },
             .get_default_feedback => |params| {
                 try self.sendSurfaceFeedback(params, diagnostics);
@@ -655,12 +1005,12 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         },
         .zwp_linux_dmabuf_feedback_v1 => |parsed| switch (parsed) {
             .destroy => {
-                self.interface_registry.remove(object_id);
+                _ = self.objects.remove(object_id);
             },
         },
         .zxdg_decoration_manager_v1 => |parsed| switch (parsed) {
             .get_toplevel_decoration => |params| {
-                try self.interface_registry.put(params.id, .zxdg_toplevel_decoration_v1, diagnostics);
+                try self.putObject(params.id, .{ .generic = .zxdg_toplevel_decoration_v1 }, diagnostics);
             },
             // FIXME: handle destroy
             else => {
@@ -670,18 +1020,34 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
         },
         .zxdg_toplevel_decoration_v1 => |parsed| switch (parsed) {
             .destroy => {
-                self.interface_registry.remove(object_id);
+                _ = self.objects.remove(object_id);
             },
             else => logUnhandledRequest(object_id, req),
         },
         .wl_buffer => |params| switch (params) {
             .destroy => {
-                const wl_buffer_id = WlBufferId{ .inner = object_id };
-                const buffer = self.wl_buffers.remove(wl_buffer_id) orelse {
+                const removed = self.objects.remove(object_id);
+                if (removed == null or removed.? != .wl_buffer) {
                     return diagnostics.makeInternalErr("trying to remove invalid wl_buffer {d}", .{object_id});
-                };
-                buffer.unref(self.alloc.general(), self.fd_pool);
-                self.interface_registry.remove(object_id);
+                }
+                removed.?.wl_buffer.unref(self.alloc.general(), self.fd_pool);
+            },
+        },
+        .wp_presentation => |parsed| switch (parsed) {
+            .feedback => |params| {
+                const wl_surface_id = WlSurfaceId{ .inner = params.surface };
+                const surface = try self.getWlSurface(wl_surface_id, .param, diagnostics);
+
+                try self.putObject(params.callback, .{ .generic = .wp_presentation_feedback }, diagnostics);
+                try surface.pending_feedback.append(self.alloc.general(), params.callback);
+            },
+            .destroy => {
+                _ = self.objects.remove(object_id);
+
+                const global = Bindings.WlDisplay{ .id = display_id };
+                try global.deleteId(self.io_writer, .{
+                    .id = object_id,
+                });
             },
         },
         else => {
@@ -691,73 +1057,55 @@ fn handleMessage(self: *Connection, object_id: u32, req: Bindings.WaylandIncomin
     }
 }
 
-const InterfaceRegistry = struct {
-    inner: sphtud.util.AutoHashMap(u32, Bindings.WaylandInterfaceType),
-
-    fn init(sphalloc: *sphtud.alloc.Sphalloc) !InterfaceRegistry {
-        var ret: InterfaceRegistry = .{
-            .inner = try .init(
-                sphalloc.arena(),
-                sphalloc.expansion(),
-                128,
-                4096,
-            ),
+const Object = union(enum) {
+    // Objects where all we need to know is what they are
+    generic: Bindings.WaylandInterfaceType,
+    wl_surface: Surface,
+    wl_buffer: WlBuffer,
+    wl_shm_pool: *ShmPool,
+    zwp_linux_buffer_params_v1: ?BufferParams,
+    xdg_surface: WlSurfaceId,
+    xdg_toplevel: Window,
+
+    fn interface(self: Object) Bindings.WaylandInterfaceType {
+        return switch (self) {
+            .generic => |interface_type| interface_type,
+            inline else => |_, t| @field(Bindings.WaylandInterfaceType, @tagName(t)),
         };
-        try ret.inner.put(display_id, .wl_display);
-        return ret;
     }
+};
 
-    fn put(self: *InterfaceRegistry, object_id: u32, interface_type: Bindings.WaylandInterfaceType, diagnostics: *HandleMessageDiagnostics) !void {
-        logger.debug("Registering {d} -> {t}", .{ object_id, interface_type });
-        const gop = try self.inner.getOrPut(object_id);
-
-        if (gop.found_existing) {
-            return diagnostics.makeInvalidMethodError("id {d} already bound to {t}", .{ object_id, gop.val.* });
-        }
-
-        gop.val.* = interface_type;
-    }
+fn putObject(self: *Connection, object_id: u32, object: Object, diagnostics: *HandleMessageDiagnostics) !void {
+    logger.debug("Registering {d} -> {t}", .{ object_id, object.interface() });
 
-    fn remove(self: *InterfaceRegistry, object_id: u32) void {
-        _ = self.inner.remove(object_id);
+    if (object_id >= object_table.server_id_start) {
+        return diagnostics.makeInvalidMethodError("id {d} is reserved for the server", .{object_id});
     }
 
-    fn get(self: *const InterfaceRegistry, object_id: u32) ?Bindings.WaylandInterfaceType {
-        return self.inner.get(object_id);
-    }
-};
+    self.objects.put(self.alloc.general(), object_id, object) catch |e| switch (e) {
+        error.IdInUse => return diagnostics.makeInvalidMethodError("id {d} already bound to {t}", .{ object_id, self.objects.get(object_id).?.interface() }),
+        error.InvalidId => return diagnostics.makeInvalidMethodError("id {d} out of range", .{object_id}),
+        error.OutOfMemory => return error.OutOfMemory,
+    };
+}
 
-fn parseRequest(op: u32, data: []const u8, interface: Bindings.WaylandInterfaceType) !Bindings.WaylandIncomingMessage {
-    inline for (std.meta.fields(Bindings.WaylandIncomingMessage)) |field| {
-        if (@field(Bindings.WaylandInterfaceType, field.name) == interface) {
-            if (@hasDecl(field.type, "parse")) {
-                return @unionInit(Bindings.WaylandIncomingMessage, field.name, try field.type.parse(op, data));
-            } else {
-                return @unionInit(Bindings.WaylandIncomingMessage, field.name, .{});
-            }
-        }
-    }
-    unreachable;
+fn objectState(self: *Connection, object_id: u32, comptime tag: std.meta.Tag(Object)) ?*@FieldType(Object, @tagName(tag)) {
+    const object = self.objects.get(object_id) orelse return null;
+    if (object.* != tag) return null;
+    return &@field(object, @tagName(tag));
 }
 
 fn logUnhandledRequest(object_id: u32, req: Bindings.WaylandIncomingMessage) void {
     logger.warn("Unhandled request by object {d}, {any}", .{ object_id, req });
 }
 
-fn requiresFd(req: Bindings.WaylandIncomingMessage) bool {
-    switch (req) {
-        inline else => |_, t| {
-            const interface_message = @field(req, @tagName(t));
-            if (@typeInfo(@TypeOf(interface_message)) == .@"struct") {
-                return false;
-            }
-            switch (interface_message) {
-                inline else => |_, t2| {
-                    const concrete_message = @field(interface_message, @tagName(t2));
-                    return @TypeOf(concrete_message).requires_fd;
-                },
-            }
-        },
+comptime {
+    // handleMessage only has room for one fd per request, which is all any
+    // protocol we implement needs
+    for (Bindings.incoming_messages) |interface_messages| {
+        for (interface_messages) |message| {
+            std.debug.assert(message.num_fds <= 1);
+        }
     }
 }
 
@@ -778,12 +1126,8 @@ fn sendSurfaceFeedback(self: *Connection, params: anytype, diagnostics: *HandleM
             .size = @intCast(self.format_table.len),
         });
 
-        // Ensure ordering :)
-        try self.io_writer.flush();
-        wl_cmsg.sendMessageWithFdAttachment(self.connection.stream, format_table_writer.buffered(), self.format_table.fd) catch {
-            // All other writes get clobbered to WriteFailed by std.Io.Writer, we can do the same
-            return error.WriteFailed;
-        };
+        // Queued in order with everything else, the fd goes out with it
+        try self.outbound.writeWithFd(format_table_writer.buffered(), self.format_table.fd);
     }
 
     try feedback_interface.trancheTargetDevice(self.io_writer, .{
@@ -809,7 +1153,7 @@ fn sendSurfaceFeedback(self: *Connection, params: anytype, diagnostics: *HandleM
     }
 
     try feedback_interface.done(self.io_writer, .{});
-    try self.interface_registry.put(params.id, .zwp_linux_dmabuf_feedback_v1, diagnostics);
+    try self.putObject(params.id, .{ .generic = .zwp_linux_dmabuf_feedback_v1 }, diagnostics);
 }
 
 fn emitXdgSurfaceConfigure(self: *Connection, id: XdgSurfaceId, surface: *Surface) !void {
@@ -826,17 +1170,17 @@ const IdSource = enum {
     param,
 };
 
-fn getWlBuffer(self: *Connection, id: WlBufferId, comptime id_source: IdSource, diagnostics: *HandleMessageDiagnostics) !*RefCountedRenderBuffer {
-    return self.wl_buffers.get(id) orelse {
+fn getWlBuffer(self: *Connection, id: WlBufferId, comptime id_source: IdSource, diagnostics: *HandleMessageDiagnostics) !WlBuffer {
+    return (self.objectState(id.inner, .wl_buffer) orelse {
         switch (id_source) {
             .interface => return diagnostics.makeInternalErr("wl_buffer storage missing {d}", .{id.inner}),
             .param => return diagnostics.makeInvalidMethodError("invalid wl_buffer {d}", .{id.inner}),
         }
-    };
+    }).*;
 }
 
 fn getWlSurface(self: *Connection, id: WlSurfaceId, comptime id_source: IdSource, diagnostics: *HandleMessageDiagnostics) !*Surface {
-    return self.wl_surfaces.getPtr(id) orelse {
+    return self.objectState(id.inner, .wl_surface) orelse {
         switch (id_source) {
             .interface => return diagnostics.makeInternalErr("wl_surface storage missing {d}", .{id.inner}),
             .param => return diagnostics.makeInvalidMethodError("invalid wl_surface {d}", .{id.inner}),
@@ -845,20 +1189,20 @@ fn getWlSurface(self: *Connection, id: WlSurfaceId, comptime id_source: IdSource
 }
 
 fn getXdgSurface(self: *Connection, id: XdgSurfaceId, id_source: IdSource, diagnostics: *HandleMessageDiagnostics) !*Surface {
-    const wl_surface_id = self.xdg_surfaces.get(id) orelse {
+    const wl_surface_id = (self.objectState(id.inner, .xdg_surface) orelse {
         switch (id_source) {
             .interface => return diagnostics.makeInternalErr("{d} does not have an xdg_surface", .{id.inner}),
             .param => return diagnostics.makeInvalidMethodError("{d} does not have an xdg_surface", .{id.inner}),
         }
-    };
+    }).*;
 
-    return self.wl_surfaces.getPtr(wl_surface_id) orelse {
+    return self.objectState(wl_surface_id.inner, .wl_surface) orelse {
         return diagnostics.makeInternalErr("xdg_surface references invalid wl_surface {d} -> {d}", .{ id.inner, wl_surface_id.inner });
     };
 }
 
 fn getZwpBufferParams(self: *Connection, id: ZwpBufferParamsId, id_source: IdSource, diagnostics: *HandleMessageDiagnostics) !*?BufferParams {
-    return self.zwp_params.getPtr(id) orelse {
+    return self.objectState(id.inner, .zwp_linux_buffer_params_v1) orelse {
         switch (id_source) {
             .interface => return diagnostics.makeInternalErr("zwp_params storage missing {d}", .{id.inner}),
             .param => return diagnostics.makeInvalidMethodError("invalid zwp_buffer_params {d}", .{id.inner}),
@@ -866,35 +1210,208 @@ fn getZwpBufferParams(self: *Connection, id: ZwpBufferParamsId, id_source: IdSou
     };
 }
 
-const Buffer = struct {
-    buf_params: BufferParams,
+const supported_shm_formats: []const u32 = &.{
+    rendering.shm_format_argb8888,
+    rendering.shm_format_xrgb8888,
+};
+
+const WlBuffer = union(enum) {
+    dmabuf: *RefCountedRenderBuffer,
+    shm: ShmBuffer,
+
+    fn ref(self: WlBuffer) WlBuffer {
+        switch (self) {
+            .dmabuf => |buf| _ = buf.ref(),
+            .shm => |buf| _ = buf.pool.ref(),
+        }
+        return self;
+    }
+
+    fn unref(self: WlBuffer, alloc: std.mem.Allocator, fd_pool: *FdPool) void {
+        switch (self) {
+            .dmabuf => |buf| buf.unref(alloc, fd_pool),
+            .shm => |buf| buf.pool.unref(alloc),
+        }
+    }
+};
+
+// Managed with Connection.alloc.general(). Buffers hold a reference, so the
+// mapping outlives wl_shm_pool.destroy for as long as they need it
+const ShmPool = struct {
+    ref_count: usize,
+    data: []align(std.heap.page_size_min) u8,
+    // Our own duplicate, resizes are checked against the file
+    fd: std.posix.fd_t,
+    // The client shrank the file while we were reading it, what was cut off
+    // reads as zeros from then on. See beginAccess()
+    truncated: bool = false,
+
+    // Pool being read by the render thread, for handleSigbus()
+    var accessed: ?*ShmPool = null;
+    var sigbus_installed = false;
+    var previous_sigbus: std.posix.Sigaction = undefined;
+
+    fn init(alloc: std.mem.Allocator, fd: std.posix.fd_t, size: i32) !*ShmPool {
+        if (size <= 0) return error.InvalidSize;
+        try checkFileSize(fd, size);
+
+        const own_fd = try std.posix.dup(fd);
+        errdefer std.posix.close(own_fd);
+
+        const data = try std.posix.mmap(null, @intCast(size), std.posix.PROT.READ, .{ .TYPE = .SHARED }, fd, 0);
+        errdefer std.posix.munmap(data);
+
+        const ret = try alloc.create(ShmPool);
+        ret.* = .{
+            .ref_count = 1,
+            .data = data,
+            .fd = own_fd,
+        };
+        return ret;
+    }
+
+    // Pools only ever grow. The mapping is allowed to move, buffers look up
+    // their contents through the pool at upload time
+    fn resize(self: *ShmPool, size: i32) !void {
+        if (size < self.data.len) return error.Shrink;
+        if (size == self.data.len) return;
+        try checkFileSize(self.fd, size);
+
+        self.data = try std.posix.mremap(self.data.ptr, self.data.len, @intCast(size), .{ .MAYMOVE = true }, null);
+    }
+
+    // Mapping past the end of the file would SIGBUS on the first upload
+    fn checkFileSize(fd: std.posix.fd_t, size: i32) !void {
+        const stat = try std.posix.fstat(fd);
+        if (size > stat.size) return error.FileTooSmall;
+    }
+
+    // The file can still be shrunk after we checked it. Reads of the pool go
+    // between beginAccess() and endAccess(), where a SIGBUS maps zeros over
+    // the pool instead of taking us down
+    fn beginAccess(self: *ShmPool) void {
+        if (!sigbus_installed) {
+            const act = std.posix.Sigaction{
+                .handler = .{ .sigaction = handleSigbus },
+                .mask = std.posix.sigemptyset(),
+                .flags = std.posix.SA.SIGINFO,
+            };
+            std.posix.sigaction(std.posix.SIG.BUS, &act, &previous_sigbus);
+            sigbus_installed = true;
+        }
+
+        accessed = self;
+    }
+
+    // False if the file was truncated under us, at which point the client
+    // gets an error
+    fn endAccess(self: *ShmPool) bool {
+        accessed = null;
+        return !self.truncated;
+    }
+
+    fn handleSigbus(_: i32, info: *const std.posix.siginfo_t, _: ?*anyopaque) callconv(.c) void {
+        const pool = accessed orelse return restoreSigbus();
+
+        const addr = @intFromPtr(info.fields.sigfault.addr);
+        const start = @intFromPtr(pool.data.ptr);
+        if (addr < start or addr >= start + pool.data.len) return restoreSigbus();
+
+        _ = std.posix.mmap(
+            pool.data.ptr,
+            pool.data.len,
+            std.posix.PROT.READ,
+            .{ .TYPE = .PRIVATE, .ANONYMOUS = true, .FIXED = true },
+            -1,
+            0,
+        ) catch return restoreSigbus();
+        pool.truncated = true;
+    }
+
+    // Not a fault we can recover from. Returning re-runs the access, which
+    // with the previous handler is the usual crash
+    fn restoreSigbus() void {
+        std.posix.sigaction(std.posix.SIG.BUS, &previous_sigbus, null);
+    }
+
+    fn ref(self: *ShmPool) *ShmPool {
+        self.ref_count += 1;
+        return self;
+    }
+
+    fn unref(self: *ShmPool, alloc: std.mem.Allocator) void {
+        self.ref_count -= 1;
+        if (self.ref_count == 0) {
+            std.posix.munmap(self.data);
+            std.posix.close(self.fd);
+            alloc.destroy(self);
+        }
+    }
+};
+
+const ShmBuffer = struct {
+    id: WlBufferId,
+    pool: *ShmPool,
+    offset: u32,
     width: i32,
     height: i32,
+    stride: u32,
     format: u32,
-    flags: u32,
+
+    // Takes a reference on pool
+    fn init(id: WlBufferId, pool: *ShmPool, offset: i32, width: i32, height: i32, stride: i32, format: u32) !ShmBuffer {
+        if (std.mem.indexOfScalar(u32, supported_shm_formats, format) == null) return error.InvalidFormat;
+        if (width <= 0 or height <= 0 or offset < 0) return error.InvalidSize;
+        if (stride < @as(i64, width) * 4) return error.InvalidStride;
+
+        const end = @as(u64, @intCast(offset)) + @as(u64, @intCast(stride)) * @as(u64, @intCast(height));
+        if (end > pool.data.len) return error.OutOfBounds;
+
+        return .{
+            .id = id,
+            .pool = pool.ref(),
+            .offset = @intCast(offset),
+            .width = width,
+            .height = height,
+            .stride = @intCast(stride),
+            .format = format,
+        };
+    }
+
+    fn contents(self: ShmBuffer) []const u8 {
+        return self.pool.data[self.offset..][0 .. self.stride * @as(u32, @intCast(self.height))];
+    }
 };
 
 // Managed with Connection.alloc.general()
 const RefCountedRenderBuffer = struct {
     ref_count: usize,
     render_buffer: rendering.RenderBuffer,
+    // Imported once on creation and re-used for every frame the buffer is
+    // committed for
+    texture: rendering.BufferTexture,
+    // Whatever the backend keeps for the buffer, e.g. its framebuffer
+    user_data: rendering.BufferUserData = .{},
     buf_id: WlBufferId,
 
-    fn init(alloc: std.mem.Allocator, wl_buffer: WlBufferId, params: BufferParams, width: i32, height: i32, format: u32, flags: u32) !*RefCountedRenderBuffer {
+    fn init(alloc: std.mem.Allocator, egl_context: *const system_gl.EglContext, wl_buffer: WlBufferId, params: BufferParams, width: i32, height: i32, format: u32, flags: u32) !*RefCountedRenderBuffer {
         _ = flags;
 
         const ret = try alloc.create(RefCountedRenderBuffer);
+        const render_buffer = rendering.RenderBuffer{
+            .buf_fd = params.fd,
+            .modifiers = params.modifier,
+            .offset = params.offset,
+            .plane_idx = params.plane_idx,
+            .stride = params.stride,
+            .width = width,
+            .height = height,
+            .format = format,
+        };
+
         ret.* = .{
-            .render_buffer = .{
-                .buf_fd = params.fd,
-                .modifiers = params.modifier,
-                .offset = params.offset,
-                .plane_idx = params.plane_idx,
-                .stride = params.stride,
-                .width = width,
-                .height = height,
-                .format = format,
-            },
+            .render_buffer = render_buffer,
+            .texture = .import(egl_context, render_buffer),
             .ref_count = 1,
             .buf_id = wl_buffer,
         };
@@ -910,6 +1427,8 @@ const RefCountedRenderBuffer = struct {
         self.ref_count -= 1;
         logger.debug("{*} unrefed, count {d}\n", .{ self, self.ref_count });
         if (self.ref_count == 0) {
+            self.user_data.deinit();
+            self.texture.deinit();
             fd_pool.close(self.render_buffer.buf_fd);
             alloc.destroy(self);
         }
@@ -926,16 +1445,35 @@ const BufferParams = struct {
 
 const Surface = struct {
     // Buffer currently attached, but not yet committed
-    pending_buffer: ?*RefCountedRenderBuffer = null,
+    pending_buffer: ?WlBuffer = null,
+    pending_damage: geometry.Damage = .{},
 
-    // Buffer currently committed
+    // dma-buf currently committed. shm buffers are copied into shm_texture
+    // and released on commit, so they are never held here
     committed_buffer: ?*RefCountedRenderBuffer = null,
     committed_buffer_handle: ?CompositorState.Renderables.Handle = null,
+    shm_texture: ?rendering.ShmTexture = null,
+    // Buffers replaced by a commit while the display was still scanning them
+    // out. One may be on screen and one queued for the next flip
+    scanout_held: [2]?*RefCountedRenderBuffer = @splat(null),
 
     callback_id: ?u32 = null,
     outstanding_xdg_configure: ?u32 = null,
 
+    // wp_presentation_feedback ids, following the commit they were requested
+    // for from pending, to committed, to latched into a frame that is on its
+    // way to the display. Managed with Connection.alloc.general()
+    pending_feedback: std.ArrayList(u32) = .empty,
+    committed_feedback: std.ArrayList(u32) = .empty,
+    latched_feedback: std.ArrayList(u32) = .empty,
+    // Latched frame was handed to the display without a copy
+    latched_zero_copy: bool = false,
+
     fn deinit(self: Surface, alloc: std.mem.Allocator, fd_pool: *FdPool, compositor_state: *CompositorState) void {
+        for ([_]std.ArrayList(u32){ self.pending_feedback, self.committed_feedback, self.latched_feedback }) |feedback| {
+            alloc.free(feedback.allocatedSlice());
+        }
+
         if (self.pending_buffer) |buf| {
             buf.unref(alloc, fd_pool);
         }
@@ -944,9 +1482,64 @@ const Surface = struct {
             buf.unref(alloc, fd_pool);
         }
 
+        for (self.scanout_held) |held_opt| {
+            if (held_opt) |buf| buf.unref(alloc, fd_pool);
+        }
+
         if (self.committed_buffer_handle) |handle| {
             compositor_state.removeRenderable(handle);
         }
+
+        if (self.shm_texture) |t| {
+            t.deinit();
+        }
+    }
+
+    // Takes over the reference to buffer. Returns false if there is nowhere to
+    // put it, which only happens if the display holds more than it should
+    fn holdForScanout(self: *Surface, buffer: *RefCountedRenderBuffer) bool {
+        for (&self.scanout_held) |*held| {
+            if (held.* == null) {
+                held.* = buffer;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Fails if the client truncated the pool's file under us
+    fn uploadShm(self: *Surface, buffer: ShmBuffer) error{PoolTruncated}!rendering.BufferTexture {
+        if (self.shm_texture) |t| {
+            if (!t.matches(buffer.width, buffer.height, buffer.format)) {
+                t.deinit();
+                self.shm_texture = null;
+            }
+        }
+
+        const full_damage = [1]geometry.Rect{.{
+            .x = 0,
+            .y = 0,
+            .width = buffer.width,
+            .height = buffer.height,
+        }};
+
+        var damage = self.pending_damage.slice();
+        if (self.shm_texture == null) {
+            self.shm_texture = rendering.ShmTexture.init(buffer.width, buffer.height, buffer.format) catch |e| {
+                logger.warn("failed to create shm texture {t}, window will not be shown", .{e});
+                return .{ .texture = null };
+            };
+            damage = &full_damage;
+        }
+
+        const texture = &self.shm_texture.?;
+        buffer.pool.beginAccess();
+        texture.upload(buffer.contents(), buffer.stride, damage) catch |e| {
+            logger.warn("failed to upload shm buffer {t}", .{e});
+        };
+        if (!buffer.pool.endAccess()) return error.PoolTruncated;
+
+        return texture.bufferTexture();
     }
 };
 
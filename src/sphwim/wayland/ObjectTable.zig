@@ -0,0 +1,209 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+// Wayland object ids are handed out densely from 1 by the client, and from
+// 0xff000000 by the server. Freed ids get re-used, so a client's ids stay
+// small and tightly packed for its whole lifetime. We can index straight into
+// a paged array instead of hashing, and pointers into the table stay valid
+// until the object is removed
+pub const server_id_start = 0xff000000;
+
+pub fn ObjectTable(comptime T: type) type {
+    return struct {
+        client: PagedArray(T),
+        server: PagedArray(T),
+
+        const Self = @This();
+
+        // Far beyond what any real client needs, but stops a misbehaving one
+        // from making us build a directory for the whole id space
+        const max_client_objects = 1 << 20;
+        // We do not create many objects of our own
+        const max_server_objects = 1 << 12;
+
+        pub const empty = Self{
+            .client = .empty,
+            .server = .empty,
+        };
+
+        pub fn deinit(self: *Self, alloc: Allocator) void {
+            self.client.deinit(alloc);
+            self.server.deinit(alloc);
+        }
+
+        pub fn get(self: *Self, id: u32) ?*T {
+            if (id >= server_id_start) {
+                return self.server.get(id - server_id_start);
+            }
+            return self.client.get(id);
+        }
+
+        pub fn put(self: *Self, alloc: Allocator, id: u32, val: T) error{ OutOfMemory, InvalidId, IdInUse }!void {
+            const slot = if (id >= server_id_start)
+                try self.server.slot(alloc, id - server_id_start, max_server_objects)
+            else if (id == 0)
+                return error.InvalidId
+            else
+                try self.client.slot(alloc, id, max_client_objects);
+
+            if (slot.* != null) return error.IdInUse;
+            slot.* = val;
+        }
+
+        pub fn remove(self: *Self, id: u32) ?T {
+            if (id >= server_id_start) {
+                return self.server.remove(id - server_id_start);
+            }
+            return self.client.remove(id);
+        }
+
+        pub const Entry = struct {
+            id: u32,
+            val: *T,
+        };
+
+        pub const Iter = struct {
+            table: *Self,
+            in_server_range: bool = false,
+            idx: usize = 0,
+
+            pub fn next(self: *Iter) ?Entry {
+                while (true) {
+                    const arr = if (self.in_server_range) &self.table.server else &self.table.client;
+                    if (arr.nextOccupied(&self.idx)) |val| {
+                        defer self.idx += 1;
+                        const id_offs: usize = if (self.in_server_range) server_id_start else 0;
+                        return .{
+                            .id = @intCast(self.idx + id_offs),
+                            .val = val,
+                        };
+                    }
+
+                    if (self.in_server_range) return null;
+                    self.in_server_range = true;
+                    self.idx = 0;
+                }
+            }
+        };
+
+        pub fn iter(self: *Self) Iter {
+            return .{ .table = self };
+        }
+    };
+}
+
+fn PagedArray(comptime T: type) type {
+    return struct {
+        pages: []?*Page,
+
+        const Self = @This();
+
+        // Small enough that a typical client fits in a page or two
+        const page_size = 64;
+        const Page = [page_size]?T;
+
+        const empty = Self{ .pages = &.{} };
+
+        fn deinit(self: *Self, alloc: Allocator) void {
+            for (self.pages) |page_opt| {
+                if (page_opt) |page| alloc.destroy(page);
+            }
+            alloc.free(self.pages);
+            self.* = .empty;
+        }
+
+        fn get(self: *Self, idx: usize) ?*T {
+            const page = self.getPage(idx) orelse return null;
+            if (page[idx % page_size]) |*val| return val;
+            return null;
+        }
+
+        fn remove(self: *Self, idx: usize) ?T {
+            const page = self.getPage(idx) orelse return null;
+            const ret = page[idx % page_size];
+            page[idx % page_size] = null;
+            return ret;
+        }
+
+        fn getPage(self: *Self, idx: usize) ?*Page {
+            const page_idx = idx / page_size;
+            if (page_idx >= self.pages.len) return null;
+            return self.pages[page_idx];
+        }
+
+        fn slot(self: *Self, alloc: Allocator, idx: usize, max_elems: usize) !*?T {
+            if (idx >= max_elems) return error.InvalidId;
+
+            const page_idx = idx / page_size;
+            if (page_idx >= self.pages.len) {
+                const max_pages = std.math.divCeil(usize, max_elems, page_size) catch unreachable;
+                const new_len = @min(max_pages, @max(page_idx + 1, self.pages.len * 2));
+
+                const new_pages = try alloc.alloc(?*Page, new_len);
+                @memcpy(new_pages[0..self.pages.len], self.pages);
+                @memset(new_pages[self.pages.len..], null);
+
+                alloc.free(self.pages);
+                self.pages = new_pages;
+            }
+
+            const page = self.pages[page_idx] orelse blk: {
+                const new_page = try alloc.create(Page);
+                @memset(new_page, null);
+                self.pages[page_idx] = new_page;
+                break :blk new_page;
+            };
+
+            return &page[idx % page_size];
+        }
+
+        // Advances idx to the next occupied slot at or after idx
+        fn nextOccupied(self: *Self, idx: *usize) ?*T {
+            while (idx.* / page_size < self.pages.len) {
+                const page = self.pages[idx.* / page_size] orelse {
+                    idx.* = (idx.* / page_size + 1) * page_size;
+                    continue;
+                };
+
+                if (page[idx.* % page_size]) |*val| return val;
+                idx.* += 1;
+            }
+
+            return null;
+        }
+    };
+}
+
+test "object table put get remove" {
+    var table = ObjectTable(u32).empty;
+    defer table.deinit(std.testing.allocator);
+
+    try std.testing.expectError(error.InvalidId, table.put(std.testing.allocator, 0, 0));
+
+    for (1..1000) |i| {
+        try table.put(std.testing.allocator, @intCast(i), @intCast(i * 2));
+    }
+    try table.put(std.testing.allocator, server_id_start + 3, 42);
+
+    try std.testing.expectError(error.IdInUse, table.put(std.testing.allocator, 10, 0));
+    try std.testing.expectEqual(20, table.get(10).?.*);
+    try std.testing.expectEqual(42, table.get(server_id_start + 3).?.*);
+    try std.testing.expectEqual(null, table.get(1000));
+    try std.testing.expectEqual(null, table.get(server_id_start));
+
+    try std.testing.expectEqual(20, table.remove(10));
+    try std.testing.expectEqual(null, table.remove(10));
+    try std.testing.expectEqual(null, table.get(10));
+
+    var num_items: usize = 0;
+    var it = table.iter();
+    while (it.next()) |entry| {
+        if (entry.id >= server_id_start) {
+            try std.testing.expectEqual(server_id_start + 3, entry.id);
+        } else {
+            try std.testing.expectEqual(entry.id * 2, entry.val.*);
+        }
+        num_items += 1;
+    }
+    try std.testing.expectEqual(999, num_items);
+}
@@ -0,0 +1,276 @@
+const std = @import("std");
+const wl_cmsg = @import("wl_cmsg");
+
+// Everything we send a client goes through here. Writes never block and never
+// fail because the client is slow to read, whatever the socket does not take
+// is queued along with its fds and sent once the socket has room again
+//
+// Past the high-water mark the client is expected to be throttled by whoever
+// produces its events. Only past the hard limit, a client that has stopped
+// reading altogether, do writes fail
+const Outbound = @This();
+
+const logger = std.log.scoped(.wl_outbound);
+
+socket: std.net.Stream,
+alloc: std.mem.Allocator,
+high_water: usize,
+// Bytes the socket has not taken yet are queue.items[sent..]
+queue: std.ArrayList(u8) = .empty,
+sent: usize = 0,
+// Ours to close until they are sent, ordered by offset
+fds: std.ArrayList(QueuedFd) = .empty,
+interface: std.Io.Writer,
+
+// A few frames of events for a busy client
+pub const default_high_water = 256 * 1024;
+// Relative to the high-water mark. The client has had plenty of warning by
+// the time it gets here
+const hard_limit_factor = 4;
+// Queues that grew past this while a client lagged are given back once they
+// drain
+const retained_capacity = 64 * 1024;
+
+const QueuedFd = struct {
+    // Into queue, the fd goes out with this byte
+    offset: usize,
+    fd: std.posix.fd_t,
+};
+
+pub fn init(alloc: std.mem.Allocator, socket: std.net.Stream, high_water: usize) !Outbound {
+    return .{
+        .socket = socket,
+        .alloc = alloc,
+        .high_water = high_water,
+        .interface = .{
+            .buffer = try alloc.alloc(u8, 4096),
+            .vtable = &.{
+                .drain = drain,
+                .flush = flush,
+            },
+        },
+    };
+}
+
+// Does not own the socket
+pub fn deinit(self: *Outbound) void {
+    for (self.fds.items) |queued| std.posix.close(queued.fd);
+    self.fds.deinit(self.alloc);
+    self.queue.deinit(self.alloc);
+    self.alloc.free(self.interface.buffer);
+}
+
+pub fn pending(self: *const Outbound) usize {
+    return self.queue.items.len - self.sent + self.interface.end;
+}
+
+pub fn isEmpty(self: *const Outbound) bool {
+    return self.pending() == 0;
+}
+
+// The client is not keeping up with what we send, stop generating more for
+// it where we can
+pub fn overHighWater(self: *const Outbound) bool {
+    return self.pending() > self.high_water;
+}
+
+// Queues msg with fd attached. fd is duplicated, the caller keeps its own
+pub fn writeWithFd(self: *Outbound, msg: []const u8, fd: std.posix.fd_t) std.Io.Writer.Error!void {
+    try self.moveBuffered();
+
+    const dup = std.posix.dup(fd) catch return error.WriteFailed;
+    errdefer std.posix.close(dup);
+
+    self.fds.append(self.alloc, .{ .offset = self.queue.items.len, .fd = dup }) catch return error.WriteFailed;
+    errdefer _ = self.fds.pop();
+
+    try self.enqueue(msg);
+}
+
+// As much of the queue as the socket takes right now. Anything left is for
+// when the socket is writable again
+pub fn send(self: *Outbound) std.Io.Writer.Error!void {
+    while (self.sent < self.queue.items.len) {
+        var len = self.queue.items.len - self.sent;
+        var fd: ?std.posix.fd_t = null;
+        if (self.fds.items.len > 0) {
+            // Stop short of the next fd so that the kernel attaches it to
+            // the right byte
+            const next = self.fds.items[0];
+            if (next.offset == self.sent) {
+                fd = next.fd;
+                if (self.fds.items.len > 1) len = self.fds.items[1].offset - self.sent;
+            } else {
+                len = next.offset - self.sent;
+            }
+        }
+
+        const written = sendMsg(self.socket, self.queue.items[self.sent..][0..len], fd) catch |e| switch (e) {
+            error.WouldBlock => break,
+            else => {
+                logger.debug("failed to send to client: {t}", .{e});
+                return error.WriteFailed;
+            },
+        };
+
+        if (fd) |f| {
+            std.posix.close(f);
+            _ = self.fds.orderedRemove(0);
+        }
+        self.sent += written;
+    }
+
+    self.compact();
+}
+
+fn compact(self: *Outbound) void {
+    if (self.sent == self.queue.items.len) {
+        self.sent = 0;
+        if (self.queue.capacity > retained_capacity) {
+            self.queue.clearAndFree(self.alloc);
+        } else {
+            self.queue.clearRetainingCapacity();
+        }
+        return;
+    }
+
+    // Shifting is proportional to what is left, only worth it once most of
+    // the queue is gone
+    if (self.sent < self.queue.items.len / 2) return;
+
+    const remaining = self.queue.items.len - self.sent;
+    std.mem.copyForwards(u8, self.queue.items[0..remaining], self.queue.items[self.sent..]);
+    self.queue.shrinkRetainingCapacity(remaining);
+    for (self.fds.items) |*queued| queued.offset -= self.sent;
+    self.sent = 0;
+}
+
+fn enqueue(self: *Outbound, bytes: []const u8) std.Io.Writer.Error!void {
+    if (self.queue.items.len - self.sent + bytes.len > self.high_water * hard_limit_factor) {
+        logger.warn("client stopped reading, dropping it with {d} bytes queued", .{self.queue.items.len - self.sent});
+        return error.WriteFailed;
+    }
+
+    self.queue.appendSlice(self.alloc, bytes) catch return error.WriteFailed;
+}
+
+fn moveBuffered(self: *Outbound) std.Io.Writer.Error!void {
+    const w = &self.interface;
+    try self.enqueue(w.buffered());
+    w.end = 0;
+}
+
+fn drain(w: *std.Io.Writer, data: []const []const u8, splat: usize) std.Io.Writer.Error!usize {
+    const self: *Outbound = @fieldParentPtr("interface", w);
+    try self.moveBuffered();
+
+    var written: usize = 0;
+    for (data[0 .. data.len - 1]) |bytes| {
+        try self.enqueue(bytes);
+        written += bytes.len;
+    }
+
+    const pattern = data[data.len - 1];
+    for (0..splat) |_| {
+        try self.enqueue(pattern);
+        written += pattern.len;
+    }
+
+    return written;
+}
+
+fn flush(w: *std.Io.Writer) std.Io.Writer.Error!void {
+    const self: *Outbound = @fieldParentPtr("interface", w);
+    try self.moveBuffered();
+    try self.send();
+}
+
+fn sendMsg(socket: std.net.Stream, bytes: []const u8, fd: ?std.posix.fd_t) std.posix.SendMsgError!usize {
+    const SCM_RIGHTS = 1;
+
+    var cmsg_buf: [wl_cmsg.max_buf_size]u8 align(@alignOf(wl_cmsg.CmsgHdr)) = @splat(0);
+    var controllen: usize = 0;
+    if (fd) |f| {
+        controllen = wl_cmsg.fd_list_start + @sizeOf(c_int);
+        const hdr = wl_cmsg.CmsgHdr{
+            .cmsg_len = controllen,
+            .cmsg_level = std.os.linux.SOL.SOCKET,
+            .cmsg_type = SCM_RIGHTS,
+        };
+        @memcpy(cmsg_buf[0..@sizeOf(wl_cmsg.CmsgHdr)], std.mem.asBytes(&hdr));
+        @memcpy(cmsg_buf[wl_cmsg.fd_list_start..][0..@sizeOf(c_int)], std.mem.asBytes(&f));
+    }
+
+    const iov = [1]std.posix.iovec_const{.{
+        .base = bytes.ptr,
+        .len = bytes.len,
+    }};
+
+    const msghdr = std.posix.msghdr_const{
+        .name = null,
+        .namelen = 0,
+        .iov = &iov,
+        .iovlen = 1,
+        .control = if (fd != null) &cmsg_buf else null,
+        .controllen = @intCast(controllen),
+        .flags = 0,
+    };
+
+    // A client that hung up is reported through the error, not a signal
+    return std.posix.sendmsg(socket.handle, &msghdr, std.os.linux.MSG.DONTWAIT | std.os.linux.MSG.NOSIGNAL);
+}
+
+test "queued fds arrive with their own messages" {
+    var pair: [2]i32 = undefined;
+    if (std.posix.errno(std.os.linux.socketpair(std.os.linux.AF.UNIX, std.os.linux.SOCK.STREAM, 0, &pair)) != .SUCCESS) {
+        return error.SocketPair;
+    }
+    defer for (pair) |fd| std.posix.close(fd);
+
+    const first = try std.posix.memfd_create("first", 0);
+    defer std.posix.close(first);
+    const second = try std.posix.memfd_create("second", 0);
+    defer std.posix.close(second);
+
+    var outbound = try Outbound.init(std.testing.allocator, .{ .handle = pair[0] }, default_high_water);
+    defer outbound.deinit();
+
+    // Both queued before anything is sent, so they sit back to back
+    try outbound.writeWithFd("first message", first);
+    try outbound.writeWithFd("second", second);
+    try outbound.interface.flush();
+    try std.testing.expect(outbound.isEmpty());
+
+    try expectMessage(pair[1], "first message", first);
+    try expectMessage(pair[1], "second", second);
+}
+
+fn expectMessage(socket: std.posix.fd_t, expected: []const u8, expected_fd: std.posix.fd_t) !void {
+    var buf: [64]u8 = undefined;
+    var control: [wl_cmsg.max_buf_size]u8 align(@alignOf(wl_cmsg.CmsgHdr)) = @splat(0);
+    var iov = [1]std.posix.iovec{.{ .base = &buf, .len = buf.len }};
+    var hdr = std.os.linux.msghdr{
+        .name = null,
+        .namelen = 0,
+        .iov = &iov,
+        .iovlen = 1,
+        .control = &control,
+        .controllen = control.len,
+        .flags = 0,
+    };
+
+    // The kernel does not merge reads across messages carrying fds
+    const rc = std.os.linux.recvmsg(socket, &hdr, std.os.linux.MSG.DONTWAIT);
+    try std.testing.expectEqual(.SUCCESS, std.posix.errno(rc));
+    try std.testing.expectEqualStrings(expected, buf[0..rc]);
+
+    const cmsg = std.mem.bytesToValue(wl_cmsg.CmsgHdr, control[0..@sizeOf(wl_cmsg.CmsgHdr)]);
+    try std.testing.expectEqual(wl_cmsg.fd_list_start + @sizeOf(c_int), cmsg.cmsg_len);
+    const received = std.mem.bytesToValue(c_int, control[wl_cmsg.fd_list_start..][0..@sizeOf(c_int)]);
+    defer std.posix.close(received);
+
+    // A different fd number, the same file
+    const received_stat = try std.posix.fstat(received);
+    const expected_stat = try std.posix.fstat(expected_fd);
+    try std.testing.expectEqual(expected_stat.ino, received_stat.ino);
+}
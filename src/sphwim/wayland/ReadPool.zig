@@ -0,0 +1,752 @@
+const std = @import("std");
+const Bindings = @import("wayland_bindings");
+const wlio = @import("wlio");
+const wl_cmsg = @import("wl_cmsg");
+const Reader = @import("Reader.zig");
+const object_table = @import("ObjectTable.zig");
+const ObjectTable = object_table.ObjectTable;
+const spsc_queue = @import("SpscQueue.zig");
+const SpscQueue = spsc_queue.SpscQueue;
+
+// Reads, frames and parses client messages on a few worker threads, so that
+// the thread that renders only has to apply them. Every connection is pinned
+// to one worker, which hands requests over in order through the connection's
+// Inbound
+const ReadPool = @This();
+
+const logger = std.log.scoped(.wl_read_pool);
+
+// Workers are owned by the pool, and have to stay where they are while their
+// thread runs
+workers: []Worker,
+// What the workers ended up with, which may not be what was asked for
+backend: Backend,
+next_worker: usize = 0,
+
+// Past a handful of threads the render thread applying requests is the
+// bottleneck, not reading them
+const max_workers = 4;
+
+// Memory a worker allocates may be freed by the render thread and the other
+// way around, none of the sphtud allocators can take that
+const thread_alloc = std.heap.smp_allocator;
+
+const display_id = 1;
+
+pub const Backend = enum {
+    epoll,
+    // One io_uring per worker. Reads are submitted to the ring instead of
+    // made after a readiness event, and a worker pass costs a single
+    // io_uring_enter for all of its connections
+    io_uring,
+};
+
+pub const Options = struct {
+    backend: Backend = .epoll,
+    // One per spare core if not set
+    num_workers: ?usize = null,
+};
+
+pub fn init(alloc: std.mem.Allocator, options: Options) !ReadPool {
+    const num_workers = options.num_workers orelse blk: {
+        const cpu_count = std.Thread.getCpuCount() catch 1;
+        // Leave a core for the render thread
+        break :blk std.math.clamp(cpu_count -| 1, 1, max_workers);
+    };
+
+    const workers = try alloc.alloc(Worker, num_workers);
+
+    const backend: Backend = blk: {
+        initWorkers(alloc, workers, options.backend) catch |e| switch (options.backend) {
+            .epoll => return e,
+            // Old kernels and sandboxes commonly have io_uring disabled
+            .io_uring => {
+                logger.warn("failed to set up io_uring ({t}), reading clients with epoll", .{e});
+                try initWorkers(alloc, workers, .epoll);
+                break :blk .epoll;
+            },
+        };
+        break :blk options.backend;
+    };
+
+    return .{
+        .workers = workers,
+        .backend = backend,
+    };
+}
+
+fn initWorkers(alloc: std.mem.Allocator, workers: []Worker, backend: Backend) !void {
+    var num_started: usize = 0;
+    errdefer for (workers[0..num_started]) |*worker| worker.deinit();
+
+    for (workers) |*worker| {
+        try worker.init(alloc, backend);
+        num_started += 1;
+    }
+}
+
+pub fn deinit(self: *ReadPool) void {
+    for (self.workers) |*worker| {
+        worker.deinit();
+    }
+}
+
+// Start reading the connection. Requests show up on inbound.queue, with
+// inbound.wake_event signalled whenever there are new ones
+pub fn add(self: *ReadPool, inbound: *Inbound) void {
+    const worker = &self.workers[self.next_worker];
+    self.next_worker = (self.next_worker + 1) % self.workers.len;
+
+    inbound.worker = worker;
+    worker.send(.{ .add = inbound });
+}
+
+// Stop reading the connection. Blocks until the worker is done with it, which
+// is at most one batch of reads, after which inbound can be freed
+pub fn remove(self: *ReadPool, inbound: *Inbound) void {
+    _ = self;
+    inbound.worker.send(.{ .remove = inbound });
+    inbound.removed.wait();
+}
+
+// Requests handed over through a connection's queue. The message borrows from
+// the request's own storage, so it stays valid until the slot is released
+pub const Request = struct {
+    object_id: u32,
+    message: Bindings.WaylandIncomingMessage,
+    // Not registered with anything yet, whoever takes the request owns it
+    fd: ?std.posix.fd_t,
+    inline_data: [inline_data_size]u8,
+    // Allocated with thread_alloc, for messages that do not fit inline
+    heap_data: ?[]u8,
+
+    // Most requests are a handful of ints. Strings and arrays can go up to
+    // the maximum message size, those are rare enough to allocate for
+    const inline_data_size = 64;
+
+    fn setData(self: *Request, data: []const u8) ![]const u8 {
+        self.heap_data = null;
+        if (data.len <= inline_data_size) {
+            const ret = self.inline_data[0..data.len];
+            @memcpy(ret, data);
+            return ret;
+        }
+
+        const ret = try thread_alloc.dupe(u8, data);
+        self.heap_data = ret;
+        return ret;
+    }
+
+    // Releases the storage, does not touch the fd
+    pub fn freeData(self: *Request) void {
+        if (self.heap_data) |data| thread_alloc.free(data);
+        self.heap_data = null;
+    }
+};
+
+// Protocol errors the worker found while reading, reported to the client by
+// the render thread once everything before them has been handled
+pub const Diagnostic = struct {
+    kind: enum { invalid_object, invalid_method },
+    message: [:0]const u8,
+};
+
+pub const ReadError = error{
+    EndOfStream,
+    ReadFailed,
+    NoFd,
+    OutOfMemory,
+    Diagnostic,
+};
+
+// The reading half of a connection. Fields are split between the worker that
+// reads it and the render thread that consumes what was read, anything shared
+// goes through the queue or an atomic
+pub const Inbound = struct {
+    // Worker only
+    reader: Reader,
+    // What the client has created, as far as the worker can tell from the
+    // messages it parsed. Destroyed objects stay behind until their id is
+    // re-used, so this can only reject messages, the render thread's object
+    // table has the final say
+    interfaces: ObjectTable(Bindings.WaylandInterfaceType),
+
+    queue: SpscQueue(Request),
+    // Written by the worker after it commits requests or fails
+    wake_event: std.posix.fd_t,
+    // Set by the worker when it stopped reading because the queue was full.
+    // Whoever clears it gets to start reading again
+    stalled: std.atomic.Value(bool) = .init(false),
+
+    // Set once by the worker, after which it reads no more. Everything in the
+    // queue came before the failure
+    failed: std.atomic.Value(bool) = .init(false),
+    failure: ReadError = error.EndOfStream,
+    failure_errno: std.os.linux.E = .SUCCESS,
+    diagnostic: Diagnostic = undefined,
+    diagnostic_buf: [256]u8 = undefined,
+
+    worker: *Worker = undefined,
+    removed: std.Thread.ResetEvent = .{},
+    // Worker only, for the io_uring backend
+    ring_op: RingOp = .{},
+
+    // Deep enough to get through a burst of commits without stalling the
+    // socket, the render thread drains it every time it is woken
+    const queue_capacity = 128;
+
+    // alloc only needs to outlive the connection, it is never touched from
+    // the worker
+    pub fn init(alloc: std.mem.Allocator, socket: std.net.Stream) !Inbound {
+        var interfaces = ObjectTable(Bindings.WaylandInterfaceType).empty;
+        errdefer interfaces.deinit(thread_alloc);
+        try interfaces.put(thread_alloc, display_id, .wl_display);
+
+        const wake_event = try std.posix.eventfd(0, std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC);
+        errdefer std.posix.close(wake_event);
+
+        const queue = try SpscQueue(Request).init(alloc, queue_capacity);
+
+        return .{
+            .reader = try Reader.init(alloc, thread_alloc, socket),
+            .interfaces = interfaces,
+            .queue = queue,
+            .wake_event = wake_event,
+        };
+    }
+
+    // Only once the pool has let go of it. Does not close the socket
+    pub fn deinit(self: *Inbound) void {
+        while (self.queue.peek()) |request| {
+            if (request.fd) |fd| std.posix.close(fd);
+            request.freeData();
+            self.queue.release();
+        }
+
+        self.reader.deinit();
+        self.interfaces.deinit(thread_alloc);
+        std.posix.close(self.wake_event);
+    }
+
+    // Render thread, clears the wakeup before the queue is drained so that
+    // nothing committed after this point goes unnoticed
+    pub fn consumeWake(self: *Inbound) void {
+        var val: u64 = 0;
+        _ = std.posix.read(self.wake_event, std.mem.asBytes(&val)) catch {};
+    }
+
+    // Render thread, hands the oldest request back to the worker
+    pub fn release(self: *Inbound, request: *Request) void {
+        request.freeData();
+        self.queue.release();
+    }
+
+    // Render thread, after draining the queue
+    pub fn resumeIfStalled(self: *Inbound) void {
+        if (self.stalled.swap(false, .seq_cst)) {
+            self.worker.resumeReading(self);
+        }
+    }
+
+    // Render thread, for when it leaves requests in the queue to come back
+    // to later
+    pub fn rewake(self: *Inbound) void {
+        self.wakeMain();
+    }
+
+    fn wakeMain(self: *Inbound) void {
+        const val: u64 = 1;
+        _ = std.posix.write(self.wake_event, std.mem.asBytes(&val)) catch |e| {
+            logger.err("failed to wake connection handler: {t}", .{e});
+        };
+    }
+
+    fn fail(self: *Inbound, err: ReadError) void {
+        self.failure = err;
+        self.failure_errno = self.reader.last_res;
+        self.failed.store(true, .release);
+    }
+
+    fn makeDiagnostic(self: *Inbound, kind: @FieldType(Diagnostic, "kind"), comptime msg: []const u8, args: anytype) ReadError {
+        const message = std.fmt.bufPrintZ(&self.diagnostic_buf, msg, args) catch blk: {
+            self.diagnostic_buf[self.diagnostic_buf.len - 1] = 0;
+            break :blk self.diagnostic_buf[0 .. self.diagnostic_buf.len - 1 :0];
+        };
+        self.diagnostic = .{ .kind = kind, .message = message };
+        return error.Diagnostic;
+    }
+
+    // Read, validate and parse whatever the client has sent, until the
+    // socket runs dry or the queue fills up
+    fn pump(self: *Inbound) void {
+        var produced = false;
+        defer if (produced) self.wakeMain();
+
+        while (true) {
+            const request = self.queue.reserve() orelse {
+                self.stalled.store(true, .seq_cst);
+                // The render thread may have drained the queue between our
+                // check and the store, in which case it missed the flag
+                if (self.queue.isFull() or !self.stalled.swap(false, .seq_cst)) return;
+                continue;
+            };
+
+            self.readRequest(request) catch |e| {
+                if (e == error.ReadFailed and self.reader.last_res == .AGAIN) break;
+
+                self.fail(e);
+                produced = true;
+                return;
+            };
+
+            self.queue.commit();
+            produced = true;
+        }
+
+        self.worker.rearm(self);
+    }
+
+    fn readRequest(self: *Inbound, request: *Request) ReadError!void {
+        self.reader.adaptBufferSize() catch {
+            logger.warn("failed to grow read buffer, continuing with existing buffer", .{});
+        };
+
+        const io_reader = &self.reader.interface;
+
+        var retrying = false;
+        while (true) {
+            const header = try io_reader.peekStruct(wlio.HeaderLE, .little);
+
+            const interface = (self.interfaces.get(header.id) orelse {
+                return self.makeDiagnostic(.invalid_object, "cannot find interface for object {d}", .{header.id});
+            }).*;
+
+            const message_info = Bindings.getIncomingMessageInfo(interface, header.op) orelse {
+                return self.makeDiagnostic(.invalid_method, "unknown opcode {d} for {t}", .{ header.op, interface });
+            };
+
+            if (!message_info.sizeValid(header.size)) {
+                return self.makeDiagnostic(.invalid_method, "received malformed request", .{});
+            }
+
+            const data = (try io_reader.peek(header.size))[@sizeOf(wlio.HeaderLE)..];
+
+            var fd: ?std.posix.fd_t = null;
+            if (message_info.num_fds > 0) {
+                fd = self.reader.fd_list.pop() orelse {
+                    if (!retrying) {
+                        // The fd may be stuck behind data that did not fit
+                        // in the buffer yet. Try once to fill it as much as
+                        // possible, a client sending the fd more than a
+                        // buffer's worth of messages late gets shut down
+                        try io_reader.fillMore();
+                        retrying = true;
+                        continue;
+                    }
+
+                    return error.NoFd;
+                };
+            }
+            errdefer if (fd) |f| std.posix.close(f);
+
+            const stored = try request.setData(data);
+            errdefer request.freeData();
+
+            const message = message_info.parse(stored) catch |e| switch (e) {
+                error.InvalidLen => {
+                    return self.makeDiagnostic(.invalid_method, "received malformed request", .{});
+                },
+            };
+
+            if (Bindings.newObject(message)) |new_object| {
+                if (new_object.interface) |new_interface| {
+                    try self.trackObject(new_object.id, new_interface);
+                }
+            }
+
+            _ = try io_reader.discard(.limited(header.size));
+
+            request.object_id = header.id;
+            request.message = message;
+            request.fd = fd;
+            return;
+        }
+    }
+
+    fn trackObject(self: *Inbound, id: u32, interface: Bindings.WaylandInterfaceType) !void {
+        // Ids are re-used once the client destroys an object, which we do not
+        // track here
+        _ = self.interfaces.remove(id);
+
+        self.interfaces.put(thread_alloc, id, interface) catch |e| switch (e) {
+            error.OutOfMemory => return error.OutOfMemory,
+            // Bad ids are reported by the render thread when it tries to
+            // create the object
+            error.InvalidId, error.IdInUse => {},
+        };
+    }
+};
+
+// The one operation a connection has in flight on an io_uring worker. The
+// kernel writes through these until it completes
+const RingOp = struct {
+    state: enum { idle, polling, receiving } = .idle,
+    // Removal is acknowledged once the op in flight has come back
+    removing: bool = false,
+    msg: std.os.linux.msghdr = undefined,
+    iov: std.posix.iovec = undefined,
+    control: [wl_cmsg.max_buf_size]u8 align(@alignOf(wl_cmsg.CmsgHdr)) = undefined,
+};
+
+const Worker = struct {
+    io: Io,
+    // Written whenever a command is queued
+    command_event: std.posix.fd_t,
+    // Only ever sent to from the render thread
+    commands: SpscQueue(Command),
+    thread: std.Thread,
+    // io_uring only, where the ring's read of command_event lands
+    command_val: u64 = 0,
+
+    const Io = union(Backend) {
+        epoll: std.posix.fd_t,
+        io_uring: std.os.linux.IoUring,
+    };
+
+    const Command = union(enum) {
+        add: *Inbound,
+        remove: *Inbound,
+        // The render thread drained a stalled connection
+        resume_reading: *Inbound,
+        stop,
+    };
+
+    const command_capacity = 64;
+    const max_events = 32;
+
+    // Every connection has at most one op in flight, plus the command read
+    // and a cancel per removal
+    const ring_entries = 256;
+    // Ring completions that are not for a connection. Connections go by
+    // pointer, which are never this low
+    const command_user_data = 0;
+    const cancel_user_data = 1;
+
+    fn init(self: *Worker, alloc: std.mem.Allocator, backend: Backend) !void {
+        var io: Io = switch (backend) {
+            .epoll => .{ .epoll = try std.posix.epoll_create1(std.os.linux.EPOLL.CLOEXEC) },
+            .io_uring => .{ .io_uring = try std.os.linux.IoUring.init(ring_entries, 0) },
+        };
+        errdefer deinitIo(&io);
+
+        // The ring waits on the command event for us, a blocking one saves
+        // it from handing back EAGAIN first
+        const event_flags: u32 = switch (backend) {
+            .epoll => std.os.linux.EFD.NONBLOCK | std.os.linux.EFD.CLOEXEC,
+            .io_uring => std.os.linux.EFD.CLOEXEC,
+        };
+        const command_event = try std.posix.eventfd(0, event_flags);
+        errdefer std.posix.close(command_event);
+
+        if (io == .epoll) {
+            // Connections are registered by pointer, commands have no pointer
+            var event = std.os.linux.epoll_event{
+                .events = std.os.linux.EPOLL.IN,
+                .data = .{ .ptr = 0 },
+            };
+            try std.posix.epoll_ctl(io.epoll, std.os.linux.EPOLL.CTL_ADD, command_event, &event);
+        }
+
+        self.* = .{
+            .io = io,
+            .command_event = command_event,
+            .commands = try .init(alloc, command_capacity),
+            .thread = undefined,
+        };
+
+        if (io == .io_uring) try self.queueCommandRead();
+
+        self.thread = try std.Thread.spawn(.{}, run, .{self});
+        self.thread.setName("wl-read") catch {};
+    }
+
+    fn deinit(self: *Worker) void {
+        self.send(.stop);
+        self.thread.join();
+        // Tearing down the ring cancels the command read, which has to go
+        // before the event it reads from
+        deinitIo(&self.io);
+        std.posix.close(self.command_event);
+    }
+
+    fn deinitIo(io: *Io) void {
+        switch (io.*) {
+            .epoll => |epoll| std.posix.close(epoll),
+            .io_uring => |*ring| ring.deinit(),
+        }
+    }
+
+    fn send(self: *Worker, command: Command) void {
+        // Only full if the worker is stuck on something, wait for it
+        while (!self.commands.push(command)) {
+            std.Thread.yield() catch {};
+        }
+
+        const val: u64 = 1;
+        _ = std.posix.write(self.command_event, std.mem.asBytes(&val)) catch |e| {
+            logger.err("failed to wake read worker: {t}", .{e});
+        };
+    }
+
+    // Render thread. The stalled connection may still have messages in its
+    // read buffer that no socket event will bring up again, so the worker
+    // picks up where it left off rather than waiting for the socket
+    fn resumeReading(self: *Worker, inbound: *Inbound) void {
+        self.send(.{ .resume_reading = inbound });
+    }
+
+    // Worker thread, the connection's read buffer is empty and the socket
+    // should be read again
+    fn rearm(self: *Worker, inbound: *Inbound) void {
+        switch (self.io) {
+            .epoll => self.armEpoll(inbound, std.os.linux.EPOLL.CTL_MOD),
+            .io_uring => self.queueRecv(inbound),
+        }
+    }
+
+    // Connections are one shot, so that a connection is only ever read by
+    // one pass at a time and a stalled one stays quiet until it is resumed
+    fn armEpoll(self: *Worker, inbound: *Inbound, op: u32) void {
+        var event = std.os.linux.epoll_event{
+            .events = std.os.linux.EPOLL.IN | std.os.linux.EPOLL.ONESHOT,
+            .data = .{ .ptr = @intFromPtr(inbound) },
+        };
+
+        std.posix.epoll_ctl(self.io.epoll, op, inbound.reader.socket.handle, &event) catch |e| {
+            logger.err("failed to watch client socket: {t}", .{e});
+            inbound.fail(error.ReadFailed);
+            inbound.wakeMain();
+        };
+    }
+
+    // Queued ops are only handed to the kernel with the next pass's wait,
+    // unless the submission queue fills up first
+    fn getSqe(self: *Worker) !*std.os.linux.io_uring_sqe {
+        const ring = &self.io.io_uring;
+        return ring.get_sqe() catch {
+            _ = try ring.submit();
+            return ring.get_sqe();
+        };
+    }
+
+    // Straight into the reader's buffer, fds and all. Nothing is copied
+    // around on our side, and one completion is all a connection costs
+    // when the client has data ready
+    fn queueRecv(self: *Worker, inbound: *Inbound) void {
+        const op = &inbound.ring_op;
+
+        const buf = inbound.reader.recvBuffer() catch |e| {
+            inbound.fail(switch (e) {
+                error.OutOfMemory => error.OutOfMemory,
+                // A full buffer with no complete message in it can only be
+                // a message waiting on an fd that never came
+                error.NoSpaceLeft => error.NoFd,
+            });
+            inbound.wakeMain();
+            return;
+        };
+
+        op.iov = .{ .base = buf.ptr, .len = buf.len };
+        op.msg = .{
+            .name = null,
+            .namelen = 0,
+            .iov = @ptrCast(&op.iov),
+            .iovlen = 1,
+            .control = &op.control,
+            .controllen = op.control.len,
+            .flags = 0,
+        };
+
+        const sqe = self.getSqe() catch |e| return self.failSubmit(inbound, e);
+        sqe.prep_recvmsg(inbound.reader.socket.handle, &op.msg, 0);
+        sqe.user_data = @intFromPtr(inbound);
+        op.state = .receiving;
+    }
+
+    // For sockets the kernel will not wait on for us, see complete()
+    fn queuePoll(self: *Worker, inbound: *Inbound) void {
+        const sqe = self.getSqe() catch |e| return self.failSubmit(inbound, e);
+        sqe.prep_poll_add(inbound.reader.socket.handle, std.os.linux.POLL.IN);
+        sqe.user_data = @intFromPtr(inbound);
+        inbound.ring_op.state = .polling;
+    }
+
+    fn failSubmit(self: *Worker, inbound: *Inbound, err: anyerror) void {
+        _ = self;
+        logger.err("failed to submit client read: {t}", .{err});
+        inbound.fail(error.ReadFailed);
+        inbound.wakeMain();
+    }
+
+    fn queueCommandRead(self: *Worker) !void {
+        const sqe = try self.getSqe();
+        sqe.prep_read(self.command_event, std.mem.asBytes(&self.command_val), 0);
+        sqe.user_data = command_user_data;
+    }
+
+    fn run(self: *Worker) void {
+        switch (self.io) {
+            .epoll => self.runEpoll(),
+            .io_uring => self.runRing(),
+        }
+    }
+
+    fn runEpoll(self: *Worker) void {
+        var events: [max_events]std.os.linux.epoll_event = undefined;
+
+        while (true) {
+            const num_events = std.posix.epoll_wait(self.io.epoll, &events, -1);
+
+            var commands_pending = false;
+            for (events[0..num_events]) |event| {
+                if (event.data.ptr == 0) {
+                    commands_pending = true;
+                    continue;
+                }
+
+                const inbound: *Inbound = @ptrFromInt(event.data.ptr);
+                inbound.pump();
+            }
+
+            // Commands go last, nothing else in this batch can refer to a
+            // connection once its removal has been acknowledged
+            if (commands_pending) {
+                var val: u64 = 0;
+                _ = std.posix.read(self.command_event, std.mem.asBytes(&val)) catch {};
+                if (!self.runCommands()) return;
+            }
+        }
+    }
+
+    fn runRing(self: *Worker) void {
+        const ring = &self.io.io_uring;
+        var cqes: [max_events]std.os.linux.io_uring_cqe = undefined;
+
+        while (true) {
+            // Whatever the last pass queued goes in with the wait, a pass is
+            // a single io_uring_enter however many connections it serves
+            _ = ring.submit_and_wait(1) catch |e| switch (e) {
+                error.SignalInterrupt => continue,
+                else => {
+                    // Giving up would leave removals waiting forever
+                    logger.err("read worker failed to wait on ring: {t}", .{e});
+                    std.Thread.yield() catch {};
+                    continue;
+                },
+            };
+
+            var commands_pending = false;
+            while (true) {
+                // Never enters the kernel, submit_and_wait() already did
+                const num_cqes = ring.copy_cqes(&cqes, 0) catch 0;
+                if (num_cqes == 0) break;
+
+                for (cqes[0..num_cqes]) |cqe| switch (cqe.user_data) {
+                    command_user_data => commands_pending = true,
+                    cancel_user_data => {},
+                    else => self.complete(@ptrFromInt(cqe.user_data), cqe),
+                };
+            }
+
+            // Same as with epoll, commands go last
+            if (commands_pending) {
+                if (!self.runCommands()) return;
+                self.queueCommandRead() catch |e| {
+                    logger.err("failed to wait for read worker commands: {t}", .{e});
+                };
+            }
+        }
+    }
+
+    fn complete(self: *Worker, inbound: *Inbound, cqe: std.os.linux.io_uring_cqe) void {
+        const op = &inbound.ring_op;
+        const state = op.state;
+        op.state = .idle;
+
+        if (op.removing) {
+            // Anything received in the meantime still has to go through the
+            // reader, it owns any fds that came with it
+            if (state == .receiving and cqe.res >= 0) {
+                inbound.reader.completeRecv(op.msg, &op.control, @intCast(cqe.res));
+            }
+            inbound.removed.set();
+            return;
+        }
+
+        switch (state) {
+            .idle => unreachable,
+            .polling => switch (cqe.err()) {
+                .SUCCESS => self.queueRecv(inbound),
+                else => |err| {
+                    inbound.reader.failRecv(err);
+                    inbound.pump();
+                },
+            },
+            .receiving => switch (cqe.err()) {
+                .SUCCESS => {
+                    inbound.reader.completeRecv(op.msg, &op.control, @intCast(cqe.res));
+                    inbound.pump();
+                },
+                // Sockets the compositor made non blocking may be handed
+                // back instead of waited on, depending on the kernel
+                .AGAIN => self.queuePoll(inbound),
+                else => |err| {
+                    inbound.reader.failRecv(err);
+                    inbound.pump();
+                },
+            },
+        }
+    }
+
+    // False once told to stop
+    fn runCommands(self: *Worker) bool {
+        while (self.commands.pop()) |command| switch (command) {
+            .add => |inbound| switch (self.io) {
+                .epoll => self.armEpoll(inbound, std.os.linux.EPOLL.CTL_ADD),
+                .io_uring => {
+                    inbound.reader.external = .{};
+                    self.queueRecv(inbound);
+                },
+            },
+            .remove => |inbound| self.removeInbound(inbound),
+            .resume_reading => |inbound| inbound.pump(),
+            .stop => return false,
+        };
+
+        return true;
+    }
+
+    fn removeInbound(self: *Worker, inbound: *Inbound) void {
+        switch (self.io) {
+            .epoll => {
+                std.posix.epoll_ctl(self.io.epoll, std.os.linux.EPOLL.CTL_DEL, inbound.reader.socket.handle, null) catch {};
+            },
+            .io_uring => if (inbound.ring_op.state != .idle) {
+                // The kernel may still write into the connection, which has
+                // to wait for the op to come back, cancelled or not
+                inbound.ring_op.removing = true;
+                const sqe = self.getSqe() catch |e| {
+                    // Still comes back once the client sends something or
+                    // hangs up, which the render thread is about to do
+                    logger.err("failed to cancel client read: {t}", .{e});
+                    return;
+                };
+                sqe.prep_cancel(@intFromPtr(inbound), 0);
+                sqe.user_data = cancel_user_data;
+                return;
+            },
+        }
+
+        inbound.removed.set();
+    }
+};
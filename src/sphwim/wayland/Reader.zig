@@ -1,27 +1,56 @@
 const std = @import("std");
 const sphtud = @import("sphtud");
 const wl_cmsg = @import("wl_cmsg");
-const FdPool = @import("../FdPool.zig");
 
 const Reader = @This();
 
+const logger = std.log.scoped(.wl_reader);
+
 socket: std.net.Stream,
-fd_pool: *FdPool,
+// Received but not yet handed out with a message. Ours to close until then
 fd_list: sphtud.util.CircularBuffer(std.posix.fd_t),
 last_res: std.os.linux.E = .SUCCESS,
+// Set when the last read filled everything we offered, which means the
+// client probably had more for us and our buffer is too small
+last_read_saturated: bool = false,
+// Set when reads are submitted by someone else, e.g. through io_uring. The
+// reader then never touches the socket itself, it only reports how the last
+// submitted read went once the buffer runs dry
+external: ?External = null,
+buffer_alloc: std.mem.Allocator,
 interface: std.Io.Reader,
 
-pub fn init(alloc: std.mem.Allocator, fd_pool: *FdPool, socket: std.net.Stream) !Reader {
+const initial_buffer_size = 4096;
+const max_buffer_size = 64 * 1024;
+
+// Clients send file descriptors attached to the message that needs them. The
+// kernel will not merge data across those boundaries in a single recvmsg, so
+// a burst of attach/commit with fds would otherwise cost one read per fd. We
+// receive into a few consecutive segments of our buffer with one recvmmsg
+// instead
+const max_segments = 4;
+const min_segment_size = 1024;
+
+const SCM_RIGHTS = 1;
+
+pub const External = struct {
+    eof: bool = false,
+    err: std.os.linux.E = .SUCCESS,
+};
+
+// buffer_alloc is used for the read buffer, which is resized as the client's
+// traffic demands
+pub fn init(alloc: std.mem.Allocator, buffer_alloc: std.mem.Allocator, socket: std.net.Stream) !Reader {
     return .{
         .socket = socket,
-        .fd_pool = fd_pool,
         .fd_list = .{
             // 100 file descriptors received before we handle any of them seems
             // like an insanely large number for a single connection
             .items = try alloc.alloc(c_int, 100),
         },
+        .buffer_alloc = buffer_alloc,
         .interface = std.Io.Reader{
-            .buffer = try alloc.alloc(u8, 4096),
+            .buffer = try buffer_alloc.alloc(u8, initial_buffer_size),
             .vtable = &.{
                 .stream = stream,
             },
@@ -31,32 +60,125 @@ pub fn init(alloc: std.mem.Allocator, fd_pool: *FdPool, socket: std.net.Stream)
     };
 }
 
+// Does not own the socket
+pub fn deinit(self: *Reader) void {
+    while (self.fd_list.pop()) |fd| {
+        std.posix.close(fd);
+    }
+    self.buffer_alloc.free(self.interface.buffer);
+}
+
+// Grow the read buffer if the client has been sending more than we can take
+// in one read. Must not be called while data from the reader is borrowed
+pub fn adaptBufferSize(self: *Reader) !void {
+    if (!self.last_read_saturated) return;
+    self.last_read_saturated = false;
+
+    const r = &self.interface;
+    if (r.buffer.len >= max_buffer_size) return;
+
+    const new_buf = try self.buffer_alloc.alloc(u8, @min(r.buffer.len * 2, max_buffer_size));
+    const buffered = r.buffer[r.seek..r.end];
+    @memcpy(new_buf[0..buffered.len], buffered);
+
+    self.buffer_alloc.free(r.buffer);
+    r.buffer = new_buf;
+    r.seek = 0;
+    r.end = buffered.len;
+
+    logger.debug("grew read buffer to {d}", .{new_buf.len});
+}
+
+// Space for the next externally submitted read, after whatever is still
+// buffered. Must not be called while data from the reader is borrowed
+pub fn recvBuffer(self: *Reader) ![]u8 {
+    const r = &self.interface;
+    if (r.seek > 0) {
+        std.mem.copyForwards(u8, r.buffer, r.buffer[r.seek..r.end]);
+        r.end -= r.seek;
+        r.seek = 0;
+    }
+
+    if (r.end == r.buffer.len) {
+        self.last_read_saturated = true;
+        try self.adaptBufferSize();
+    }
+
+    // Only possible if a client holds back an fd for a whole buffer's worth
+    // of messages
+    if (r.end == r.buffer.len) return error.NoSpaceLeft;
+
+    return r.buffer[r.end..];
+}
+
+// An externally submitted read into recvBuffer() finished with len bytes
+pub fn completeRecv(self: *Reader, hdr: std.os.linux.msghdr, control: []const u8, len: usize) void {
+    const external = &self.external.?;
+    self.collectFds(hdr, control);
+
+    if (len == 0) {
+        external.eof = true;
+        return;
+    }
+
+    const r = &self.interface;
+    self.last_read_saturated = len == r.buffer.len - r.end;
+    r.end += len;
+}
+
+pub fn failRecv(self: *Reader, err: std.os.linux.E) void {
+    self.external.?.err = err;
+}
+
 fn stream(r: *std.Io.Reader, writer: *std.Io.Writer, limit: std.Io.Limit) error{ EndOfStream, ReadFailed, WriteFailed }!usize {
     const self: *Reader = @fieldParentPtr("interface", r);
     self.last_res = .SUCCESS;
 
+    if (self.external) |external| {
+        if (external.err != .SUCCESS) {
+            self.last_res = external.err;
+            return error.ReadFailed;
+        }
+
+        if (external.eof) return error.EndOfStream;
+
+        // Nothing more until the next submitted read completes
+        self.last_res = .AGAIN;
+        return error.ReadFailed;
+    }
+
     const dest = limit.slice(try writer.writableSliceGreedy(1));
 
-    var iov: [1]std.posix.iovec = .{.{
-        .base = dest.ptr,
-        .len = dest.len,
-    }};
-
-    var control: [wl_cmsg.max_buf_size]u8 = undefined;
-    var msg_header = std.os.linux.msghdr{
-        .name = null,
-        .namelen = 0,
-        .iov = &iov,
-        .iovlen = 1,
-        .control = &control,
-        .controllen = control.len,
-        .flags = 0,
-    };
+    const num_segments = std.math.clamp(dest.len / min_segment_size, 1, max_segments);
+    const segment_size = dest.len / num_segments;
 
-    // We could recvmmsg here, but for now this is good enough
-    const ret = std.os.linux.recvmsg(self.socket.handle, &msg_header, 0);
+    var iovs: [max_segments]std.posix.iovec = undefined;
+    var controls: [max_segments][wl_cmsg.max_buf_size]u8 align(@alignOf(wl_cmsg.CmsgHdr)) = undefined;
+    var msgs: [max_segments]std.os.linux.mmsghdr = undefined;
 
-    if (ret == 0) return error.EndOfStream;
+    for (0..num_segments) |i| {
+        const segment_start = i * segment_size;
+        const segment_end = if (i == num_segments - 1) dest.len else segment_start + segment_size;
+        iovs[i] = .{
+            .base = dest[segment_start..].ptr,
+            .len = segment_end - segment_start,
+        };
+
+        msgs[i] = .{
+            .hdr = .{
+                .name = null,
+                .namelen = 0,
+                .iov = iovs[i..].ptr,
+                .iovlen = 1,
+                .control = &controls[i],
+                .controllen = controls[i].len,
+                .flags = 0,
+            },
+            .len = 0,
+        };
+    }
+
+    const ret = std.os.linux.recvmmsg(self.socket.handle, &msgs, @intCast(num_segments), 0, null);
 
     const linux_err: std.os.linux.E = .init(ret);
     switch (linux_err) {
@@ -67,29 +189,61 @@ fn stream(r: *std.Io.Reader, writer: *std.Io.Writer, limit: std.Io.Limit) error{
         },
     }
 
-    if (msg_header.controllen >= @sizeOf(wl_cmsg.CmsgHdr)) blk: {
-        const hdr = std.mem.bytesToValue(wl_cmsg.CmsgHdr, &control);
-        if (hdr.cmsg_level == std.os.linux.SOL.SOCKET) {
-            var offs: usize = wl_cmsg.fd_list_start;
-            while (offs < hdr.cmsg_len) {
-                const fd: c_int = std.mem.bytesToValue(c_int, control[offs..][0..4]);
-                offs += 4;
-
-                self.fd_pool.register(fd) catch {
-                    std.log.err("Dropped file descriptor", .{});
-                    std.posix.close(fd);
-                    break :blk;
-                };
-
-                self.fd_list.pushNoClobber(fd) catch {
-                    std.log.err("Dropped file descriptor", .{});
-                    self.fd_pool.close(fd);
-                    break :blk;
-                };
-            }
+    // Segments are sized up front, so anything that did not fill its segment
+    // leaves a gap. Pack everything down to the start of dest
+    var total: usize = 0;
+    for (msgs[0..ret], 0..) |msg, i| {
+        self.collectFds(msg.hdr, &controls[i]);
+
+        if (msg.len == 0) {
+            // Remote closed, whatever came before this is still valid. The
+            // next read will report the end of stream
+            break;
+        }
+
+        const segment_start = i * segment_size;
+        if (segment_start != total) {
+            std.mem.copyForwards(u8, dest[total..], dest[segment_start..][0..msg.len]);
+        }
+        total += msg.len;
+    }
+
+    if (total == 0) return error.EndOfStream;
+
+    self.last_read_saturated = total == dest.len;
+
+    writer.advance(total);
+    return total;
+}
+
+fn collectFds(self: *Reader, hdr: std.os.linux.msghdr, control: []const u8) void {
+    if (hdr.flags & std.os.linux.MSG.CTRUNC != 0) {
+        logger.err("Ancillary data truncated, file descriptors were dropped", .{});
+    }
+
+    var offs: usize = 0;
+    while (offs + @sizeOf(wl_cmsg.CmsgHdr) <= hdr.controllen) {
+        const cmsg = std.mem.bytesToValue(wl_cmsg.CmsgHdr, control[offs..][0..@sizeOf(wl_cmsg.CmsgHdr)]);
+        if (cmsg.cmsg_len < wl_cmsg.fd_list_start or offs + cmsg.cmsg_len > hdr.controllen) break;
+
+        if (cmsg.cmsg_level == std.os.linux.SOL.SOCKET and cmsg.cmsg_type == SCM_RIGHTS) {
+            self.pushFds(control[offs + wl_cmsg.fd_list_start .. offs + cmsg.cmsg_len]);
         }
+
+        offs += std.mem.alignForward(usize, cmsg.cmsg_len, @sizeOf(usize));
     }
+}
+
+fn pushFds(self: *Reader, fd_data: []const u8) void {
+    var offs: usize = 0;
+    while (offs + @sizeOf(c_int) <= fd_data.len) {
+        const fd: c_int = std.mem.bytesToValue(c_int, fd_data[offs..][0..@sizeOf(c_int)]);
+        offs += @sizeOf(c_int);
 
-    writer.advance(@intCast(ret));
-    return @intCast(ret);
+        self.fd_list.pushNoClobber(fd) catch {
+            std.log.err("Dropped file descriptor", .{});
+            std.posix.close(fd);
+            continue;
+        };
+    }
 }
@@ -0,0 +1,110 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+// Bounded queue between exactly one producer thread and one consumer thread.
+// Neither side ever blocks or takes a lock, a full or empty queue is reported
+// and it is up to the caller to come back later
+//
+// Items are written and read in place, a reserved slot is only visible to the
+// consumer once committed, and a peeked slot is only handed back to the
+// producer once released. Anything the consumer borrows from a slot stays
+// valid until then
+pub fn SpscQueue(comptime T: type) type {
+    return struct {
+        items: []T,
+        // Next slot to read, only written by the consumer
+        head: std.atomic.Value(usize) align(std.atomic.cache_line) = .init(0),
+        // Next slot to write, only written by the producer
+        tail: std.atomic.Value(usize) align(std.atomic.cache_line) = .init(0),
+
+        const Self = @This();
+
+        // capacity must be a power of two, so that positions can grow forever
+        // and wrap with a mask
+        pub fn init(alloc: Allocator, capacity: usize) !Self {
+            std.debug.assert(std.math.isPowerOfTwo(capacity));
+            return .{
+                .items = try alloc.alloc(T, capacity),
+            };
+        }
+
+        pub fn deinit(self: *Self, alloc: Allocator) void {
+            alloc.free(self.items);
+        }
+
+        // Producer side. Null if the consumer has not released enough yet
+        pub fn reserve(self: *Self) ?*T {
+            const tail = self.tail.load(.monotonic);
+            const head = self.head.load(.acquire);
+            if (tail -% head == self.items.len) return null;
+            return &self.items[tail & (self.items.len - 1)];
+        }
+
+        // Producer side, publishes the slot returned by reserve()
+        pub fn commit(self: *Self) void {
+            const tail = self.tail.load(.monotonic);
+            self.tail.store(tail +% 1, .release);
+        }
+
+        pub fn push(self: *Self, val: T) bool {
+            const slot = self.reserve() orelse return false;
+            slot.* = val;
+            self.commit();
+            return true;
+        }
+
+        // Consumer side, oldest committed item
+        pub fn peek(self: *Self) ?*T {
+            const head = self.head.load(.monotonic);
+            const tail = self.tail.load(.acquire);
+            if (head == tail) return null;
+            return &self.items[head & (self.items.len - 1)];
+        }
+
+        // Consumer side, hands the slot returned by peek() back
+        pub fn release(self: *Self) void {
+            const head = self.head.load(.monotonic);
+            self.head.store(head +% 1, .release);
+        }
+
+        pub fn pop(self: *Self) ?T {
+            const ret = (self.peek() orelse return null).*;
+            self.release();
+            return ret;
+        }
+
+        // Either side. Only a hint, the other side may be moving it
+        pub fn isFull(self: *const Self) bool {
+            return self.tail.load(.acquire) -% self.head.load(.acquire) == self.items.len;
+        }
+    };
+}
+
+test "spsc queue wraparound" {
+    var queue = try SpscQueue(u32).init(std.testing.allocator, 4);
+    defer queue.deinit(std.testing.allocator);
+
+    // Positions are only ever masked, start them close to overflowing
+    queue.head = .init(std.math.maxInt(usize) - 5);
+    queue.tail = .init(std.math.maxInt(usize) - 5);
+
+    var next_push: u32 = 0;
+    var next_pop: u32 = 0;
+    for (0..10) |_| {
+        while (queue.push(next_push)) next_push += 1;
+        try std.testing.expect(queue.isFull());
+        try std.testing.expectEqual(4, next_push - next_pop);
+
+        for (0..3) |_| {
+            try std.testing.expectEqual(next_pop, queue.pop().?);
+            next_pop += 1;
+        }
+    }
+
+    while (queue.pop()) |val| {
+        try std.testing.expectEqual(next_pop, val);
+        next_pop += 1;
+    }
+    try std.testing.expectEqual(next_push, next_pop);
+    try std.testing.expectEqual(null, queue.peek());
+}
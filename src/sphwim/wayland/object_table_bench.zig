@@ -0,0 +1,196 @@
+const std = @import("std");
+const object_table = @import("ObjectTable.zig");
+
+// Replays the object traffic of a client with a large number of live objects
+// against both the ObjectTable and the hash map layout it replaced (one map
+// for interface lookup, plus one per interface with state)
+//
+// zig build bench -Doptimize=ReleaseFast
+
+const num_surfaces = 2000;
+const buffers_per_surface = 3;
+const num_frames = 200;
+
+const Interface = enum(u8) {
+    wl_surface,
+    wl_buffer,
+    zwp_linux_buffer_params_v1,
+    xdg_surface,
+    xdg_toplevel,
+    wl_callback,
+};
+
+const Op = struct {
+    kind: enum { create, lookup, destroy },
+    id: u32,
+    interface: Interface,
+};
+
+// Mimics Connection.Object, sized similarly so cache behavior is comparable
+const Object = union(Interface) {
+    wl_surface: [6]u64,
+    wl_buffer: *anyopaque,
+    zwp_linux_buffer_params_v1: [3]u64,
+    xdg_surface: u32,
+    xdg_toplevel: [4]u64,
+    wl_callback: void,
+};
+
+fn makeObject(interface: Interface) Object {
+    return switch (interface) {
+        .wl_surface => .{ .wl_surface = @splat(0) },
+        .wl_buffer => .{ .wl_buffer = @ptrFromInt(0x1000) },
+        .zwp_linux_buffer_params_v1 => .{ .zwp_linux_buffer_params_v1 = @splat(0) },
+        .xdg_surface => .{ .xdg_surface = 0 },
+        .xdg_toplevel => .{ .xdg_toplevel = @splat(0) },
+        .wl_callback => .{ .wl_callback = {} },
+    };
+}
+
+const IdAllocator = struct {
+    next: u32 = 2,
+    free: std.ArrayList(u32) = .empty,
+
+    // libwayland hands out the most recently freed id first
+    fn alloc(self: *IdAllocator) u32 {
+        if (self.free.pop()) |id| return id;
+        defer self.next += 1;
+        return self.next;
+    }
+
+    fn release(self: *IdAllocator, gpa: std.mem.Allocator, id: u32) !void {
+        try self.free.append(gpa, id);
+    }
+};
+
+fn generateSession(gpa: std.mem.Allocator) ![]Op {
+    var ops = std.ArrayList(Op).empty;
+    var ids = IdAllocator{};
+    defer ids.free.deinit(gpa);
+
+    const surfaces = try gpa.alloc(u32, num_surfaces);
+    defer gpa.free(surfaces);
+
+    const buffers = try gpa.alloc([buffers_per_surface]u32, num_surfaces);
+    defer gpa.free(buffers);
+
+    for (surfaces, buffers) |*surface, *surface_buffers| {
+        surface.* = ids.alloc();
+        try ops.append(gpa, .{ .kind = .create, .id = surface.*, .interface = .wl_surface });
+
+        const xdg_surface = ids.alloc();
+        try ops.append(gpa, .{ .kind = .create, .id = xdg_surface, .interface = .xdg_surface });
+        try ops.append(gpa, .{ .kind = .lookup, .id = surface.*, .interface = .wl_surface });
+        try ops.append(gpa, .{ .kind = .create, .id = ids.alloc(), .interface = .xdg_toplevel });
+
+        for (surface_buffers) |*buffer| {
+            const params = ids.alloc();
+            try ops.append(gpa, .{ .kind = .create, .id = params, .interface = .zwp_linux_buffer_params_v1 });
+            try ops.append(gpa, .{ .kind = .lookup, .id = params, .interface = .zwp_linux_buffer_params_v1 });
+
+            buffer.* = ids.alloc();
+            try ops.append(gpa, .{ .kind = .create, .id = buffer.*, .interface = .wl_buffer });
+            try ops.append(gpa, .{ .kind = .destroy, .id = params, .interface = .zwp_linux_buffer_params_v1 });
+            try ids.release(gpa, params);
+        }
+    }
+
+    for (0..num_frames) |frame| {
+        for (surfaces, buffers) |surface, surface_buffers| {
+            // attach + frame + commit, and the callback we fire after render
+            try ops.append(gpa, .{ .kind = .lookup, .id = surface, .interface = .wl_surface });
+            try ops.append(gpa, .{ .kind = .lookup, .id = surface_buffers[frame % buffers_per_surface], .interface = .wl_buffer });
+
+            const callback = ids.alloc();
+            try ops.append(gpa, .{ .kind = .create, .id = callback, .interface = .wl_callback });
+            try ops.append(gpa, .{ .kind = .lookup, .id = surface, .interface = .wl_surface });
+            try ops.append(gpa, .{ .kind = .lookup, .id = surface, .interface = .wl_surface });
+            try ops.append(gpa, .{ .kind = .destroy, .id = callback, .interface = .wl_callback });
+            try ids.release(gpa, callback);
+        }
+    }
+
+    return try ops.toOwnedSlice(gpa);
+}
+
+fn replayTable(gpa: std.mem.Allocator, ops: []const Op) !u64 {
+    var table = object_table.ObjectTable(Object).empty;
+    defer table.deinit(gpa);
+
+    var checksum: u64 = 0;
+    for (ops) |op| {
+        switch (op.kind) {
+            .create => try table.put(gpa, op.id, makeObject(op.interface)),
+            .lookup => {
+                const object = table.get(op.id) orelse return error.MissingObject;
+                checksum +%= @intFromEnum(std.meta.activeTag(object.*));
+            },
+            .destroy => {
+                _ = table.remove(op.id) orelse return error.MissingObject;
+            },
+        }
+    }
+    return checksum;
+}
+
+fn replayHashMaps(gpa: std.mem.Allocator, ops: []const Op) !u64 {
+    var registry = std.AutoHashMapUnmanaged(u32, Interface).empty;
+    defer registry.deinit(gpa);
+
+    var states = std.AutoHashMapUnmanaged(u32, Object).empty;
+    defer states.deinit(gpa);
+
+    var checksum: u64 = 0;
+    for (ops) |op| {
+        switch (op.kind) {
+            .create => {
+                try registry.put(gpa, op.id, op.interface);
+                if (op.interface != .wl_callback) {
+                    try states.put(gpa, op.id, makeObject(op.interface));
+                }
+            },
+            .lookup => {
+                const interface = registry.get(op.id) orelse return error.MissingObject;
+                const object = states.getPtr(op.id) orelse return error.MissingObject;
+                checksum +%= @intFromEnum(interface);
+                std.mem.doNotOptimizeAway(object);
+            },
+            .destroy => {
+                _ = registry.remove(op.id);
+                _ = states.remove(op.id);
+            },
+        }
+    }
+    return checksum;
+}
+
+fn bench(comptime name: []const u8, gpa: std.mem.Allocator, ops: []const Op, comptime replay: anytype) !void {
+    const iters = 20;
+    var best: u64 = std.math.maxInt(u64);
+
+    for (0..iters) |_| {
+        var timer = try std.time.Timer.start();
+        std.mem.doNotOptimizeAway(try replay(gpa, ops));
+        best = @min(best, timer.read());
+    }
+
+    std.debug.print("{s}: {d} ops, best {d:.3}ms, {d:.1}ns/op\n", .{
+        name,
+        ops.len,
+        @as(f64, @floatFromInt(best)) / std.time.ns_per_ms,
+        @as(f64, @floatFromInt(best)) / @as(f64, @floatFromInt(ops.len)),
+    });
+}
+
+pub fn main() !void {
+    var gpa_state = std.heap.DebugAllocator(.{}){};
+    defer _ = gpa_state.deinit();
+
+    const gpa = if (@import("builtin").mode == .Debug) gpa_state.allocator() else std.heap.smp_allocator;
+
+    const ops = try generateSession(gpa);
+    defer gpa.free(ops);
+
+    try bench("object table", gpa, ops, replayTable);
+    try bench("hash maps", gpa, ops, replayHashMaps);
+}
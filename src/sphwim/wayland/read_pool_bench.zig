@@ -0,0 +1,186 @@
+const std = @import("std");
+const wl_cmsg = @import("wl_cmsg");
+const ReadPool = @import("ReadPool.zig");
+
+// Streams the same synthetic client traffic through the read pool with each
+// of its backends, and times how long the consuming side waits until it has
+// every request. Clients send a frame's worth of requests per write, one of
+// them with an fd attached, roughly what a busy libwayland client flushes
+//
+// zig build bench -Doptimize=ReleaseFast
+
+const num_clients = 32;
+const num_frames = 2000;
+const syncs_per_frame = 6;
+
+const display_id = 1;
+const registry_id = 2;
+const shm_id = 3;
+const shm_pool_id = 4;
+const first_callback_id = 5;
+
+// get_registry and bind, then every frame a create_pool, the syncs and the
+// pool's destroy
+const requests_per_client = 2 + num_frames * (2 + syncs_per_frame);
+
+fn writeMessage(w: *std.Io.Writer, object_id: u32, op: u16, args: []const u8) !void {
+    try w.writeInt(u32, object_id, .little);
+    try w.writeInt(u16, op, .little);
+    try w.writeInt(u16, @intCast(8 + args.len), .little);
+    try w.writeAll(args);
+}
+
+fn u32Bytes(comptime args: anytype) [args.len * 4]u8 {
+    const vals: [args.len]u32 = args;
+    return @bitCast(vals);
+}
+
+// name, interface, version, id
+const bind_args = u32Bytes(.{ 1, 7 }) ++ "wl_shm\x00\x00".* ++ u32Bytes(.{ 1, shm_id });
+
+fn writeAll(socket: std.posix.fd_t, data: []const u8) !void {
+    var written: usize = 0;
+    while (written < data.len) {
+        written += try std.posix.write(socket, data[written..]);
+    }
+}
+
+fn runClient(socket: std.net.Stream, pool_fd: std.posix.fd_t) !void {
+    var buf: [4096]u8 = undefined;
+
+    var w = std.Io.Writer.fixed(&buf);
+    // wl_display.get_registry, wl_registry.bind
+    try writeMessage(&w, display_id, 1, &u32Bytes(.{registry_id}));
+    try writeMessage(&w, registry_id, 0, &bind_args);
+    try writeAll(socket.handle, w.buffered());
+
+    for (0..num_frames) |_| {
+        // wl_shm.create_pool
+        w = std.Io.Writer.fixed(&buf);
+        try writeMessage(&w, shm_id, 0, &u32Bytes(.{ shm_pool_id, 4096 }));
+        try wl_cmsg.sendMessageWithFdAttachment(socket, w.buffered(), pool_fd);
+
+        // wl_display.sync, wl_shm_pool.destroy
+        w = std.Io.Writer.fixed(&buf);
+        for (0..syncs_per_frame) |i| {
+            try writeMessage(&w, display_id, 0, std.mem.asBytes(&@as(u32, @intCast(first_callback_id + i))));
+        }
+        try writeMessage(&w, shm_pool_id, 1, &.{});
+        try writeAll(socket.handle, w.buffered());
+    }
+}
+
+fn socketPair() ![2]std.posix.fd_t {
+    var fds: [2]std.posix.fd_t = undefined;
+    const ret = std.os.linux.socketpair(std.os.linux.AF.UNIX, std.os.linux.SOCK.STREAM | std.os.linux.SOCK.CLOEXEC, 0, &fds);
+    if (std.os.linux.E.init(ret) != .SUCCESS) return error.SocketPair;
+
+    // The compositor's end is non blocking like an accepted client, the
+    // client's end blocks when we fall behind
+    const flags = try std.posix.fcntl(fds[0], std.posix.F.GETFL, 0);
+    _ = try std.posix.fcntl(fds[0], std.posix.F.SETFL, flags | @as(u32, @bitCast(std.posix.O{ .NONBLOCK = true })));
+    return fds;
+}
+
+fn runRound(backend: ReadPool.Backend, pool_fd: std.posix.fd_t) !u64 {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const alloc = arena.allocator();
+
+    var pool = try ReadPool.init(alloc, .{ .backend = backend });
+    defer pool.deinit();
+    if (pool.backend != backend) return error.BackendUnavailable;
+
+    var sockets: [num_clients][2]std.posix.fd_t = undefined;
+    var inbounds: [num_clients]*ReadPool.Inbound = undefined;
+    var pollfds: [num_clients]std.posix.pollfd = undefined;
+
+    for (&sockets, &inbounds, &pollfds) |*pair, *inbound, *pollfd| {
+        pair.* = try socketPair();
+        inbound.* = try alloc.create(ReadPool.Inbound);
+        inbound.*.* = try .init(alloc, .{ .handle = pair[0] });
+        pollfd.* = .{ .fd = inbound.*.wake_event, .events = std.posix.POLL.IN, .revents = 0 };
+        pool.add(inbound.*);
+    }
+
+    defer for (sockets, inbounds) |pair, inbound| {
+        pool.remove(inbound);
+        inbound.deinit();
+        std.posix.close(pair[0]);
+        std.posix.close(pair[1]);
+    };
+
+    var timer = try std.time.Timer.start();
+
+    var clients: [num_clients]std.Thread = undefined;
+    var num_started: usize = 0;
+    defer for (clients[0..num_started]) |client| client.join();
+
+    for (&clients, sockets) |*client, pair| {
+        client.* = try std.Thread.spawn(.{}, runClient, .{ std.net.Stream{ .handle = pair[1] }, pool_fd });
+        num_started += 1;
+    }
+    // Clients blocked on a full socket would never finish otherwise
+    errdefer for (sockets) |pair| std.posix.shutdown(pair[0], .both) catch {};
+
+    var remaining: usize = num_clients * requests_per_client;
+    while (remaining > 0) {
+        _ = try std.posix.poll(&pollfds, -1);
+
+        for (pollfds, inbounds) |pollfd, inbound| {
+            if (pollfd.revents == 0) continue;
+
+            inbound.consumeWake();
+            const failed = inbound.failed.load(.acquire);
+
+            while (inbound.queue.peek()) |request| {
+                if (request.fd) |fd| std.posix.close(fd);
+                inbound.release(request);
+                remaining -= 1;
+            }
+
+            // Clients never hang up before they are done
+            if (failed) {
+                std.debug.print("client failed: {t}\n", .{inbound.failure});
+                return error.ClientFailed;
+            }
+
+            inbound.resumeIfStalled();
+        }
+    }
+
+    return timer.read();
+}
+
+fn bench(backend: ReadPool.Backend, pool_fd: std.posix.fd_t) !void {
+    const iters = 10;
+    var best: u64 = std.math.maxInt(u64);
+
+    for (0..iters) |_| {
+        best = @min(best, runRound(backend, pool_fd) catch |e| switch (e) {
+            error.BackendUnavailable => {
+                std.debug.print("{t}: unavailable\n", .{backend});
+                return;
+            },
+            else => return e,
+        });
+    }
+
+    const num_requests = num_clients * requests_per_client;
+    std.debug.print("{t}: {d} requests from {d} clients, best {d:.3}ms, {d:.1}ns/request\n", .{
+        backend,
+        num_requests,
+        num_clients,
+        @as(f64, @floatFromInt(best)) / std.time.ns_per_ms,
+        @as(f64, @floatFromInt(best)) / @as(f64, @floatFromInt(num_requests)),
+    });
+}
+
+pub fn main() !void {
+    // Only ever passed along, never mapped
+    const pool_fd = try std.posix.memfd_create("read_pool_bench", std.os.linux.MFD.CLOEXEC);
+    defer std.posix.close(pool_fd);
+
+    try bench(.epoll, pool_fd);
+    try bench(.io_uring, pool_fd);
+}
@@ -36,6 +36,23 @@ pub const GbmContext = struct {
         pub fn format(self: Buffer) u32 {
             return c.gbm_bo_get_format(self.inner);
         }
+
+        pub fn userData(self: Buffer) ?*anyopaque {
+            return c.gbm_bo_get_user_data(self.inner);
+        }
+
+        // Buffer objects are recycled by the gbm surface for its whole
+        // lifetime, per buffer state can be stashed here and cleaned up when
+        // the buffer object is destroyed
+        pub fn setUserData(self: Buffer, data: ?*anyopaque, comptime destroy: ?fn (data: ?*anyopaque) void) void {
+            const destroy_fn = if (destroy) |f| &struct {
+                fn destroyUserData(_: ?*c.gbm_bo, user_data: ?*anyopaque) callconv(.c) void {
+                    f(user_data);
+                }
+            }.destroyUserData else null;
+
+            c.gbm_bo_set_user_data(self.inner, data, destroy_fn);
+        }
     };
 
     const format = c.GBM_FORMAT_XRGB8888;
@@ -120,7 +120,10 @@ fn registerForDmaBufFeedback(client: *wlclient.Client(wlb)) !?u64 {
     return main_device_dev_t;
 }
 
+// The window it is used with has to outlive it, its wl_buffers are destroyed
+// along with the gbm surface in deinit()
 pub const DefaultGlContext = struct {
+    alloc: std.mem.Allocator,
     egl_ctx: system.EglContext,
     gbm_ctx: system.GbmContext,
     compositor_owned_buffers: std.AutoHashMap(u32, system.GbmContext.Buffer),
@@ -132,6 +135,7 @@ pub const DefaultGlContext = struct {
         const egl_ctx = try system.EglContext.init(alloc, gbm_ctx);
 
         return .{
+            .alloc = alloc,
             .egl_ctx = egl_ctx,
             .gbm_ctx = gbm_ctx,
             .compositor_owned_buffers = .init(alloc),
@@ -165,13 +169,54 @@ pub const DefaultGlContext = struct {
         // wl_surface, then it is owned by the compositor
         errdefer self.gbm_ctx.unlock(front_buf);
 
-        const buffer = try RenderBuffer.fromGbm(front_buf);
-        defer std.posix.close(buffer.fd);
+        const wl_buf_id = try self.wlBufferForGbm(window, front_buf);
 
-        const wl_buf_id = try window.swapBuffers(buffer);
         try self.compositor_owned_buffers.put(wl_buf_id, front_buf);
+        errdefer _ = self.compositor_owned_buffers.remove(wl_buf_id);
+
+        try window.swapBuffers(wl_buf_id);
+    }
+
+    // The gbm surface cycles through the same few buffer objects, so each
+    // one gets a wl_buffer the first time we see it and keeps it for the
+    // lifetime of the buffer object
+    fn wlBufferForGbm(self: *DefaultGlContext, window: *Window, gbm_buf: system.GbmContext.Buffer) !u32 {
+        if (gbm_buf.userData()) |data| {
+            const bo_buffer: *BoWlBuffer = @ptrCast(@alignCast(data));
+            return bo_buffer.id;
+        }
+
+        const bo_buffer = try self.alloc.create(BoWlBuffer);
+        errdefer self.alloc.destroy(bo_buffer);
+
+        const buffer = try RenderBuffer.fromGbm(gbm_buf);
+        defer std.posix.close(buffer.fd);
+
+        bo_buffer.* = .{
+            .alloc = self.alloc,
+            .window = window,
+            .id = try window.createBuffer(buffer),
+        };
+        gbm_buf.setUserData(bo_buffer, BoWlBuffer.destroy);
+        return bo_buffer.id;
     }
 
+    // Lives in the buffer object's user data, so that the wl_buffer goes
+    // away with the buffer object
+    const BoWlBuffer = struct {
+        alloc: std.mem.Allocator,
+        window: *Window,
+        id: u32,
+
+        fn destroy(data: ?*anyopaque) void {
+            const self: *BoWlBuffer = @ptrCast(@alignCast(data));
+            self.window.destroyBuffer(self.id) catch |e| {
+                std.log.err("failed to destroy wl_buffer: {t}", .{e});
+            };
+            self.alloc.destroy(self);
+        }
+    };
+
     pub fn notifyGlBufferRelease(self: *DefaultGlContext, buf_id: u32) void {
         const gbm_handle = self.compositor_owned_buffers.fetchRemove(buf_id) orelse {
             std.log.err("Got release event for unknown buffer", .{});
@@ -263,6 +308,7 @@ pub const Window = struct {
             .id = surface_feedback.id,
         });
 
+        try client.flush();
         const preferred_gpu = try registerForDmaBufFeedback(&client);
 
         const wl_surface = try client.newId(wlb.WlSurface);
@@ -294,6 +340,8 @@ pub const Window = struct {
             .callback = frame_callback.id,
         });
 
+        try client.flush();
+
         const typical_input_events = 24;
         const max_input_events = 1024;
 
@@ -341,9 +389,19 @@ pub const Window = struct {
                 return true;
             }
         }
+
+        // Anything we sent in response to events is batched up and sent
+        // once we are done processing
+        try self.client.flush();
         return false;
     }
 
+    // Sends whatever is batched up, e.g. buffer destroys made outside of
+    // service()
+    pub fn flush(self: *Window) !void {
+        try self.client.flush();
+    }
+
     pub fn getFd(self: Window) std.posix.fd_t {
         return self.client.stream.handle;
     }
@@ -382,6 +440,10 @@ pub const Window = struct {
             .modifier_lo = @truncate(modifier),
         });
 
+        // Everything buffered has to go out before the message we send
+        // directly on the socket
+        try self.client.flush();
+
         const buf_fd = front_buf.fd;
         try wlclient.sendMessageWithFdAttachment(
             self.client.stream,
@@ -390,7 +452,11 @@ pub const Window = struct {
         );
     }
 
-    pub fn swapBuffers(self: *Window, front_buf: RenderBuffer) !u32 {
+    // Creates a wl_buffer backed by the given dma-buf. Buffers are intended
+    // to be created once and re-attached with swapBuffers() for every frame
+    // they are rendered to. The fd is duplicated by the compositor and may be
+    // closed after this returns
+    pub fn createBuffer(self: *Window, front_buf: RenderBuffer) !u32 {
         const params = try self.client.newId(wlb.ZwpLinuxBufferParamsV1);
         try self.dmabuf.createParams(self.client.writer(), .{
             .params_id = params.id,
@@ -410,8 +476,21 @@ pub const Window = struct {
         try params.destroy(self.client.writer(), .{});
         self.client.removeId(params.id);
 
+        return wl_buf.id;
+    }
+
+    pub fn destroyBuffer(self: *Window, wl_buf_id: u32) !void {
+        const iface = wlb.WlBuffer{ .id = wl_buf_id };
+        try iface.destroy(self.client.writer(), .{});
+        self.client.removeId(wl_buf_id);
+    }
+
+    // Attaches and commits a buffer previously created with createBuffer().
+    // The buffer belongs to the compositor until the gl context is notified
+    // of its release
+    pub fn swapBuffers(self: *Window, wl_buf_id: u32) !void {
         try self.wl_surface.attach(self.client.writer(), .{
-            .buffer = wl_buf.id,
+            .buffer = wl_buf_id,
             .x = 0,
             .y = 0,
         });
@@ -424,14 +503,14 @@ pub const Window = struct {
         });
 
         try self.wl_surface.commit(self.client.writer(), .{});
+        try self.client.flush();
 
-        // Commit has to be the last failable call in this scope, or a bunch of
-        // errdefers will be incorrect
+        // Flushing the commit has to be the last failable call in this scope,
+        // or a bunch of errdefers will be incorrect
 
         errdefer comptime unreachable;
 
         self.wants_frame = false;
-        return wl_buf.id;
     }
 
     fn handleEvent(self: *Window, event: wlclient.Event(wlb), gl_ctx: anytype) !bool {
@@ -480,11 +559,8 @@ pub const Window = struct {
             .wl_buffer => |parsed| {
                 switch (parsed) {
                     .release => {
-                        const iface = wlb.WlBuffer{ .id = event.object_id };
-                        try iface.destroy(self.client.writer(), .{});
-
-                        self.client.removeId(event.object_id);
-
+                        // The wl_buffer stays alive, it will be attached
+                        // again the next time its buffer object comes around
                         gl_ctx.notifyGlBufferRelease(event.object_id);
                     },
                 }
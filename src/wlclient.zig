@@ -17,14 +17,20 @@ pub fn Client(comptime Bindings: type) type {
 
         const Self = @This();
 
+        // Requests are buffered until flush() is called, or until the
+        // buffer fills up. Messages are small, so a few KiB is enough to
+        // batch everything sent in response to one round of events
+        const write_buf_size = 4096;
+
         pub fn init(alloc: Allocator, expansion_alloc: sphtud.util.ExpansionAlloc) !Self {
             const stream = try openWaylandConnection();
             const display = Bindings.WlDisplay{ .id = 1 };
             const registry = Bindings.WlRegistry{ .id = 2 };
-            var stream_writer = stream.writer(&.{});
+            var stream_writer = stream.writer(try alloc.alloc(u8, write_buf_size));
             try display.getRegistry(&stream_writer.interface, .{
                 .registry = registry.id,
             });
+            try stream_writer.interface.flush();
 
             const interfaces = try InterfaceRegistry(Bindings).init(alloc, expansion_alloc, registry);
 
@@ -62,6 +68,12 @@ pub fn Client(comptime Bindings: type) type {
         pub fn writer(self: *Self) *std.Io.Writer {
             return &self.stream_writer.interface;
         }
+
+        // Sends all buffered requests. Needs to be called before waiting on
+        // a response, and before sending anything directly on the socket
+        pub fn flush(self: *Self) !void {
+            try self.stream_writer.interface.flush();
+        }
     };
 }
 
@@ -244,6 +256,9 @@ pub fn EventIt(comptime Bindings: type) type {
                 return null;
             }
             const header = std.mem.bytesToValue(HeaderLE, self.client.event_buf.data[self.client.event_buf.front..header_end]);
+            if (header.size < @sizeOf(HeaderLE)) {
+                return error.InvalidLen;
+            }
             const data_end = self.client.event_buf.front + header.size;
             if (data_end > self.client.event_buf.data.len and self.client.event_buf.front == 0) {
                 return error.DataTooLarge;
@@ -257,23 +272,13 @@ pub fn EventIt(comptime Bindings: type) type {
             const data = self.client.event_buf.data[header_end..data_end];
             const interface = self.client.interfaces.get(header.id) orelse return null;
 
-            inline for (std.meta.fields(Bindings.WaylandIncomingMessage)) |field| {
-                if (@field(Bindings.WaylandInterfaceType, field.name) == interface) {
-                    if (@hasDecl(field.type, "parse")) {
-                        return .{
-                            .object_id = header.id,
-                            .event = @unionInit(Bindings.WaylandIncomingMessage, field.name, try field.type.parse(header.op, data)),
-                        };
-                    } else {
-                        return .{
-                            .object_id = header.id,
-                            .event = @unionInit(Bindings.WaylandIncomingMessage, field.name, .{}),
-                        };
-                    }
-                }
-            }
+            const message_info = Bindings.getIncomingMessageInfo(interface, header.op) orelse return error.UnknownMessage;
+            if (!message_info.sizeValid(header.size)) return error.InvalidLen;
 
-            unreachable;
+            return .{
+                .object_id = header.id,
+                .event = try message_info.parse(data),
+            };
         }
 
         fn dataInSocket(self: *Self) !bool {
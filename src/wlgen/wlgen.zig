@@ -11,7 +11,8 @@ const attribute_max_len = 128;
 const Arg = struct {
     name: []const u8,
     summary: []const u8,
-    has_interface: bool,
+    // Interface of objects and new_ids, if the protocol pins it down
+    interface: ?[]const u8,
     typ: Type,
 
     const Type = enum {
@@ -53,7 +54,8 @@ const Arg = struct {
         var summary: []const u8 = &.{};
         errdefer alloc.free(summary);
 
-        var has_interface = false;
+        var interface: ?[]const u8 = null;
+        errdefer if (interface) |i| alloc.free(i);
 
         const ArgTag = enum { name, interface, type, summary };
 
@@ -67,7 +69,7 @@ const Arg = struct {
 
             switch (arg_tag) {
                 .name => name = try attr.val.makeContiguousAlloc(alloc),
-                .interface => has_interface = true,
+                .interface => interface = try attr.val.makeContiguousAlloc(alloc),
                 .type => {
                     var val_buf: [attribute_max_len]u8 = undefined;
                     const val = try attr.val.makeContiguousBuf(&val_buf);
@@ -80,7 +82,7 @@ const Arg = struct {
         return .{
             .name = name orelse return error.NoArgName,
             .summary = summary,
-            .has_interface = has_interface,
+            .interface = interface,
             .typ = typ orelse return error.NoArgType,
         };
     }
@@ -88,6 +90,7 @@ const Arg = struct {
     fn deinit(self: *Arg, alloc: Allocator) void {
         alloc.free(self.name);
         alloc.free(self.summary);
+        if (self.interface) |i| alloc.free(i);
     }
 };
 
@@ -518,6 +521,70 @@ fn dodgeReservedKeyword(name: []const u8) []const u8 {
     return name;
 }
 
+const wire_header_size = 8;
+const wire_max_size = std.math.maxInt(u16);
+
+const WireSize = struct {
+    min: usize,
+    max: usize,
+};
+
+fn wireSize(event: Interface.RequestEvent) WireSize {
+    var min: usize = wire_header_size;
+    var variable_len = false;
+
+    for (event.args) |arg| {
+        switch (arg.typ) {
+            .int, .uint, .fixed, .object => min += 4,
+            .new_id => {
+                min += 4;
+                if (arg.interface == null) {
+                    // interface name string + version
+                    min += 8;
+                    variable_len = true;
+                }
+            },
+            // Length prefix, contents may be empty
+            .string, .array => {
+                min += 4;
+                variable_len = true;
+            },
+            // Sent out of band
+            .fd => {},
+        }
+    }
+
+    return .{
+        .min = min,
+        .max = if (variable_len) wire_max_size else min,
+    };
+}
+
+fn numFds(event: Interface.RequestEvent) usize {
+    var ret: usize = 0;
+    for (event.args) |arg| {
+        if (arg.typ == .fd) ret += 1;
+    }
+    return ret;
+}
+
+// The new_id a message creates an object with, if any
+fn newIdArg(event: Interface.RequestEvent) ?Arg {
+    if (!allArgsHaveKnownType(event)) return null;
+
+    for (event.args) |arg| {
+        if (arg.typ == .new_id) return arg;
+    }
+    return null;
+}
+
+fn hasInterface(interfaces: []const Interface, name: []const u8) bool {
+    for (interfaces) |interface| {
+        if (std.mem.eql(u8, interface.name, name)) return true;
+    }
+    return false;
+}
+
 fn anyEventCanBeParsed(incoming: []const Interface.RequestEvent) bool {
     for (incoming) |event| {
         if (allArgsHaveKnownType(event)) {
@@ -572,7 +639,7 @@ const ZigBindingsWriter = struct {
         );
 
         for (req.args) |arg| {
-            if (arg.typ == .new_id and !arg.has_interface) {
+            if (arg.typ == .new_id and arg.interface == null) {
                 try self.writer.print(
                     "        {s}_interface: [:0]const u8,\n",
                     .{arg.name},
@@ -643,7 +710,7 @@ const ZigBindingsWriter = struct {
         try self.writeRequiresFd(event);
 
         for (event.args) |arg| {
-            if (arg.typ == .new_id and !arg.has_interface) {
+            if (arg.typ == .new_id and arg.interface == null) {
                 try self.writer.print(
                     "            {s}_interface: [:0]const u8,\n",
                     .{arg.name},
@@ -756,6 +823,166 @@ const ZigBindingsWriter = struct {
         );
     }
 
+    fn writeIncomingMessageParser(self: *ZigBindingsWriter, interface_name: []const u8, event: Interface.RequestEvent) !void {
+        try self.writer.print(
+            \\fn parse{f}{f}(data: []const u8) error{{InvalidLen}}!WaylandIncomingMessage {{
+            \\
+        , .{ snakeToPascal(interface_name), snakeToPascal(event.name) });
+
+        if (allArgsHaveKnownType(event)) {
+            try self.writer.print(
+                \\    return .{{ .{s} = .{{ .{s} = try wlio.parseDataResponse({f}.IncomingMessage.{f}, data) }} }};
+                \\
+            , .{
+                interface_name,
+                dodgeReservedKeyword(event.name),
+                snakeToPascal(interface_name),
+                snakeToPascal(event.name),
+            });
+        } else {
+            try self.writer.print(
+                \\    _ = data;
+                \\    return .{{ .{s} = .{s} }};
+                \\
+            , .{
+                interface_name,
+                dodgeReservedKeyword(event.name),
+            });
+        }
+
+        try self.writer.writeAll("}\n\n");
+    }
+
+    // Dense tables indexed by interface and opcode, so that dispatching an
+    // incoming message is a single lookup instead of a walk over every
+    // interface. Wire sizes are known up front so malformed messages can be
+    // rejected before we try to parse them
+    fn writeIncomingMessageTable(self: *ZigBindingsWriter, interfaces: []const Interface, bindings_mode: BindingsMode) !void {
+        try self.writer.writeAll(
+            \\pub const IncomingMessageInfo = struct {
+            \\    parse: *const fn (data: []const u8) error{InvalidLen}!WaylandIncomingMessage,
+            \\    // Including header
+            \\    min_size: u16,
+            \\    max_size: u16,
+            \\    num_fds: u8,
+            \\
+            \\    pub fn sizeValid(self: *const IncomingMessageInfo, size: u16) bool {
+            \\        return size >= self.min_size and size <= self.max_size;
+            \\    }
+            \\};
+            \\
+            \\pub fn getIncomingMessageInfo(interface: WaylandInterfaceType, op: u16) ?*const IncomingMessageInfo {
+            \\    const messages = incoming_messages[@intFromEnum(interface)];
+            \\    if (op >= messages.len) return null;
+            \\    return &messages[op];
+            \\}
+            \\
+            \\
+        );
+
+        for (interfaces) |interface| {
+            for (bindings_mode.incoming(interface)) |event| {
+                try self.writeIncomingMessageParser(interface.name, event);
+            }
+        }
+
+        try self.writer.writeAll(
+            \\// Indexed by @intFromEnum(WaylandInterfaceType), then by opcode
+            \\pub const incoming_messages = [_][]const IncomingMessageInfo{
+            \\
+        );
+
+        for (interfaces) |interface| {
+            const incoming = bindings_mode.incoming(interface);
+            if (incoming.len == 0) {
+                try self.writer.print("    // {s}\n    &.{{}},\n", .{interface.name});
+                continue;
+            }
+
+            try self.writer.print("    // {s}\n    &.{{\n", .{interface.name});
+            for (incoming) |event| {
+                const size = wireSize(event);
+                try self.writer.print(
+                    "        .{{ .parse = parse{f}{f}, .min_size = {d}, .max_size = {d}, .num_fds = {d} }},\n",
+                    .{ snakeToPascal(interface.name), snakeToPascal(event.name), size.min, size.max, numFds(event) },
+                );
+            }
+            try self.writer.writeAll("    },\n");
+        }
+
+        try self.writer.writeAll("};\n\n");
+    }
+
+    // Lets whoever reads messages keep track of what objects exist without
+    // handling every message that creates one
+    fn writeNewObject(self: *ZigBindingsWriter, interfaces: []const Interface, bindings_mode: BindingsMode) !void {
+        try self.writer.writeAll(
+            \\pub const NewObject = struct {
+            \\    id: u32,
+            \\    // Null if the interface is not part of these bindings
+            \\    interface: ?WaylandInterfaceType,
+            \\};
+            \\
+            \\pub fn newObject(message: WaylandIncomingMessage) ?NewObject {
+            \\    switch (message) {
+            \\
+        );
+
+        var num_creating_interfaces: usize = 0;
+        for (interfaces) |interface| {
+            const incoming = bindings_mode.incoming(interface);
+
+            var num_creating: usize = 0;
+            for (incoming) |event| {
+                if (newIdArg(event) != null) num_creating += 1;
+            }
+            if (num_creating == 0) continue;
+            num_creating_interfaces += 1;
+
+            try self.writer.print("        .{s} => |m| switch (m) {{\n", .{interface.name});
+            for (incoming) |event| {
+                const arg = newIdArg(event) orelse continue;
+                const event_name = dodgeReservedKeyword(event.name);
+
+                if (arg.interface) |new_interface| {
+                    if (hasInterface(interfaces, new_interface)) {
+                        try self.writer.print(
+                            "            .{s} => |p| return .{{ .id = p.{s}, .interface = .{s} }},\n",
+                            .{ event_name, arg.name, new_interface },
+                        );
+                    } else {
+                        try self.writer.print(
+                            "            .{s} => |p| return .{{ .id = p.{s}, .interface = null }},\n",
+                            .{ event_name, arg.name },
+                        );
+                    }
+                } else {
+                    // Untyped new_ids name their interface on the wire
+                    try self.writer.print(
+                        "            .{s} => |p| return .{{ .id = p.{s}, .interface = std.meta.stringToEnum(WaylandInterfaceType, p.{s}_interface) }},\n",
+                        .{ event_name, arg.name, arg.name },
+                    );
+                }
+            }
+            if (num_creating < incoming.len) {
+                try self.writer.writeAll("            else => {},\n");
+            }
+            try self.writer.writeAll("        },\n");
+        }
+
+        if (num_creating_interfaces < interfaces.len) {
+            try self.writer.writeAll("        else => {},\n");
+        }
+
+        try self.writer.writeAll(
+            \\    }
+            \\    return null;
+            \\}
+            \\
+            \\
+        );
+    }
+
     fn writeInterface(self: *ZigBindingsWriter, interface_name: []const u8, outgoing: []const Interface.RequestEvent, incoming: []const Interface.RequestEvent) !void {
         try self.writeInterfaceStart(interface_name);
 
@@ -831,6 +1058,20 @@ fn parseWaylandXml(alloc: Allocator, wayland_xml_path: []const u8) ![]Interface
 const BindingsMode = enum {
     client,
     server,
+
+    fn outgoing(self: BindingsMode, interface: Interface) []const Interface.RequestEvent {
+        return switch (self) {
+            .client => interface.requests,
+            .server => interface.events,
+        };
+    }
+
+    fn incoming(self: BindingsMode, interface: Interface) []const Interface.RequestEvent {
+        return switch (self) {
+            .client => interface.events,
+            .server => interface.requests,
+        };
+    }
 };
 
 const Args = struct {
@@ -900,12 +1141,12 @@ pub fn main() !void {
 
     try zig_writer.writeGetInterfaceVersion(interfaces.items);
     try zig_writer.writeEventUnion(interfaces.items);
+    try zig_writer.writeIncomingMessageTable(interfaces.items, args.bindings_mode);
+    try zig_writer.writeNewObject(interfaces.items, args.bindings_mode);
 
     for (interfaces.items) |interface| {
-        const outgoing, const incoming = switch (args.bindings_mode) {
-            .client => .{ interface.requests, interface.events },
-            .server => .{ interface.events, interface.requests },
-        };
+        const outgoing = args.bindings_mode.outgoing(interface);
+        const incoming = args.bindings_mode.incoming(interface);
         try zig_writer.writeInterface(interface.name, outgoing, incoming);
     }
 